@@ -0,0 +1,355 @@
+#ifndef INCLUDED_CONSTEXPR_FORMULA_
+#define INCLUDED_CONSTEXPR_FORMULA_
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+
+// The formula parser from precedence_test.cc, but constexpr: a formula that is a string
+// literal can be parsed (and, if it has no variables, evaluated) by the compiler.
+//
+//     constexpr auto formula = constexpr_formula::parse_formula("a * 2 + b");
+//     double value = formula.evaluate(inputs);
+//     static_assert(constexpr_formula::parse_formula("1 + 2 * 3").evaluate() == 7, "");
+//
+// The nodes live in an array inside the formula, sized by the length of the literal (every
+// node takes at least one character), and refer to each other by index. Binary operators
+// with two constant operands are folded while parsing, so only the parts that depend on
+// the inputs are left to evaluate.
+//
+// Errors go through formula_error(), which is not constexpr: in a constant expression,
+// reaching it is a compile error (that names the message); at runtime it exits, like
+// precedence_test.cc does.
+
+namespace constexpr_formula {
+
+enum token_type_t
+{
+    TOKEN_NUMBER,
+    TOKEN_PLUS,
+    TOKEN_MINUS,
+    TOKEN_DIVIDE,
+    TOKEN_MULTIPLY,
+    TOKEN_VARIABLE,
+    TOKEN_OPEN_PARENTHESIS,
+    TOKEN_CLOSE_PARENTHESIS,
+    TOKEN_END
+};
+
+struct token_t
+{
+    token_type_t token_type = TOKEN_END;
+    double value = 0;
+    char my_operator = 0;
+    uint8_t variable_index = 0; // for TOKEN_VARIABLE: a = 0, b = 1, ... z = 25.
+};
+
+struct tokenizer_t
+{
+    const char* input = nullptr;
+    size_t position = 0;
+};
+
+enum node_type_t
+{
+    NODE_TYPE_NUMBER,
+    NODE_TYPE_VARIABLE,
+    NODE_TYPE_BINARY_OP
+};
+
+// no union: only one member of a union can ever be active in a constant expression.
+struct node_t
+{
+    node_type_t type = NODE_TYPE_NUMBER;
+    double value = 0;
+    uint8_t variable_index = 0;
+    char my_operator = 0;
+    size_t lhs = 0;
+    size_t rhs = 0;
+};
+
+inline void formula_error(const char* message)
+{
+    fprintf(stderr, "formula error: %s\n", message);
+    exit(1);
+}
+
+constexpr bool is_space(char character)
+{
+    return character == ' ' || character == '\t' || character == '\n' || character == '\r' || character == '\v' || character == '\f';
+}
+
+constexpr bool is_digit(char character) { return character >= '0' && character <= '9'; }
+
+/// next_token - like the runtime one, but a number is read here: the digits are collected
+/// in an integer and divided by a power of ten once at the end. both are exact (up to 15
+/// digits), so the one rounding of the division gives the same double strtod would.
+constexpr token_t next_token(tokenizer_t& tokenizer)
+{
+    const char* input = tokenizer.input;
+    size_t position = tokenizer.position;
+    while (input[position] && is_space(input[position]))
+    {
+        ++position;
+    }
+
+    token_t token;
+    char current = input[position];
+    if (!current)
+    {
+        tokenizer.position = position;
+        return token;
+    }
+
+    if (is_digit(current) || current == '.')
+    {
+        uint64_t digits = 0;
+        size_t digit_count = 0;
+        size_t fraction_digit_count = 0;
+        bool seen_point = false;
+
+        // keep advancing until no digits.
+        while (is_digit(input[position]) || input[position] == '.')
+        {
+            if (input[position] == '.')
+            {
+                if (seen_point) formula_error("a number can only have one decimal point");
+                seen_point = true;
+            }
+            else
+            {
+                digits = digits * 10 + uint64_t(input[position] - '0');
+                digit_count += 1;
+                if (seen_point) fraction_digit_count += 1;
+            }
+            position++;
+        }
+
+        if (digit_count == 0) formula_error("a number needs at least one digit");
+        if (digit_count > 15) formula_error("a number can have at most 15 digits");
+
+        double scale = 1;
+        for (size_t idx = 0; idx != fraction_digit_count; ++idx) scale *= 10;
+
+        tokenizer.position = position;
+        token.token_type = TOKEN_NUMBER;
+        token.value = double(digits) / scale;
+        return token;
+    }
+
+    // single letter variables, these are the inputs of the formula.
+    if (current >= 'a' && current <= 'z')
+    {
+        tokenizer.position = position + 1;
+        token.token_type = TOKEN_VARIABLE;
+        token.variable_index = uint8_t(current - 'a');
+        return token;
+    }
+
+    tokenizer.position = position + 1; // start from this position next time.
+    token.my_operator = current;
+    switch (current)
+    {
+        case '+': token.token_type = TOKEN_PLUS; break;
+        case '-': token.token_type = TOKEN_MINUS; break;
+        case '*': token.token_type = TOKEN_MULTIPLY; break;
+        case '/': token.token_type = TOKEN_DIVIDE; break;
+        case '(': token.token_type = TOKEN_OPEN_PARENTHESIS; break;
+        case ')': token.token_type = TOKEN_CLOSE_PARENTHESIS; break;
+        default: formula_error("unknown character");
+    }
+    return token;
+}
+
+/// formula_t - a parsed formula of at most capacity nodes.
+template <size_t capacity>
+struct formula_t
+{
+    node_t nodes[capacity] = {};
+    size_t node_count = 0;
+    size_t root = 0;
+    uint8_t input_count = 0; // highest variable index + 1.
+
+    constexpr size_t add_node(const node_t& node)
+    {
+        if (node_count == capacity) formula_error("formula has too many nodes");
+        nodes[node_count] = node;
+        return node_count++;
+    }
+
+    constexpr double evaluate_node(size_t index, const double* inputs) const
+    {
+        const node_t& node = nodes[index];
+        switch (node.type)
+        {
+            case NODE_TYPE_NUMBER: return node.value;
+            case NODE_TYPE_VARIABLE:
+            {
+                if (!inputs) formula_error("formula has variables, but there are no inputs");
+                return inputs[node.variable_index];
+            }
+            case NODE_TYPE_BINARY_OP:
+            {
+                double lhs = evaluate_node(node.lhs, inputs);
+                double rhs = evaluate_node(node.rhs, inputs);
+                switch (node.my_operator)
+                {
+                    case '+': return lhs + rhs;
+                    case '-': return lhs - rhs;
+                    case '*': return lhs * rhs;
+                    default:  return lhs / rhs;
+                }
+            }
+        }
+
+        return 0;
+    }
+
+    /// evaluate - inputs[0] is a, inputs[1] is b, ... a formula without variables can be
+    /// evaluated without inputs.
+    constexpr double evaluate(const double* inputs = nullptr) const { return evaluate_node(root, inputs); }
+
+    constexpr bool is_constant() const { return nodes[root].type == NODE_TYPE_NUMBER; }
+};
+
+template <size_t capacity>
+struct parser_t
+{
+    tokenizer_t tokenizer;
+    token_t current_token;
+    formula_t<capacity> formula;
+};
+
+// these are just constructors
+template <size_t capacity>
+constexpr size_t create_number_node(parser_t<capacity>& parser, double value)
+{
+    node_t node;
+    node.type = NODE_TYPE_NUMBER;
+    node.value = value;
+    return parser.formula.add_node(node);
+}
+
+template <size_t capacity>
+constexpr size_t create_variable_node(parser_t<capacity>& parser, uint8_t variable_index)
+{
+    node_t node;
+    node.type = NODE_TYPE_VARIABLE;
+    node.variable_index = variable_index;
+    if (variable_index + 1 > parser.formula.input_count) parser.formula.input_count = variable_index + 1;
+    return parser.formula.add_node(node);
+}
+
+/// create_binary_operator_node - folds two constant operands into a number node instead.
+/// constant operands are single nodes, and the last two made, so their slots are reused.
+/// (a constant expression can't divide by zero, so that is an error of its own.)
+template <size_t capacity>
+constexpr size_t create_binary_operator_node(parser_t<capacity>& parser, char my_operator, size_t lhs, size_t rhs)
+{
+    formula_t<capacity>& formula = parser.formula;
+
+    node_t node;
+    node.type = NODE_TYPE_BINARY_OP;
+    node.my_operator = my_operator;
+    node.lhs = lhs;
+    node.rhs = rhs;
+
+    if (formula.nodes[lhs].type == NODE_TYPE_NUMBER && formula.nodes[rhs].type == NODE_TYPE_NUMBER)
+    {
+        if (my_operator == '/' && formula.nodes[rhs].value == 0) formula_error("division by zero");
+
+        size_t index = formula.add_node(node);
+        double value = formula.evaluate_node(index, nullptr);
+        formula.node_count = lhs < rhs ? lhs : rhs;
+        return create_number_node(parser, value);
+    }
+
+    return formula.add_node(node);
+}
+
+// <expression>    ::= <term> { ("+" | "-") <term> }
+// <term>          ::= <factor> { ("*" | "/") <factor> }
+// <factor>        ::= <number> | <variable> | "(" <expression> ")"
+// <variable>      ::= "a" | "b" | ... | "z"
+// <number>        ::= <digit> { <digit> } [ "." <digit> { <digit> } ]
+// <digit>         ::= "0" | "1" | "2" | "3" | "4" | "5" | "6" | "7" | "8" | "9"
+
+template <size_t capacity>
+constexpr size_t parse_expression(parser_t<capacity>& parser);
+
+template <size_t capacity>
+constexpr size_t parse_factor(parser_t<capacity>& parser)
+{
+    if (parser.current_token.token_type == TOKEN_NUMBER)
+    {
+        size_t node = create_number_node(parser, parser.current_token.value);
+        parser.current_token = next_token(parser.tokenizer);
+        return node;
+    }
+
+    if (parser.current_token.token_type == TOKEN_VARIABLE)
+    {
+        size_t node = create_variable_node(parser, parser.current_token.variable_index);
+        parser.current_token = next_token(parser.tokenizer);
+        return node;
+    }
+
+    if (parser.current_token.token_type == TOKEN_OPEN_PARENTHESIS)
+    {
+        parser.current_token = next_token(parser.tokenizer);
+        size_t node = parse_expression(parser);
+        if (parser.current_token.token_type != TOKEN_CLOSE_PARENTHESIS) formula_error("expected ')'");
+        parser.current_token = next_token(parser.tokenizer);
+        return node;
+    }
+
+    formula_error("expected a number, a variable or '('");
+    return 0;
+}
+
+template <size_t capacity>
+constexpr size_t parse_term(parser_t<capacity>& parser)
+{
+    size_t node = parse_factor(parser);
+    while (parser.current_token.token_type == TOKEN_MULTIPLY || parser.current_token.token_type == TOKEN_DIVIDE)
+    {
+        char op = parser.current_token.my_operator;
+        parser.current_token = next_token(parser.tokenizer);
+        size_t rhs = parse_factor(parser);
+        node = create_binary_operator_node(parser, op, node, rhs);
+    }
+    return node;
+}
+
+template <size_t capacity>
+constexpr size_t parse_expression(parser_t<capacity>& parser)
+{
+    size_t node = parse_term(parser);
+    while (parser.current_token.token_type == TOKEN_PLUS || parser.current_token.token_type == TOKEN_MINUS)
+    {
+        char op = parser.current_token.my_operator;
+        parser.current_token = next_token(parser.tokenizer);
+        size_t rhs = parse_term(parser);
+        node = create_binary_operator_node(parser, op, node, rhs);
+    }
+    return node;
+}
+
+/// parse_formula - for a string literal, the node array is as long as the literal.
+template <size_t length>
+constexpr formula_t<length> parse_formula(const char (&formula)[length])
+{
+    parser_t<length> parser;
+    parser.tokenizer.input = formula;
+    parser.current_token = next_token(parser.tokenizer);
+
+    parser.formula.root = parse_expression(parser);
+    if (parser.current_token.token_type != TOKEN_END) formula_error("unexpected input after the formula");
+
+    return parser.formula;
+}
+
+} // end namespace constexpr_formula
+
+#endif
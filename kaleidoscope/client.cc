@@ -0,0 +1,80 @@
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// The client for `parser --serve <socket>`: sends its stdin as one request and prints the
+// response the way `parser --jit` would print it (to stderr).
+//
+//     ./client /tmp/kaleidoscope.sock < input.k
+
+static bool write_all(int fd, const char* data, size_t size)
+{
+    while (size != 0)
+    {
+        ssize_t count = write(fd, data, size);
+        if (count < 0 && errno != EINTR) return false;
+        if (count > 0)
+        {
+            data += count;
+            size -= count;
+        }
+    }
+    return true;
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc != 2)
+    {
+        fprintf(stderr, "usage: %s <socket> < input\n", argv[0]);
+        return 1;
+    }
+
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (strlen(argv[1]) >= sizeof(address.sun_path))
+    {
+        fprintf(stderr, "Error: socket path %s is too long\n", argv[1]);
+        return 1;
+    }
+    strcpy(address.sun_path, argv[1]);
+
+    int connection = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (connection < 0 || connect(connection, (sockaddr*)&address, sizeof(address)) != 0)
+    {
+        fprintf(stderr, "Error: could not connect to %s: %s\n", argv[1], strerror(errno));
+        return 1;
+    }
+
+    // the whole request first: the server only starts once we are done sending.
+    char buffer[4096];
+    ssize_t count;
+    while ((count = read(STDIN_FILENO, buffer, sizeof(buffer))) != 0)
+    {
+        if (count < 0 && errno == EINTR) continue;
+        if (count < 0 || !write_all(connection, buffer, count))
+        {
+            fprintf(stderr, "Error: could not send the request: %s\n", strerror(errno));
+            return 1;
+        }
+    }
+    shutdown(connection, SHUT_WR);
+
+    while ((count = read(connection, buffer, sizeof(buffer))) != 0)
+    {
+        if (count < 0 && errno == EINTR) continue;
+        if (count < 0)
+        {
+            fprintf(stderr, "Error: could not read the response: %s\n", strerror(errno));
+            return 1;
+        }
+        write_all(STDERR_FILENO, buffer, count);
+    }
+
+    close(connection);
+    return 0;
+}
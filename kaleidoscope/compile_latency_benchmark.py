@@ -0,0 +1,73 @@
+#!/usr/bin/env python3
+"""Compare how long it takes to get a function ready to run with LLVM (--jit) and
+with the baseline compiler (--baseline).
+
+    ./compile_latency_benchmark.py build/parser --functions 2000
+
+The input defines a number of functions, every one of them a few dozen operations
+and a call to the one before it. --jit compiles every definition as soon as it is
+read, and so does --baseline. A --tiered run of the same input reads and checks the
+definitions but compiles nothing; the difference with it, divided by the number of
+functions, is the compile latency. The tier 2 threshold is out of reach, and there
+are no calls, so the baseline side never uses LLVM.
+
+Build with optimization (-DCMAKE_BUILD_TYPE=Release) for numbers that mean anything.
+"""
+
+import argparse
+import statistics
+import subprocess
+import sys
+import time
+
+
+def definition(idx):
+    body = " + ".join("x * %d - y * %d" % (term + 1, term + idx) for term in range(8))
+    if idx > 0:
+        body += " + f%d(x, y) * 0.5 < y" % (idx - 1)
+    return "def f%d(x y) %s;\n" % (idx, body)
+
+
+def program(functions):
+    return "".join(definition(idx) for idx in range(functions)).encode()
+
+
+def time_run(parser, mode, source):
+    command = [parser] + mode + ["--tier2-threshold", "1000000000"]
+    start = time.perf_counter()
+    result = subprocess.run(command, input=source, stdout=subprocess.DEVNULL, stderr=subprocess.PIPE)
+    elapsed = time.perf_counter() - start
+
+    if result.returncode != 0 or b"rror" in result.stderr:
+        sys.exit("%s failed: %s" % (" ".join(command), result.stderr.decode(errors="replace")[-2000:]))
+    return elapsed
+
+
+def per_function_latency(parser, mode, functions, runs):
+    source = program(functions)
+
+    latencies = []
+    for _ in range(runs):
+        compiling = time_run(parser, mode, source)
+        not_compiling = time_run(parser, ["--tiered"], source)
+        latencies.append((compiling - not_compiling) / functions)
+    return latencies
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("parser", help="path to the parser binary")
+    parser.add_argument("--functions", type=int, default=2000)
+    parser.add_argument("--runs", type=int, default=3)
+    arguments = parser.parse_args()
+
+    llvm = per_function_latency(arguments.parser, ["--jit"], arguments.functions, arguments.runs)
+    baseline = per_function_latency(arguments.parser, ["--baseline"], arguments.functions, arguments.runs)
+
+    for name, latencies in (("llvm", llvm), ("baseline", baseline)):
+        print("%-9s %8.1f us per function (median of %d runs)" % (name, statistics.median(latencies) * 1e6, len(latencies)))
+    print("speedup (median): %.1fx" % (statistics.median(llvm) / statistics.median(baseline)))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,94 @@
+#include "kaleidoscope.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <vector>
+
+// Times keystrokes in a big kaleidoscope::document_t: every edit is followed by asking for
+// the diagnostics, like an editor would. Afterwards the document is checked against one
+// that was parsed from scratch.
+//
+//     ./edit_benchmark [lines] [edits]
+
+static std::string make_source(size_t line_count)
+{
+    std::string source;
+    for (size_t idx = 0; idx < line_count / 4; ++idx)
+    {
+        source += "# function " + std::to_string(idx) + "\n";
+        source += "def f" + std::to_string(idx) + "(x y)\n";
+        source += "  x * " + std::to_string(idx % 97) + " + y * (x - 3)\n";
+        source += idx ? "  + f" + std::to_string(idx - 1) + "(y, x);\n" : "  + 1;\n";
+    }
+    return source;
+}
+
+static bool same_diagnostics(const std::vector<kaleidoscope::diagnostic_t> &a, const std::vector<kaleidoscope::diagnostic_t> &b)
+{
+    if (a.size() != b.size()) return false;
+    for (size_t idx = 0; idx != a.size(); ++idx)
+    {
+        if (a[idx].line != b[idx].line || a[idx].column != b[idx].column || a[idx].message != b[idx].message) return false;
+    }
+    return true;
+}
+
+int main(int argc, char* argv[])
+{
+    size_t line_count = argc > 1 ? strtoull(argv[1], NULL, 10) : 100000;
+    size_t edit_count = argc > 2 ? strtoull(argv[2], NULL, 10) : 2000;
+
+    std::string source = make_source(line_count);
+
+    auto start = std::chrono::steady_clock::now();
+    kaleidoscope::document_t document(source);
+    double open_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    printf("%zu bytes, %zu items, opened in %.1f ms\n", source.size(), document.get_item_count(), open_ms);
+
+    // typing: insert a character somewhere, sometimes one that breaks the syntax, and
+    // take it out again half of the time.
+    std::mt19937 random(42);
+    const char characters[] = "x+1 ()*;d";
+    std::vector<double> latencies;
+    size_t relexed_tokens = 0;
+    size_t reparsed_items = 0;
+    size_t diagnostic_count = 0;
+
+    for (size_t idx = 0; idx != edit_count; ++idx)
+    {
+        size_t position = random() % (document.get_text().size() + 1);
+        bool remove = idx % 2 == 1 && position < document.get_text().size();
+
+        auto edit_start = std::chrono::steady_clock::now();
+        kaleidoscope::document_t::edit_statistics_t statistics = remove
+            ? document.edit(position, position + 1, "")
+            : document.edit(position, position, std::string(1, characters[random() % (sizeof(characters) - 1)]));
+        diagnostic_count = document.get_diagnostics().size();
+        latencies.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - edit_start).count());
+
+        relexed_tokens += statistics.relexed_tokens;
+        reparsed_items += statistics.reparsed_items;
+    }
+
+    std::sort(latencies.begin(), latencies.end());
+    double total = 0;
+    for (double latency : latencies) total += latency;
+
+    printf("%zu edits: mean %.3f ms, median %.3f ms, p95 %.3f ms, max %.3f ms\n",
+        edit_count, total / edit_count, latencies[edit_count / 2], latencies[edit_count * 95 / 100], latencies.back());
+    printf("per edit: %.1f tokens relexed, %.2f items reparsed; %zu diagnostics at the end\n",
+        double(relexed_tokens) / edit_count, double(reparsed_items) / edit_count, diagnostic_count);
+
+    kaleidoscope::document_t fresh(document.get_text());
+    if (fresh.get_item_count() != document.get_item_count() || !same_diagnostics(fresh.get_diagnostics(), document.get_diagnostics()))
+    {
+        printf("MISMATCH with a document parsed from scratch\n");
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,76 @@
+#include "kaleidoscope.h"
+
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Compiles a few functions through kaleidoscope::compile(), from several threads, and shows
+// what asking for a function that was compiled before costs.
+
+static const char* const source =
+    "extern sin(x);\n"
+    "def square(x) x * x;\n"
+    "def wave(x y) sin(x) * square(y) + 1;\n";
+
+int main()
+{
+    auto start = std::chrono::steady_clock::now();
+    auto wave = kaleidoscope::compile<double(double, double)>(source, "wave");
+    auto compiled = std::chrono::steady_clock::now();
+    auto again = kaleidoscope::compile<double(double, double)>(source, "wave");
+    auto cached = std::chrono::steady_clock::now();
+
+    if (!wave)
+    {
+        fputs(wave.get_diagnostics().c_str(), stderr);
+        return 1;
+    }
+
+    printf("wave(0.5, 2) = %f\n", wave(0.5, 2));
+    printf("compile: %.1f us, cached: %.1f us, same function: %s\n",
+        std::chrono::duration<double, std::micro>(compiled - start).count(),
+        std::chrono::duration<double, std::micro>(cached - compiled).count(),
+        wave.get_address() == again.get_address() ? "yes" : "no");
+
+    // another source with a square of its own doesn't change wave's.
+    auto square = kaleidoscope::compile<double(double)>("def square(x) x * x * x;", "square");
+    printf("square(3) = %f, wave(0.5, 2) = %f\n", square(3), wave(0.5, 2));
+
+    // typed functions get their C++ types; a mismatch is an error, not a crash.
+    auto add = kaleidoscope::compile<int32_t(int32_t, int32_t)>("def add(a:i32 b:i32):i32 a + b;", "add");
+    printf("add(40, 2) = %d\n", add(40, 2));
+
+    auto wrong = kaleidoscope::compile<double(double)>("def add(a:i32 b:i32):i32 a + b;", "add");
+    printf("wrong signature: %s", wrong ? "compiled?\n" : wrong.get_diagnostics().c_str());
+
+    // a function over columns of data: every row is a call, the rows go to a thread pool.
+    std::vector<double> xs(100000), ys(100000), results(100000);
+    for (size_t row = 0; row != xs.size(); ++row)
+    {
+        xs[row] = row * 0.001;
+        ys[row] = 2;
+    }
+    const double* columns[] = {xs.data(), ys.data()};
+    std::string diagnostics;
+    if (kaleidoscope::evaluate_columns(source, "wave", columns, 2, xs.size(), results.data(), &diagnostics))
+    {
+        printf("wave over %zu rows: results[500] = %f\n", results.size(), results[500]);
+    }
+    else fputs(diagnostics.c_str(), stderr);
+
+    std::vector<std::thread> threads;
+    for (int idx = 0; idx != 4; ++idx)
+    {
+        threads.emplace_back([idx]
+        {
+            std::string formula = "def f(x) x * " + std::to_string(idx) + " + 1;";
+            auto f = kaleidoscope::compile<double(double)>(formula, "f");
+            printf("thread %d: f(10) = %f\n", idx, f(10));
+        });
+    }
+    for (std::thread &thread : threads) thread.join();
+
+    return 0;
+}
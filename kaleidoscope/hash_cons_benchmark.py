@@ -0,0 +1,92 @@
+#!/usr/bin/env python3
+"""Compare compiling generated formulas with and without --hash-cons.
+
+    ./hash_cons_benchmark.py build/parser --functions 200 --window 4
+
+Every function is a formula that is written out in full, the way a generator would:
+a list of subexpressions is built up by combining two of the last --window ones, and
+every use of one spells it out again. Both runs compile every definition (--jit); the
+time and the peak memory of the whole run are reported, so parsing is in there too.
+
+Build with optimization (-DCMAKE_BUILD_TYPE=Release) for numbers that mean anything.
+"""
+
+import argparse
+import os
+import random
+import statistics
+import subprocess
+import sys
+import tempfile
+import time
+
+
+def formula(rng, window, size):
+    """a formula of about size characters, and how many distinct operators are in it."""
+    pool = ["a", "b", "c", "(a * 0.5)", "(b - 1)"]
+    while len(pool[-1]) < size:
+        # combine two of the last few, so the text grows quickly and repeats a lot.
+        lhs = pool[-1 - rng.randrange(min(window, len(pool)))]
+        rhs = pool[-1 - rng.randrange(min(window, len(pool)))]
+        pool.append("(%s %s %s)" % (lhs, rng.choice("+-*"), rhs))
+    return pool[-1], len(pool)
+
+
+def program(functions, window, size, seed):
+    rng = random.Random(seed)
+    definitions = []
+    written, distinct = 0, 0
+    for idx in range(functions):
+        body, body_distinct = formula(rng, window, size)
+        definitions.append("def f%d(a b c) %s;\n" % (idx, body))
+        written += sum(body.count(op) for op in "+-*")
+        distinct += body_distinct
+    return "".join(definitions).encode(), written, distinct
+
+
+def run(parser, mode, source):
+    """seconds and peak resident kilobytes of one run."""
+    with tempfile.TemporaryFile() as input_file, tempfile.TemporaryFile() as error_file:
+        input_file.write(source)
+        input_file.seek(0)
+
+        # wait4 rather than wait, for the peak memory of just this child.
+        start = time.perf_counter()
+        process = subprocess.Popen([parser] + mode, stdin=input_file, stdout=subprocess.DEVNULL, stderr=error_file)
+        _, status, usage = os.wait4(process.pid, 0)
+        elapsed = time.perf_counter() - start
+        process.returncode = os.waitstatus_to_exitcode(status)
+
+        error_file.seek(0)
+        errors = error_file.read()
+
+    if process.returncode != 0 or b"rror" in errors:
+        sys.exit("%s failed: %s" % (" ".join([parser] + mode), errors.decode(errors="replace")[-2000:]))
+    return elapsed, usage.ru_maxrss
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("parser", help="path to the parser binary")
+    parser.add_argument("--functions", type=int, default=200)
+    parser.add_argument("--window", type=int, default=4, help="how far back a subexpression can reuse another")
+    parser.add_argument("--size", type=int, default=20000, help="characters per formula, roughly")
+    parser.add_argument("--runs", type=int, default=3)
+    parser.add_argument("--seed", type=int, default=1)
+    arguments = parser.parse_args()
+
+    source, written, distinct = program(arguments.functions, arguments.window, arguments.size, arguments.seed)
+    print("%d functions, %.1f MB of source, %d operators written out, at most %d distinct"
+          % (arguments.functions, len(source) / 1e6, written, distinct))
+
+    results = {}
+    for name, mode in (("tree", ["--jit"]), ("hash-cons", ["--jit", "--hash-cons"])):
+        runs = [run(arguments.parser, mode, source) for _ in range(arguments.runs)]
+        results[name] = (statistics.median(seconds for seconds, _ in runs), max(kilobytes for _, kilobytes in runs))
+        print("%-9s %8.3f s  %8.1f MB peak (median of %d runs)" % (name, results[name][0], results[name][1] / 1024, len(runs)))
+
+    print("speedup: %.1fx, memory: %.1fx less" % (results["tree"][0] / results["hash-cons"][0], results["tree"][1] / results["hash-cons"][1]))
+
+
+if __name__ == "__main__":
+    main()
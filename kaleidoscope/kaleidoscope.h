@@ -0,0 +1,167 @@
+#ifndef INCLUDED_KALEIDOSCOPE_
+#define INCLUDED_KALEIDOSCOPE_
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Compiling Kaleidoscope from C++, for programs that link the kaleidoscope library (which
+// is parser.cc without its main):
+//
+//     auto f = kaleidoscope::compile<double(double, double)>("def f(x y) x * y + 1;", "f");
+//     if (f) printf("%f\n", f(2, 3));
+//     else fputs(f.get_diagnostics().c_str(), stderr);
+//
+// The source may hold definitions and externs, and is compiled like --jit would. Every
+// source gets functions of its own: two sources that both define `f` don't see each
+// other's. The result is cached on the source, the name, the signature and the options,
+// so asking for the same function again is a hash lookup. Failures are not cached: asking
+// again compiles again, and the diagnostics of a failed compile only last until the next
+// one fails on the same thread. compile() can be called from any thread; compiling takes a
+// lock, looking up a cached result only a shared one.
+//
+// Compiled code is never thrown away, so a function stays callable for as long as the
+// program runs.
+
+namespace kaleidoscope {
+
+/// compile_options_t - the code generation options of parser that make sense per source.
+struct compile_options_t
+{
+    bool ipo = false;          // --ipo
+    bool partial_eval = false; // --partial-eval
+    bool memoize = false;      // --memoize
+    bool hash_cons = false;    // --hash-cons
+};
+
+struct compiled_symbol_t
+{
+    void* address = nullptr; // null if the source did not compile.
+    const std::string* diagnostics = nullptr; // what the front end said about the source.
+};
+
+/// compile_symbol - the untyped core of compile(). signature is the Kaleidoscope type of the
+/// function, like "r64(r64,i32)"; name has to have exactly that type.
+compiled_symbol_t compile_symbol(const std::string &source, const std::string &name, const std::string &signature, const compile_options_t &options);
+
+/// type_name - the Kaleidoscope type for a C++ parameter or return type.
+template <typename T> struct type_name;
+template <> struct type_name<uint8_t>  { static const char* get() { return "u8"; } };
+template <> struct type_name<uint16_t> { static const char* get() { return "u16"; } };
+template <> struct type_name<uint32_t> { static const char* get() { return "u32"; } };
+template <> struct type_name<uint64_t> { static const char* get() { return "u64"; } };
+template <> struct type_name<int8_t>   { static const char* get() { return "i8"; } };
+template <> struct type_name<int16_t>  { static const char* get() { return "i16"; } };
+template <> struct type_name<int32_t>  { static const char* get() { return "i32"; } };
+template <> struct type_name<int64_t>  { static const char* get() { return "i64"; } };
+template <> struct type_name<float>    { static const char* get() { return "r32"; } };
+template <> struct type_name<double>   { static const char* get() { return "r64"; } };
+
+template <typename signature_t> class function_t;
+
+/// function_t - a compiled function, called like the C++ function it is.
+template <typename return_t, typename... argument_ts>
+class function_t<return_t(argument_ts...)>
+{
+public:
+    typedef return_t (*pointer_t)(argument_ts...);
+
+private:
+    pointer_t address = nullptr;
+    const std::string* diagnostics = nullptr;
+
+public:
+    function_t() = default;
+    function_t(pointer_t address, const std::string* diagnostics) : address(address), diagnostics(diagnostics) {}
+
+    explicit operator bool() const { return address != nullptr; }
+    return_t operator()(argument_ts... arguments) const { return address(arguments...); }
+
+    pointer_t get_address() const { return address; }
+
+    const std::string &get_diagnostics() const
+    {
+        static const std::string none;
+        return diagnostics ? *diagnostics : none;
+    }
+
+    static std::string get_signature()
+    {
+        std::string signature = type_name<return_t>::get();
+        signature += "(";
+        const char* argument_names[] = {type_name<argument_ts>::get()..., nullptr};
+        for (size_t idx = 0; idx != sizeof...(argument_ts); ++idx)
+        {
+            if (idx != 0) signature += ",";
+            signature += argument_names[idx];
+        }
+        return signature + ")";
+    }
+};
+
+/// compile - the function `name` from source, typed as signature_t. empty (false) if the
+/// source doesn't compile, doesn't define name, or defines it with another type; the
+/// diagnostics say which.
+template <typename signature_t>
+function_t<signature_t> compile(const std::string &source, const std::string &name, const compile_options_t &options = {})
+{
+    typedef function_t<signature_t> result_t;
+
+    compiled_symbol_t symbol = compile_symbol(source, name, result_t::get_signature(), options);
+    return result_t((typename result_t::pointer_t)symbol.address, symbol.diagnostics);
+}
+
+/// evaluate_columns - output[row] = name(columns[0][row], columns[1][row], ...) for every
+/// row < row_count, with name compiled from source like compile() does: it has to take
+/// column_count r64s and return an r64. The rows are split over a thread pool, and the
+/// calls run through a kernel that loops over them, not through name itself. false if
+/// name can't be evaluated that way, with the reason added to diagnostics (if not null).
+bool evaluate_columns(const std::string &source, const std::string &name, const double* const* columns, size_t column_count, size_t row_count, double* output, std::string* diagnostics = nullptr, const compile_options_t &options = {});
+
+/// diagnostic_t - an error in a document. line and column count from 1.
+struct diagnostic_t
+{
+    unsigned line = 0;
+    unsigned column = 0;
+    std::string message;
+};
+
+/// document_t - the text of a source file that is being edited, kept lexed and parsed. An
+/// edit only re-lexes from the top-level item (a def or extern, with whatever follows it
+/// up to the next one) before it, up to where the tokens line up with an item after it
+/// again, and only the items in between are parsed again. The others keep their tokens
+/// and their ASTs.
+///
+/// Only the syntax is checked: nothing is compiled, so a document can't tell that a
+/// function doesn't exist. Documents share the parser with compile(), one at a time.
+class document_t
+{
+public:
+    struct edit_statistics_t
+    {
+        size_t relexed_tokens = 0;
+        size_t reparsed_items = 0;
+        size_t reused_items = 0;
+    };
+
+    explicit document_t(const std::string &text = "");
+    ~document_t();
+    document_t(const document_t &) = delete;
+    document_t &operator=(const document_t &) = delete;
+
+    /// edit - replace the bytes [begin, end) of the text.
+    edit_statistics_t edit(size_t begin, size_t end, const std::string &replacement);
+
+    const std::string &get_text() const;
+    size_t get_item_count() const;
+    std::vector<diagnostic_t> get_diagnostics() const;
+
+private:
+    struct implementation_t;
+    std::unique_ptr<implementation_t> implementation;
+};
+
+} // end namespace kaleidoscope
+
+#endif
@@ -0,0 +1,341 @@
+#ifndef INCLUDED_KALEIDOSCOPE_JIT_
+#define INCLUDED_KALEIDOSCOPE_JIT_
+
+#include "llvm/ExecutionEngine/JITEventListener.h"
+#include "llvm/ExecutionEngine/Orc/Core.h"
+#include "llvm/ExecutionEngine/Orc/ExecutionUtils.h"
+#include "llvm/ExecutionEngine/Orc/IndirectionUtils.h"
+#include "llvm/ExecutionEngine/Orc/LazyReexports.h"
+#include "llvm/ExecutionEngine/Orc/LLJIT.h"
+#include "llvm/ExecutionEngine/Orc/RTDyldObjectLinkingLayer.h"
+#include "llvm/ExecutionEngine/Orc/ThreadSafeModule.h"
+#include "llvm/ExecutionEngine/SectionMemoryManager.h"
+#include "llvm/IR/DataLayout.h"
+#include "llvm/Object/SymbolSize.h"
+
+#include <cstdio>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <unistd.h>
+
+// The JIT the REPL runs on. It is a thin layer over LLJIT: modules go into the main
+// JITDylib like they would with plain LLJIT, but every user function is reached through an
+// indirect stub named after the function. The body itself is emitted under a different
+// symbol (see function_body_name()), and the stub is pointed at it either right away
+// (eager) or at a lazy call-through trampoline that compiles the body on the first call
+// (lazy). Since callers only ever bind to the stub, we are free to re-point it later.
+
+namespace kaleidoscope {
+
+/// jit_errors_t - errors the JIT runs into where it can't return them to anyone: while it
+/// compiles a body on the first call, on whatever thread that call is on. the front end
+/// picks them up with kaleidoscope_jit::take_errors() when the call is done.
+class jit_errors_t
+{
+    std::mutex mutex;
+    std::vector<std::string> messages;
+
+public:
+    void add(llvm::Error error)
+    {
+        std::string message = llvm::toString(std::move(error));
+        std::lock_guard<std::mutex> lock(mutex);
+        messages.push_back(std::move(message));
+    }
+
+    std::vector<std::string> take()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return std::move(messages);
+    }
+};
+
+// the failure handler below has no way to get at a JIT of its own, and there is one
+// session per process anyway.
+inline jit_errors_t &jit_errors()
+{
+    static jit_errors_t errors;
+    return errors;
+}
+
+// where a call ends up when compiling the body it wanted failed, in place of the body.
+// the error itself went to jit_errors(); the caller gets NaN for a result.
+static double handle_lazy_compile_failure()
+{
+    return std::numeric_limits<double>::quiet_NaN();
+}
+
+/// perf_map_listener - writes every function the JIT loads to /tmp/perf-<pid>.map, which
+/// is where perf looks for names of code that isn't in any file.
+class perf_map_listener : public llvm::JITEventListener
+{
+    std::mutex mutex;
+    FILE* file = nullptr;
+
+public:
+    perf_map_listener()
+    {
+        std::string path = "/tmp/perf-" + std::to_string(getpid()) + ".map";
+        file = fopen(path.c_str(), "w");
+        if (!file) fprintf(stderr, "Error: could not open %s\n", path.c_str());
+    }
+
+    ~perf_map_listener() override
+    {
+        if (file) fclose(file);
+    }
+
+    void notifyObjectLoaded(ObjectKey, const llvm::object::ObjectFile &object, const llvm::RuntimeDyld::LoadedObjectInfo &info) override
+    {
+        if (!file) return;
+
+        // the copy for debuggers has the addresses the sections were loaded at.
+        llvm::object::OwningBinary<llvm::object::ObjectFile> loaded = info.getObjectForDebug(object);
+        if (!loaded.getBinary()) return;
+
+        std::lock_guard<std::mutex> lock(mutex);
+        for (const auto &symbol_and_size : llvm::object::computeSymbolSizes(*loaded.getBinary()))
+        {
+            const llvm::object::SymbolRef &symbol = symbol_and_size.first;
+            auto type = symbol.getType();
+            if (!type || *type != llvm::object::SymbolRef::ST_Function) continue;
+
+            auto name = symbol.getName();
+            auto address = symbol.getAddress();
+            if (!name || !address)
+            {
+                llvm::consumeError(name.takeError());
+                llvm::consumeError(address.takeError());
+                continue;
+            }
+
+            fprintf(file, "%llx %llx %s\n", (unsigned long long)*address, (unsigned long long)symbol_and_size.second, name->str().c_str());
+        }
+        fflush(file);
+    }
+};
+
+/// lazy_module_unit - one symbol whose module is only made when something looks the symbol
+/// up for the first time (see kaleidoscope_jit::add_lazy_module()).
+class lazy_module_unit : public llvm::orc::MaterializationUnit
+{
+public:
+    typedef std::function<llvm::Expected<llvm::orc::ThreadSafeModule>()> module_producer_t;
+
+private:
+    llvm::orc::IRLayer &layer;
+    std::string name;
+    module_producer_t produce;
+
+public:
+    lazy_module_unit(llvm::orc::IRLayer &layer, llvm::orc::SymbolStringPtr symbol, llvm::StringRef name, module_producer_t produce)
+        :
+            llvm::orc::MaterializationUnit(Interface(llvm::orc::SymbolFlagsMap{{symbol, llvm::JITSymbolFlags::Exported | llvm::JITSymbolFlags::Callable}}, nullptr)),
+            layer(layer),
+            name(name),
+            produce(std::move(produce))
+    {}
+
+    llvm::StringRef getName() const override { return name; }
+
+    void materialize(std::unique_ptr<llvm::orc::MaterializationResponsibility> responsibility) override
+    {
+        auto module = produce();
+        if (!module)
+        {
+            layer.getExecutionSession().reportError(module.takeError());
+            responsibility->failMaterialization();
+            return;
+        }
+
+        layer.emit(std::move(responsibility), std::move(*module));
+    }
+
+private:
+    // nothing was made yet, so there is nothing to throw away.
+    void discard(const llvm::orc::JITDylib &, const llvm::orc::SymbolStringPtr &) override {}
+};
+
+class kaleidoscope_jit
+{
+    // before the jit, so it is still there while the jit goes away.
+    std::unique_ptr<perf_map_listener> perf_map;
+
+    std::unique_ptr<llvm::orc::LLJIT> jit;
+    std::unique_ptr<llvm::orc::LazyCallThroughManager> lazy_call_through_manager;
+    std::unique_ptr<llvm::orc::IndirectStubsManager> stubs_manager;
+
+    kaleidoscope_jit(
+        std::unique_ptr<perf_map_listener> perf_map,
+        std::unique_ptr<llvm::orc::LLJIT> jit,
+        std::unique_ptr<llvm::orc::LazyCallThroughManager> lazy_call_through_manager,
+        std::unique_ptr<llvm::orc::IndirectStubsManager> stubs_manager)
+        :
+            perf_map(std::move(perf_map)),
+            jit(std::move(jit)),
+            lazy_call_through_manager(std::move(lazy_call_through_manager)),
+            stubs_manager(std::move(stubs_manager))
+    {}
+
+public:
+    /// create - with profile, tell perf about the code we load: names through a perf map,
+    /// and names plus line numbers (from the debug info, if any) through a jitdump file
+    /// for `perf inject --jit`.
+    static llvm::Expected<std::unique_ptr<kaleidoscope_jit>> create(bool profile = false)
+    {
+        llvm::orc::LLJITBuilder builder;
+        std::unique_ptr<perf_map_listener> perf_map;
+        if (profile)
+        {
+            perf_map = std::make_unique<perf_map_listener>();
+
+            std::vector<llvm::JITEventListener*> listeners = {perf_map.get()};
+            if (llvm::JITEventListener* jitdump = llvm::JITEventListener::createPerfJITEventListener()) listeners.push_back(jitdump);
+
+            builder.setObjectLinkingLayerCreator([listeners](llvm::orc::ExecutionSession &session, const llvm::Triple &) -> llvm::Expected<std::unique_ptr<llvm::orc::ObjectLayer>>
+            {
+                auto layer = std::make_unique<llvm::orc::RTDyldObjectLinkingLayer>(session, [] { return std::make_unique<llvm::SectionMemoryManager>(); });
+                for (llvm::JITEventListener* listener : listeners) layer->registerJITEventListener(*listener);
+                return std::unique_ptr<llvm::orc::ObjectLayer>(std::move(layer));
+            });
+        }
+
+        auto jit = builder.create();
+        if (!jit) return jit.takeError();
+        (*jit)->getExecutionSession().setErrorReporter([](llvm::Error error) { jit_errors().add(std::move(error)); });
+
+        // resolve externs (sin, cos, ...) against the symbols of this process.
+        auto process_symbols = llvm::orc::DynamicLibrarySearchGenerator::GetForCurrentProcess((*jit)->getDataLayout().getGlobalPrefix());
+        if (!process_symbols) return process_symbols.takeError();
+        (*jit)->getMainJITDylib().addGenerator(std::move(*process_symbols));
+
+        const llvm::Triple &triple = (*jit)->getTargetTriple();
+        auto lazy_call_through_manager = llvm::orc::createLocalLazyCallThroughManager(
+            triple,
+            (*jit)->getExecutionSession(),
+            llvm::pointerToJITTargetAddress(&handle_lazy_compile_failure));
+        if (!lazy_call_through_manager) return lazy_call_through_manager.takeError();
+
+        auto stubs_manager = llvm::orc::createLocalIndirectStubsManagerBuilder(triple)();
+
+        return std::unique_ptr<kaleidoscope_jit>(new kaleidoscope_jit(
+            std::move(perf_map),
+            std::move(*jit),
+            std::move(*lazy_call_through_manager),
+            std::move(stubs_manager)));
+    }
+
+    const llvm::DataLayout &get_data_layout() const { return jit->getDataLayout(); }
+
+    /// take_errors - what went wrong since the last call, where nobody could be told right
+    /// away (a lazy compile that failed, say).
+    std::vector<std::string> take_errors() { return jit_errors().take(); }
+
+    llvm::orc::JITDylib &get_main_jit_dylib() { return jit->getMainJITDylib(); }
+
+    llvm::orc::ResourceTrackerSP create_resource_tracker() { return jit->getMainJITDylib().createResourceTracker(); }
+
+    /// add_module - hand a module to the JIT. nothing is compiled until one of its symbols
+    /// is looked up.
+    llvm::Error add_module(llvm::orc::ThreadSafeModule thread_safe_module, llvm::orc::ResourceTrackerSP tracker = nullptr)
+    {
+        if (!tracker) tracker = create_resource_tracker();
+        return jit->addIRModule(tracker, std::move(thread_safe_module));
+    }
+
+    /// add_object - hand the JIT an object file that was compiled from one of our modules
+    /// somewhere else (see the pipelined driver).
+    llvm::Error add_object(std::unique_ptr<llvm::MemoryBuffer> object, llvm::orc::ResourceTrackerSP tracker = nullptr)
+    {
+        if (!tracker) tracker = create_resource_tracker();
+        return jit->addObjectFile(tracker, std::move(object));
+    }
+
+    /// add_lazy_module - define the symbol `name` without any code behind it yet: produce
+    /// is asked for the module that defines it on the first lookup, from whatever thread
+    /// that happens on.
+    llvm::Error add_lazy_module(llvm::StringRef name, lazy_module_unit::module_producer_t produce, llvm::orc::ResourceTrackerSP tracker = nullptr)
+    {
+        if (!tracker) tracker = create_resource_tracker();
+        return tracker->getJITDylib().define(
+            std::make_unique<lazy_module_unit>(jit->getIRTransformLayer(), jit->mangleAndIntern(name), name, std::move(produce)),
+            tracker);
+    }
+
+    /// define_host_symbol - make a function of this process callable from JIT'd code.
+    llvm::Error define_host_symbol(llvm::StringRef name, void* address)
+    {
+        llvm::orc::SymbolMap symbols;
+        symbols[jit->mangleAndIntern(name)] = llvm::JITEvaluatedSymbol(
+            llvm::pointerToJITTargetAddress(address),
+            llvm::JITSymbolFlags::Exported | llvm::JITSymbolFlags::Callable);
+        return jit->getMainJITDylib().define(llvm::orc::absoluteSymbols(std::move(symbols)));
+    }
+
+    llvm::Expected<llvm::JITTargetAddress> lookup(llvm::StringRef name)
+    {
+        auto symbol = jit->lookup(name);
+        if (!symbol) return symbol.takeError();
+        return symbol->getAddress();
+    }
+
+    bool has_stub(llvm::StringRef name)
+    {
+        return bool(stubs_manager->findStub(name, true));
+    }
+
+    /// define_stub - create the stub `name`, pointing at target, and export it from the
+    /// main JITDylib so that calls to `name` from any module go through it.
+    llvm::Error define_stub(llvm::StringRef name, llvm::JITTargetAddress target)
+    {
+        if (auto error = stubs_manager->createStub(name, target, llvm::JITSymbolFlags::Exported | llvm::JITSymbolFlags::Callable))
+        {
+            return error;
+        }
+
+        llvm::orc::SymbolMap symbols;
+        symbols[jit->mangleAndIntern(name)] = stubs_manager->findStub(name, true);
+        return jit->getMainJITDylib().define(llvm::orc::absoluteSymbols(std::move(symbols)));
+    }
+
+    /// get_stub_address - where the stub `name` is, without a lookup in the JITDylib.
+    llvm::JITTargetAddress get_stub_address(llvm::StringRef name)
+    {
+        return stubs_manager->findStub(name, true).getAddress();
+    }
+
+    llvm::Error update_stub(llvm::StringRef name, llvm::JITTargetAddress target)
+    {
+        return stubs_manager->updatePointer(name, target);
+    }
+
+    /// get_lazy_trampoline - an address that, when called, looks up (and so compiles)
+    /// body_name, re-points the stub `stub_name` at the result and then jumps to it.
+    llvm::Expected<llvm::JITTargetAddress> get_lazy_trampoline(const std::string &stub_name, llvm::StringRef body_name)
+    {
+        return lazy_call_through_manager->getCallThroughTrampoline(
+            jit->getMainJITDylib(),
+            jit->mangleAndIntern(body_name),
+            [this, stub_name](llvm::JITTargetAddress resolved_address) -> llvm::Error
+            {
+                return update_stub(stub_name, resolved_address);
+            });
+    }
+};
+
+/// function_body_name - the symbol a user function's body is emitted under. the plain name
+/// belongs to the stub. a function that is redefined gets a new body name every time, so
+/// the new body can be in place before the old one goes away.
+inline std::string function_body_name(const std::string &name, unsigned version = 0)
+{
+    if (version == 0) return name + ".body";
+    return name + ".body." + std::to_string(version);
+}
+
+} // end namespace kaleidoscope
+
+#endif
@@ -2,23 +2,160 @@
 #include "llvm/ADT/STLExtras.h"
 #include "llvm/IR/BasicBlock.h"
 #include "llvm/IR/Constants.h"
+#include "llvm/IR/DIBuilder.h"
 #include "llvm/IR/DerivedTypes.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/InstIterator.h"
 #include "llvm/IR/LLVMContext.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/Type.h"
 #include "llvm/IR/Verifier.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Analysis/TargetLibraryInfo.h"
+#include "llvm/ExecutionEngine/Orc/CompileUtils.h"
+#include "llvm/ExecutionEngine/Orc/JITTargetMachineBuilder.h"
+#include "llvm/Support/DynamicLibrary.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Transforms/IPO/ArgumentPromotion.h"
+#include "llvm/Transforms/IPO/DeadArgumentElimination.h"
+#include "llvm/Transforms/IPO/ElimAvailExtern.h"
+#include "llvm/Transforms/IPO/GlobalDCE.h"
+#include "llvm/Transforms/IPO/Internalize.h"
+#include "llvm/Transforms/IPO/SCCP.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/MC/TargetRegistry.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/FormatVariadic.h"
+#include "llvm/Support/Host.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Target/TargetMachine.h"
+#include "llvm/Target/TargetOptions.h"
+
+#include "kaleidoscope.h"
+#include "kaleidoscope_jit.h"
+#include "spsc_queue.h"
+#include "work_stealing_pool.h"
+#include "x86_64_assembler.h"
+#include "../old/types.h"
 
 
 #include <string>
 #include <vector>
 #include <memory>
 #include <map>
+#include <set>
+#include <cstring>
+#include <cassert>
+#include <cerrno>
+#include <fstream>
+#include <cmath>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+#include <unordered_map>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
 
 using namespace std;
 using namespace llvm; 
 
+//===----------------------------------------------------------------------===//
+// Command line options
+//===----------------------------------------------------------------------===//
+
+enum emit_kind_t
+{
+    EMIT_BITCODE,
+    EMIT_OBJECT
+};
+
+/// options_t - everything we pick up from the command line.
+struct options_t
+{
+    // streaming: instead of keeping every function in memory until exit, write the module
+    // out every flush_function_count functions or flush_megabytes (estimated) megabytes.
+    bool stream = false;
+    std::string stream_prefix;
+    emit_kind_t emit_kind = EMIT_BITCODE;
+    size_t flush_function_count = 1000;
+    size_t flush_megabytes = 64;
+
+    // jit: evaluate top-level expressions instead of just printing their IR.
+    // lazy: only compile a function the first time it is called.
+    bool jit = false;
+    bool lazy = false;
+
+    // tiered: interpret first, compile a function once it was called tier1_threshold
+    // times and recompile it optimized after tier2_threshold calls.
+    bool tiered = false;
+    uint64_t tier1_threshold = 100;
+    uint64_t tier2_threshold = 10000;
+
+    // baseline: with tiered, compile definitions straight to machine code (no LLVM)
+    // instead of interpreting them, and go from there to the optimized tier 2.
+    bool baseline = false;
+
+    // memoize: give every function that is provably pure a cache of memo_table_size
+    // (a power of two) entries, keyed on the bits of its arguments.
+    bool memoize = false;
+    size_t memo_table_size = 4096;
+
+    // ipo: inline and clean up across function boundaries. exports: the functions an
+    // AOT module has to keep; if there are any, everything else can be internalized.
+    bool ipo = false;
+    std::set<std::string> exports;
+
+    // partial_eval: evaluate calls of pure functions with constant arguments at compile
+    // time, and specialize functions on the arguments that are constant.
+    bool partial_eval = false;
+
+    // hash_cons: parse repeats of an expression within a definition into references to
+    // the first one, so code is generated for it once.
+    bool hash_cons = false;
+
+    // batch_expressions: compile and run up to this many consecutive top-level
+    // expressions together (0: one at a time).
+    size_t batch_expressions = 0;
+
+    // batch_threads: run the expressions of a batch on this many threads (0: on the main
+    // thread, one after the other).
+    size_t batch_threads = 0;
+
+    // pipeline: parse, generate IR and compile on threads of their own.
+    bool pipeline = false;
+
+    // library_output: write the definitions to this function library instead of printing
+    // the module. libraries: function libraries to load before reading the input.
+    std::string library_output;
+    std::vector<std::string> libraries;
+
+    // debug_info: describe functions and source lines in DWARF. profile: also tell perf
+    // about JIT'd code. source_path: read this file instead of stdin (and name it in
+    // the debug info).
+    bool debug_info = false;
+    bool profile = false;
+    std::string source_path;
+
+    // serve_path: instead of reading stdin, run what clients send to this Unix socket,
+    // handling up to serve_threads connections at a time.
+    std::string serve_path;
+    size_t serve_threads = 4;
+
+    // map: after reading the input, evaluate map_function over every row of map_path.
+    std::string map_function;
+    std::string map_path;
+};
+
+static options_t g_options;
+
+
 // The lexer returns tokens [0-255] if it is an unknown character, otherwise one
 // of these for known things.
 enum Token {
@@ -35,6 +172,57 @@ enum Token {
 
 static string g_identifier_string; // Filled in if TOKEN_IDENTIFIER (wow, so not part of a union?)
 static double g_number_value;  
+static std::string g_number_string; // the digits of the number, for integer literals.
+static std::string g_number_suffix; // the type suffix of the number (42i32), if any.
+static int g_last_character = ' '; // read but not yet part of a token.
+static FILE* g_input = nullptr; // where the lexer reads from, if not stdin.
+
+/// source_location_t - line and column (both from 1) in the input.
+struct source_location_t
+{
+    unsigned line = 0;
+    unsigned column = 0;
+};
+
+static source_location_t g_last_character_location = {1, 0};
+static source_location_t g_token_location; // where the current token starts.
+
+
+//===----------------------------------------------------------------------===//
+// Types
+//===----------------------------------------------------------------------===//
+
+// Values are r64 unless a prototype or literal says otherwise: `def f(n:i32 x:r32):i64`,
+// `42u8`, `1.5r32`. The names are the ones from internal_type_strings. TYPE_BOOL is what
+// comparisons produce; it can be used as an annotation too.
+
+/// find_internal_type - the type with the given name, or TYPE_INVALID.
+static internal_types find_internal_type(const std::string &name)
+{
+    for (int idx = TYPE_INVALID + 1; idx != TYPE_ELEMENT_COUNT; ++idx)
+    {
+        if (name == internal_type_strings[idx]) return (internal_types)idx;
+    }
+
+    return TYPE_INVALID;
+}
+
+static bool is_float_type(internal_types type) { return type == TYPE_R32 || type == TYPE_R64; }
+static bool is_integer_type(internal_types type) { return type >= TYPE_U8 && type <= TYPE_I64; }
+static bool is_signed_type(internal_types type) { return type >= TYPE_I8 && type <= TYPE_I64; }
+
+static unsigned type_bits(internal_types type)
+{
+    switch (type)
+    {
+        case TYPE_U8:  case TYPE_I8:  return 8;
+        case TYPE_U16: case TYPE_I16: return 16;
+        case TYPE_U32: case TYPE_I32: case TYPE_R32: return 32;
+        case TYPE_U64: case TYPE_I64: case TYPE_R64: return 64;
+        case TYPE_BOOL: return 1;
+        default: return 0;
+    }
+}
 
 
 //===----------------------------------------------------------------------===//
@@ -43,23 +231,88 @@ static double g_number_value;
 
 namespace {
 
+struct function_record_t;
+struct fold_frame_t;
+struct baseline_function_t;
+
 /// expr_ast - Base class for all expression nodes.
 class expr_ast
 {
+protected:
+    // the type of the value codegen() produced.
+    internal_types type = TYPE_R64;
+
+    // where in the source the expression is: nodes are made while their first token (or
+    // for operators and calls, a later one) is current, so they have to say otherwise.
+    source_location_t location = g_token_location;
+
 public:
     virtual ~expr_ast() = default;
     virtual Value* codegen() = 0; // inheritance != polymorphism :~)
+    internal_types get_type() const { return type; }
+    source_location_t get_location() const { return location; }
+
+    // whether this expression spells out a type anywhere (a suffixed literal). the
+    // interpreter, memoization and partial evaluation only know about doubles.
+    virtual bool is_typed() const = 0;
+
+    // an unsuffixed literal takes on the type of what it is combined with, if its value
+    // survives that: no fraction for an integer type, and in range.
+    virtual bool is_untyped_literal() const { return false; }
+    virtual bool fits_type(internal_types type) const { return true; }
+
+    // interpreter (see "Tiered execution" below). bind resolves variables to argument
+    // slots and callees to their records, and reports the same errors codegen would.
+    virtual bool bind(const std::vector<std::string> &parameters) = 0;
+    virtual double evaluate(const double* arguments) = 0;
+
+    // the names of all functions called anywhere in this expression.
+    virtual void collect_callees(std::set<std::string> &callees) const = 0;
+
+    // compile time evaluation (see "Partial evaluation" below). false if the value can't
+    // be known, or finding it out went over budget.
+    virtual bool fold(const fold_frame_t &frame, double &result) const = 0;
+
+    // machine code that leaves the value in xmm0 (see "Baseline compiler" below). only
+    // for bound expressions.
+    virtual void emit_baseline(baseline_function_t &function) const = 0;
+
+    // hash consing (see "Hash consing" below). the key says what the expression is, in
+    // terms of the canonical nodes of its operands; false if it can't be shared.
+    virtual bool append_hash_cons_key(std::string &key) const = 0;
+    virtual const expr_ast* get_canonical() const { return this; }
+
+    // codegen() for the operand of an operator or a call. with --hash-cons a node can be
+    // the operand of several, and the others reuse the value it left in the block.
+    Value* codegen_operand();
+    Value* get_generated_value(BasicBlock* block) const { return block == generated_block ? generated_value : nullptr; }
+
+private:
+    Value* generated_value = nullptr;
+    BasicBlock* generated_block = nullptr;
 };
 
 /// number_expr_ast - Expression class for numeric literals like "1.0".
 class number_expr_ast : public expr_ast
 {
   double value;
+  uint64_t integer_value;
+  internal_types literal_type;
+  bool has_suffix;
 
 public:
-  number_expr_ast(double value) : value(value) {}
+  number_expr_ast(double value, uint64_t integer_value = 0, internal_types literal_type = TYPE_R64, bool has_suffix = false)
+      : value(value), integer_value(integer_value), literal_type(literal_type), has_suffix(has_suffix) {}
   Value* codegen() override;
-
+  bool is_typed() const override { return has_suffix; }
+  bool is_untyped_literal() const override { return !has_suffix; }
+  bool fits_type(internal_types type) const override;
+  bool bind(const std::vector<std::string> &parameters) override;
+  double evaluate(const double* arguments) override;
+  void collect_callees(std::set<std::string> &callees) const override {}
+  bool fold(const fold_frame_t &frame, double &result) const override;
+  void emit_baseline(baseline_function_t &function) const override;
+  bool append_hash_cons_key(std::string &key) const override;
 };
 
 
@@ -68,10 +321,21 @@ public:
 class variable_expr_ast : public expr_ast
 {
     std::string name;
+    size_t argument_index = 0;
 
 public:
-    variable_expr_ast(const std::string &name) : name(name) {}
+    variable_expr_ast(const std::string &name, source_location_t location) : name(name)
+    {
+        this->location = location;
+    }
     Value* codegen() override;
+    bool is_typed() const override { return false; }
+    bool bind(const std::vector<std::string> &parameters) override;
+    double evaluate(const double* arguments) override;
+    void collect_callees(std::set<std::string> &callees) const override {}
+    bool fold(const fold_frame_t &frame, double &result) const override;
+    void emit_baseline(baseline_function_t &function) const override;
+    bool append_hash_cons_key(std::string &key) const override;
 };
 
 /// binary_expr_ast - Expression class for a binary operator.
@@ -82,10 +346,26 @@ class binary_expr_ast : public expr_ast
 
 public:
     binary_expr_ast(char op, std::unique_ptr<expr_ast> lhs,
-                std::unique_ptr<expr_ast> rhs)
-      : op(op), lhs(std::move(lhs)), rhs(std::move(rhs)) {}
+                std::unique_ptr<expr_ast> rhs, source_location_t location)
+      : op(op), lhs(std::move(lhs)), rhs(std::move(rhs))
+    {
+        this->location = location;
+    }
 
     Value* codegen() override;
+    bool bind(const std::vector<std::string> &parameters) override;
+    double evaluate(const double* arguments) override;
+    bool is_typed() const override { return lhs->is_typed() || rhs->is_typed(); }
+
+    void collect_callees(std::set<std::string> &callees) const override
+    {
+        lhs->collect_callees(callees);
+        rhs->collect_callees(callees);
+    }
+
+    bool fold(const fold_frame_t &frame, double &result) const override;
+    void emit_baseline(baseline_function_t &function) const override;
+    bool append_hash_cons_key(std::string &key) const override;
 };
 
 /// call_expr_ast - Expression class for function calls.
@@ -93,14 +373,71 @@ class call_expr_ast : public expr_ast
 {
   std::string callee;
   std::vector<std::unique_ptr<expr_ast>> arguments;
+  function_record_t* callee_record = nullptr;
 
 public:
   call_expr_ast(const std::string &callee,
-              std::vector<std::unique_ptr<expr_ast>> arguments)
-      : callee(callee), arguments(std::move(arguments)) {}
+              std::vector<std::unique_ptr<expr_ast>> arguments, source_location_t location)
+      : callee(callee), arguments(std::move(arguments))
+  {
+      this->location = location;
+  }
+
+
+    Value* codegen() override;
+    bool bind(const std::vector<std::string> &parameters) override;
+    double evaluate(const double* arguments) override;
+
+    bool is_typed() const override
+    {
+        for (auto &argument : arguments)
+        {
+            if (argument->is_typed()) return true;
+        }
+        return false;
+    }
+
+    void collect_callees(std::set<std::string> &callees) const override
+    {
+        callees.insert(callee);
+        for (auto &argument : arguments) argument->collect_callees(callees);
+    }
+
+    bool fold(const fold_frame_t &frame, double &result) const override;
+    void emit_baseline(baseline_function_t &function) const override;
+    bool append_hash_cons_key(std::string &key) const override;
+};
+
+/// shared_expr_ast - with --hash-cons, a repeat of an expression that was parsed before in
+/// the same definition. the expression itself is owned by the tree it was parsed in, and
+/// always comes before the repeat in it, so codegen() finds its value already there.
+class shared_expr_ast : public expr_ast
+{
+    expr_ast* target;
 
+public:
+    shared_expr_ast(expr_ast* target, source_location_t location) : target(target)
+    {
+        this->location = location;
+    }
 
     Value* codegen() override;
+    bool is_typed() const override { return target->is_typed(); }
+    bool is_untyped_literal() const override { return target->is_untyped_literal(); }
+    bool fits_type(internal_types type) const override { return target->fits_type(type); }
+
+    // the target binds itself, and reports its own callees, where it is in the tree.
+    bool bind(const std::vector<std::string> &parameters) override { return true; }
+    void collect_callees(std::set<std::string> &callees) const override {}
+
+    // the interpreter, the folder and the baseline compiler just do the work again.
+    double evaluate(const double* arguments) override { return target->evaluate(arguments); }
+    bool fold(const fold_frame_t &frame, double &result) const override { return target->fold(frame, result); }
+    void emit_baseline(baseline_function_t &function) const override { target->emit_baseline(function); }
+
+    // repeats are never interned themselves; their parents are, by the target.
+    bool append_hash_cons_key(std::string &key) const override { return false; }
+    const expr_ast* get_canonical() const override { return target; }
 };
 
 /// prototype_ast - This class represents the "prototype" for a function,
@@ -110,32 +447,78 @@ class prototype_ast
 {
   std::string name;
   std::vector<std::string> arguments;
+  std::vector<internal_types> argument_types;
+  internal_types return_type;
 
 public:
-  prototype_ast(const std::string &name, std::vector<std::string> arguments)
-      : name(name), arguments(std::move(arguments)) {}
+  prototype_ast(const std::string &name, std::vector<std::string> arguments,
+                std::vector<internal_types> argument_types = {}, internal_types return_type = TYPE_R64)
+      : name(name), arguments(std::move(arguments)), argument_types(std::move(argument_types)), return_type(return_type)
+  {
+      // no annotations: everything is a double.
+      this->argument_types.resize(this->arguments.size(), TYPE_R64);
+  }
 
 
     Function* codegen();
     const std::string &getName() const { return name; }
+    void set_name(const std::string &name) { this->name = name; }
+    const std::vector<std::string> &get_arguments() const { return arguments; }
+    internal_types get_argument_type(size_t idx) const { return argument_types[idx]; }
+    internal_types get_return_type() const { return return_type; }
+
+    bool is_all_r64() const
+    {
+        for (internal_types type : argument_types)
+        {
+            if (type != TYPE_R64) return false;
+        }
+        return return_type == TYPE_R64;
+    }
 };
 
 /// function_ast - This class represents a function definition itself.
 class function_ast {
   std::unique_ptr<prototype_ast> prototype;
   std::unique_ptr<expr_ast> body;
+  source_location_t location; // of the `def`, or the start of a top-level expression.
 
 public:
   function_ast(std::unique_ptr<prototype_ast> prototype,
-              std::unique_ptr<expr_ast> body)
-      : prototype(std::move(prototype)), body(std::move(body)) {}
+              std::unique_ptr<expr_ast> body, source_location_t location)
+      : prototype(std::move(prototype)), body(std::move(body)), location(location) {}
 
     Function* codegen();
+    const prototype_ast &get_prototype() const { return *prototype; }
+    bool is_typed() const { return !prototype->is_all_r64() || body->is_typed(); }
+    expr_ast &get_body() { return *body; }
+    const expr_ast &get_body() const { return *body; }
+    source_location_t get_location() const { return location; }
 };
 
 } // end anonymous namespace
 
 
+/// read_character - getchar (or from g_input), keeping track of where in the input we are.
+static int read_character()
+{
+    if (g_last_character == '\n')
+    {
+        g_last_character_location.line += 1;
+        g_last_character_location.column = 1;
+    }
+    else
+    {
+        g_last_character_location.column += 1;
+    }
+
+    return g_input ? getc(g_input) : getchar();
+}
+
+// a document (see "Incremental documents") hands the parser tokens it lexed before.
+static int replay_token();
+static bool g_replaying_tokens = false;
+
 //@NOTE(SJM): I hate this naming convention. what is current token vs get_token???
 /// get_token - Return the next(!!!!) token from standard input. the çurrent" token is just stored in g_current_token.
 // we just return an enum value, and the client knows that for specific tokens,
@@ -143,21 +526,22 @@ public:
 // that seems like an awful thing but whatever.
 static int get_token()
 {
-    
-    static int last_character = ' ';
+    if (g_replaying_tokens) return replay_token();
+
     // Skip any whitespace.
-    while (isspace(last_character))
+    while (isspace(g_last_character))
     {
-     last_character = getchar();
+     g_last_character = read_character();
     }
+    g_token_location = g_last_character_location;
 
-    if (isalpha(last_character)) // identifier: [a-zA-Z][a-zA-Z0-9]*
+    if (isalpha(g_last_character)) // identifier: [a-zA-Z][a-zA-Z0-9]*
     { 
-        g_identifier_string = last_character;
+        g_identifier_string = g_last_character;
 
-        while (isalnum((last_character = getchar())))
+        while (isalnum((g_last_character = read_character())))
         {
-            g_identifier_string += last_character;
+            g_identifier_string += g_last_character;
         }
 
         if (g_identifier_string == "def") return TOKEN_DEF;
@@ -166,37 +550,46 @@ static int get_token()
         return TOKEN_IDENTIFIER;
     }
 
-    if (isdigit(last_character) || last_character == '.')
+    if (isdigit(g_last_character) || g_last_character == '.')
     {   // Number: [0-9.]+
         std::string number_string;
         do
         {
-            number_string += last_character;
-            last_character = getchar();
-        } while (isdigit(last_character) || last_character == '.');
+            number_string += g_last_character;
+            g_last_character = read_character();
+        } while (isdigit(g_last_character) || g_last_character == '.');
+
+        // type suffix: [a-zA-Z][a-zA-Z0-9]*
+        g_number_suffix.clear();
+        while (isalnum(g_last_character))
+        {
+            g_number_suffix += g_last_character;
+            g_last_character = read_character();
+        }
 
+      g_number_string = number_string;
       g_number_value = strtod(number_string.c_str(), 0);
       return TOKEN_NUMBER;
     }
 
 
-    if (last_character == '#')
+    if (g_last_character == '#')
     {
         do
         {
-            last_character = getchar();
-        } while(last_character != EOF && last_character != '\n' && last_character != '\r');
+            g_last_character = read_character();
+        } while(g_last_character != EOF && g_last_character != '\n' && g_last_character != '\r');
 
 
-        if (last_character != EOF) return get_token();
+        if (g_last_character != EOF) return get_token();
     }
 
     // Check for end of file.  Don't eat the EOF.
-    if (last_character == EOF) return TOKEN_EOF;
+    if (g_last_character == EOF) return TOKEN_EOF;
 
     // Otherwise, just return the character as its ascii value.
-    int this_character = last_character;
-    last_character = getchar();
+    int this_character = g_last_character;
+    g_last_character = read_character();
      
     return this_character;
 }
@@ -209,12 +602,143 @@ static int get_next_token() {
     return g_current_token;
 }
 
-/// log_error* - These are little helper functions for error handling.
-std::unique_ptr<expr_ast> log_error(const char *message)
+/// skip_to_next_item - error recovery: drop the rest of an item that didn't parse, up to
+/// the next `def` or `extern`, or up to and including the next `;`. skipping a token at a
+/// time would parse the leftovers as top-level expressions and report errors about those
+/// too. the same goes for an item that parsed but didn't compile: in `foo() bad;`, `bad`
+/// is part of the mistake, not an expression of its own.
+///
+/// this reads characters, not tokens: all it has to find are comments, the two keywords
+/// and semicolons, so it doesn't build identifiers or convert numbers on the way.
+static void skip_to_next_item()
+{
+    if (g_current_token == TOKEN_DEF || g_current_token == TOKEN_EXTERN || g_current_token == TOKEN_EOF) return;
+
+    // a document's tokens were lexed before, there are no characters to read.
+    if (g_replaying_tokens)
+    {
+        while (g_current_token != ';' && g_current_token != TOKEN_DEF && g_current_token != TOKEN_EXTERN && g_current_token != TOKEN_EOF)
+        {
+            get_next_token();
+        }
+        if (g_current_token == ';') get_next_token();
+        return;
+    }
+
+    if (g_current_token == ';')
+    {
+        get_next_token();
+        return;
+    }
+
+    // a keyword can't start in the middle of an identifier, or in the type suffix of a
+    // number (like get_token, this counts a '.' as the start of one).
+    bool in_word = false;
+    while (g_last_character != EOF)
+    {
+        if (g_last_character == '#')
+        {
+            while (g_last_character != EOF && g_last_character != '\n' && g_last_character != '\r')
+            {
+                g_last_character = read_character();
+            }
+            in_word = false;
+            continue;
+        }
+
+        if (g_last_character == ';')
+        {
+            g_last_character = read_character();
+            get_next_token();
+            return;
+        }
+
+        if (isalpha(g_last_character) && !in_word)
+        {
+            source_location_t location = g_last_character_location;
+            char word[sizeof("extern")];
+            size_t length = 0;
+            do
+            {
+                if (length != sizeof(word)) word[length] = (char)g_last_character;
+                length += 1;
+                g_last_character = read_character();
+            } while (isalnum(g_last_character));
+
+            bool is_def = length == 3 && memcmp(word, "def", 3) == 0;
+            bool is_extern = length == 6 && memcmp(word, "extern", 6) == 0;
+            if (is_def || is_extern)
+            {
+                g_identifier_string.assign(word, length);
+                g_token_location = location;
+                g_current_token = is_def ? TOKEN_DEF : TOKEN_EXTERN;
+                return;
+            }
+            continue;
+        }
+
+        in_word = isalnum(g_last_character) || g_last_character == '.';
+        g_last_character = read_character();
+    }
+
+    g_token_location = g_last_character_location;
+    g_current_token = TOKEN_EOF;
+}
+
+// when set, errors (and the other messages about an item) are collected here instead of
+// printed, so they can be printed in order with the output of the items around them.
+// every thread of the pipelined driver has its own.
+static thread_local std::string* g_diagnostics = nullptr;
+
+/// emit_output - print a message about the current item, or add it to g_diagnostics.
+static void emit_output(const std::string &text)
+{
+    if (g_diagnostics) *g_diagnostics += text;
+    else fputs(text.c_str(), stderr);
+}
+
+// the last error reported on this thread. an error that repeats it, the same message at
+// the same place, isn't reported again.
+static thread_local std::string g_last_error;
+static thread_local source_location_t g_last_error_location;
+
+// the errors this thread ran into, repeats included: an item failed if this went up while
+// it was handled.
+static thread_local size_t g_error_count = 0;
+
+/// reset_errors - forget the last error, for a new input that starts at line 1 again.
+static void reset_errors()
+{
+    g_last_error.clear();
+    g_last_error_location = source_location_t();
+}
+
+/// log_error* - These are little helper functions for error handling. errors are reported
+/// at location, as "Error: line:column: message", or without one if the line is 0. the
+/// parser's errors are at the current token; code generation has to say where.
+std::unique_ptr<expr_ast> log_error(const char *message, source_location_t location)
 {
-  fprintf(stderr, "Error: %s\n", message);
+  g_error_count += 1;
+  if (g_last_error == message && g_last_error_location.line == location.line && g_last_error_location.column == location.column)
+  {
+      return nullptr;
+  }
+  g_last_error = message;
+  g_last_error_location = location;
+
+  std::string text = "Error: ";
+  if (location.line != 0) text += std::to_string(location.line) + ":" + std::to_string(location.column) + ": ";
+  text += message;
+  text += "\n";
+
+  if (g_diagnostics) *g_diagnostics += text;
+  else fputs(text.c_str(), stderr);
   return nullptr;
 }
+std::unique_ptr<expr_ast> log_error(const char *message)
+{
+  return log_error(message, g_token_location);
+}
 std::unique_ptr<prototype_ast> log_error_p(const char *message)
 {
   log_error(message);
@@ -224,16 +748,49 @@ std::unique_ptr<prototype_ast> log_error_p(const char *message)
 
 // Parser stuff
 
+// when set, the functions the input defines are renamed to g_name_prefix + name, and calls
+// to them follow (see the embedding API). g_local_names holds the original names.
+static std::string g_name_prefix;
+static std::set<std::string> g_local_names;
+
+static std::string local_function_name(const std::string &name)
+{
+    if (g_local_names.count(name)) return g_name_prefix + name;
+    return name;
+}
+
+
+// hash consing hooks, see "Hash consing" below.
+static std::unique_ptr<expr_ast> hash_cons(std::unique_ptr<expr_ast> expression);
+static void reset_hash_cons();
 
 // awful forward declaration because of circular thbngs.
 static std::unique_ptr<expr_ast> parse_expression();
 
 
-// numberexpr ::= number
+// numberexpr ::= number [type]
 static std::unique_ptr<expr_ast> parse_number_expr() {
-  auto result = std::make_unique<number_expr_ast>(g_number_value);
+  internal_types literal_type = TYPE_R64;
+  if (!g_number_suffix.empty())
+  {
+      literal_type = find_internal_type(g_number_suffix);
+      if (literal_type == TYPE_INVALID || literal_type == TYPE_BOOL) return log_error("unknown type suffix on number");
+  }
+
+  uint64_t integer_value = 0;
+  if (is_integer_type(literal_type))
+  {
+      if (g_number_string.find('.') != std::string::npos) return log_error("integer literal with a fractional part");
+
+      errno = 0;
+      integer_value = strtoull(g_number_string.c_str(), nullptr, 10);
+      unsigned value_bits = type_bits(literal_type) - is_signed_type(literal_type);
+      if (errno == ERANGE || (value_bits < 64 && (integer_value >> value_bits) != 0)) return log_error("integer literal out of range for its type");
+  }
+
+  auto result = hash_cons(std::make_unique<number_expr_ast>(g_number_value, integer_value, literal_type, !g_number_suffix.empty()));
   get_next_token();
-  return std::move(result);
+  return result;
 }
 
 /// parenexpr ::= '(' expression ')'
@@ -259,10 +816,11 @@ static std::unique_ptr<expr_ast> parse_parentheses_expr() {
 static std::unique_ptr<expr_ast> parse_identifier_expr()
 {
     std::string identifier_name = g_identifier_string;
+    source_location_t identifier_location = g_token_location;
     get_next_token();  // eat identifier.
 
     // Simple variable ref
-    if (g_current_token != '(')  return std::make_unique<variable_expr_ast>(identifier_name);
+    if (g_current_token != '(')  return hash_cons(std::make_unique<variable_expr_ast>(identifier_name, identifier_location));
 
     // Call.
     get_next_token();  // eat (
@@ -292,7 +850,7 @@ static std::unique_ptr<expr_ast> parse_identifier_expr()
     // Eat the ')'.
     get_next_token();
 
-    return std::make_unique<call_expr_ast>(identifier_name, std::move(function_arguments));
+    return hash_cons(std::make_unique<call_expr_ast>(local_function_name(identifier_name), std::move(function_arguments), identifier_location));
 }
 
 /// primary
@@ -356,6 +914,7 @@ static std::unique_ptr<expr_ast> parse_binary_operator_rhs(int expr_precedence,
 
         // okay, we know this is a binary operator
         int binary_operator = g_current_token;
+        source_location_t operator_location = g_token_location;
         get_next_token(); // eat binary operator
 
         // parse the primary expression aftyer the binary operator./
@@ -373,7 +932,7 @@ static std::unique_ptr<expr_ast> parse_binary_operator_rhs(int expr_precedence,
         }
 
         // merge lhs/ rhs
-        lhs = std::make_unique<binary_expr_ast>(binary_operator, std::move(lhs), std::move(rhs));
+        lhs = hash_cons(std::make_unique<binary_expr_ast>(binary_operator, std::move(lhs), std::move(rhs), operator_location));
     }
 }
 
@@ -388,6 +947,23 @@ static std::unique_ptr<expr_ast> parse_expression()
   return parse_binary_operator_rhs(0, std::move(lhs));
 }
 
+/// type ::= ':' identifier
+static bool parse_type_annotation(internal_types &type)
+{
+    get_next_token(); // eat ':'
+
+    if (g_current_token == TOKEN_IDENTIFIER) type = find_internal_type(g_identifier_string);
+    if (g_current_token != TOKEN_IDENTIFIER || type == TYPE_INVALID)
+    {
+        log_error("expected a type after ':'");
+        return false;
+    }
+
+    get_next_token(); // eat the type.
+    return true;
+}
+
+/// prototype ::= identifier '(' (identifier [type])* ')' [type]
 static std::unique_ptr<prototype_ast> parse_prototype()
 {
     if (g_current_token != TOKEN_IDENTIFIER)
@@ -404,14 +980,18 @@ static std::unique_ptr<prototype_ast> parse_prototype()
         return log_error_p("Expected '(' in prototype");
     }
     
-    // read the list of argument names.
+    // read the list of argument names, and their types if they have one.
     std::vector<std::string> argument_names;
-    while(get_next_token() == TOKEN_IDENTIFIER)
+    std::vector<internal_types> argument_types;
+    get_next_token(); // eat '('
+    while (g_current_token == TOKEN_IDENTIFIER)
     {
         argument_names.push_back(g_identifier_string);
-       
-        
+        get_next_token();
 
+        internal_types argument_type = TYPE_R64;
+        if (g_current_token == ':' && !parse_type_annotation(argument_type)) return nullptr;
+        argument_types.push_back(argument_type);
     }
 
      if (g_current_token != ')')
@@ -422,7 +1002,10 @@ static std::unique_ptr<prototype_ast> parse_prototype()
     // success.
     get_next_token(); // eat ')'
 
-    return std::make_unique<prototype_ast>(function_name, std::move(argument_names));
+    internal_types return_type = TYPE_R64;
+    if (g_current_token == ':' && !parse_type_annotation(return_type)) return nullptr;
+
+    return std::make_unique<prototype_ast>(function_name, std::move(argument_names), std::move(argument_types), return_type);
 
 }
 
@@ -430,14 +1013,23 @@ static std::unique_ptr<prototype_ast> parse_prototype()
 
 static std::unique_ptr<function_ast> parse_definition()
 {
+    source_location_t location = g_token_location;
+    reset_hash_cons();
     get_next_token(); // eat def
     auto prototype = parse_prototype();
 
     if (!prototype) return nullptr;
 
+    // before the body, so recursive calls are renamed too.
+    if (!g_name_prefix.empty())
+    {
+        g_local_names.insert(prototype->getName());
+        prototype->set_name(g_name_prefix + prototype->getName());
+    }
+
     if (auto expr = parse_expression())
     {
-        return std::make_unique<function_ast>(std::move(prototype), std::move(expr));
+        return std::make_unique<function_ast>(std::move(prototype), std::move(expr), location);
     }
 
     return nullptr;
@@ -446,11 +1038,13 @@ static std::unique_ptr<function_ast> parse_definition()
 
 static std::unique_ptr<function_ast> parse_top_level_expr()
 {
+    source_location_t location = g_token_location;
+    reset_hash_cons();
     if (auto expr = parse_expression())
     {
         // make an anonymous function prototype.
-        auto prototype = std::make_unique<prototype_ast>("", std::vector<std::string>());
-        return std::make_unique<function_ast>(std::move(prototype), std::move(expr));
+        auto prototype = std::make_unique<prototype_ast>("__anon_expr", std::vector<std::string>());
+        return std::make_unique<function_ast>(std::move(prototype), std::move(expr), location);
     }
 
     return nullptr;
@@ -473,237 +1067,3898 @@ static std::unique_ptr<prototype_ast> parse_extern()
 static std::unique_ptr<LLVMContext> llvm_context;
 static std::unique_ptr<IRBuilder<>> ir_builder;
 static std::unique_ptr<Module> module;
-static std::map<std::string, Value*> named_values;
 
-Value* log_error_v(const char *message)
+/// named_value_t - a function argument in scope, and its type.
+struct named_value_t
 {
-  log_error(message);
-  return nullptr;
-}
+    Value* value = nullptr;
+    internal_types type = TYPE_R64;
+};
 
-Value* number_expr_ast::codegen()
+static std::map<std::string, named_value_t> named_values;
+
+/// debug_info_t - with --debug-info, what describes the current module in DWARF: every
+/// function gets a subprogram at the line of its `def`, and the instructions of operators
+/// and calls the line and column they are at, which is what perf and debuggers show.
+struct debug_info_t
 {
-  return ConstantFP::get(*llvm_context, APFloat(this->value)); // now i'm using "this"!
-}
+    std::unique_ptr<DIBuilder> builder;
+    DIFile* file = nullptr;
+
+    // the function being generated; code outside of one (batch functions, kernels) has
+    // no locations.
+    DISubprogram* scope = nullptr;
+};
 
+static debug_info_t g_debug_info;
 
-Value* variable_expr_ast::codegen()
+/// initialize_debug_info - start describing a freshly made module.
+static void initialize_debug_info()
 {
-  // Look this variable up in the function.
-  Value *value = named_values[name];
-  if (!value) log_error_v("Unknown variable name");
+    g_debug_info = debug_info_t();
+    if (!g_options.debug_info) return;
+
+    g_debug_info.builder = std::make_unique<DIBuilder>(*module);
+    StringRef source = g_options.source_path.empty() ? StringRef("<stdin>") : StringRef(g_options.source_path);
+    g_debug_info.file = g_debug_info.builder->createFile(sys::path::filename(source), sys::path::parent_path(source));
+    g_debug_info.builder->createCompileUnit(dwarf::DW_LANG_C, g_debug_info.file, "kaleidoscope", false, "", 0);
+
+    module->addModuleFlag(Module::Warning, "Debug Info Version", DEBUG_METADATA_VERSION);
+}
 
-  return value;
+/// finalize_debug_info - before a module leaves the front end. the builder goes with it:
+/// it can't outlive the module's context, and once the module is handed off, that may be
+/// in use by another thread.
+static void finalize_debug_info()
+{
+    if (g_debug_info.builder) g_debug_info.builder->finalize();
+    g_debug_info = debug_info_t();
 }
 
+static DIType* get_debug_type(internal_types type)
+{
+    unsigned encoding = dwarf::DW_ATE_unsigned;
+    if (is_float_type(type)) encoding = dwarf::DW_ATE_float;
+    else if (is_signed_type(type)) encoding = dwarf::DW_ATE_signed;
+    else if (type == TYPE_BOOL) encoding = dwarf::DW_ATE_boolean;
 
+    return g_debug_info.builder->createBasicType(internal_type_strings[type], std::max(type_bits(type), 8u), encoding);
+}
 
-Value* binary_expr_ast::codegen()
+/// begin_debug_function - give function a subprogram and make it the scope of what is
+/// generated next. returns the scope to go back to afterwards (functions can be generated
+/// while generating another one).
+static DISubprogram* begin_debug_function(Function* function, const prototype_ast &prototype, source_location_t location)
 {
+    DISubprogram* outer_scope = g_debug_info.scope;
+    if (!g_debug_info.builder) return outer_scope;
 
-  Value* lhs_value = lhs->codegen();
-  Value* rhs_value = rhs->codegen();
+    SmallVector<Metadata*, 8> types = {get_debug_type(prototype.get_return_type())};
+    for (size_t idx = 0; idx != prototype.get_arguments().size(); ++idx)
+    {
+        types.push_back(get_debug_type(prototype.get_argument_type(idx)));
+    }
 
-  if (!lhs_value || !rhs_value) return nullptr;
+    DISubprogram* subprogram = g_debug_info.builder->createFunction(
+        g_debug_info.file, prototype.getName(), StringRef(), g_debug_info.file, location.line,
+        g_debug_info.builder->createSubroutineType(g_debug_info.builder->getOrCreateTypeArray(types)),
+        location.line, DINode::FlagPrototyped, DISubprogram::SPFlagDefinition);
+    function->setSubprogram(subprogram);
 
-  switch (op) {
-  case '+':
-    return ir_builder->CreateFAdd(lhs_value, rhs_value, "addtmp");
-  case '-':
-    return ir_builder->CreateFSub(lhs_value, rhs_value, "subtmp");
-  case '*':
-    return ir_builder->CreateFMul(lhs_value, rhs_value, "multmp");
-  case '<':
-    lhs_value = ir_builder->CreateFCmpULT(lhs_value, rhs_value, "cmptmp");
-    // Convert bool 0/1 to double 0.0 or 1.0
-    return ir_builder->CreateUIToFP(lhs_value, Type::getDoubleTy(*llvm_context),
-                                 "booltmp");
-  default:
-    return log_error_v("invalid binary operator");
-  }
+    g_debug_info.scope = subprogram;
+    ir_builder->SetCurrentDebugLocation(DILocation::get(*llvm_context, location.line, location.column, subprogram));
+    return outer_scope;
 }
 
-Value* call_expr_ast::codegen() {
-  // Look up the name in the global module table.
-  Function* callee_function = module->getFunction(this->callee);
-
-  if (!callee_function) return log_error_v("Unknown function referenced");
+static void end_debug_function(DISubprogram* outer_scope)
+{
+    if (!g_debug_info.builder) return;
 
-  // If argument mismatch error.
-  if (callee_function->arg_size() != this->arguments.size()) return log_error_v("Incorrect # arguments passed");
+    g_debug_info.builder->finalizeSubprogram(g_debug_info.scope);
+    g_debug_info.scope = outer_scope;
+    ir_builder->SetCurrentDebugLocation(DebugLoc());
+}
 
-  // wow, what is even going on here
-  std::vector<Value*> value_arguments;
-  for (unsigned i = 0, e = value_arguments.size(); i != e; ++i)
-  {
-    value_arguments.push_back(this->arguments[i]->codegen());
-    if (!value_arguments.back()) return nullptr;
-  }
+/// emit_location - attribute the instructions generated next to expression.
+static void emit_location(const expr_ast &expression)
+{
+    if (!g_debug_info.scope) return;
 
-  return ir_builder->CreateCall(callee_function, value_arguments, "calltmp");
+    source_location_t location = expression.get_location();
+    ir_builder->SetCurrentDebugLocation(DILocation::get(*llvm_context, location.line, location.column, g_debug_info.scope));
 }
 
+// only there in --jit/--lazy/--tiered mode.
+static std::unique_ptr<kaleidoscope::kaleidoscope_jit> jit;
+static ExitOnError exit_on_error;
 
+// every prototype we have seen so far, by name. the module only holds what has been
+// emitted since the last flush, so this is what we use to re-declare functions that live
+// in an earlier module (or in an earlier object file, when streaming).
+static std::map<std::string, std::unique_ptr<prototype_ast>> function_protos;
 
-Function* prototype_ast::codegen()
+// the ASTs of the definitions the JIT has seen, for everything that wants to generate
+// code for (or interpret) a function again later.
+static std::map<std::string, std::unique_ptr<function_ast>> function_definitions;
+
+// names of the functions whose bodies already left memory through flush_module().
+static std::set<std::string> emitted_definitions;
+
+Value* log_error_v(const char *message, source_location_t location)
 {
-    // Make the function type:  double(double,double) etc.
-    std::vector<Type*> doubles(
-        this->arguments.size(),
-        Type::getDoubleTy(*llvm_context));
+  log_error(message, location);
+  return nullptr;
+}
+
+// libm functions that `extern` can bind to and that don't have side effects.
+static const std::set<std::string> known_math_functions = {
+    "sin", "cos", "tan", "asin", "acos", "atan", "atan2", "sinh", "cosh", "tanh",
+    "exp", "exp2", "log", "log2", "log10", "pow", "sqrt", "fabs", "floor", "ceil"
+};
 
+/// get_function - find the function in the current module, or re-declare it from
+/// function_protos if it was emitted into a module that has since been flushed.
+Function* get_function(const std::string &name)
+{
+    if (auto* function = module->getFunction(name)) return function;
 
-    FunctionType* function_type = FunctionType::get(Type::getDoubleTy(*llvm_context), doubles, false);
+    auto it = function_protos.find(name);
+    if (it != function_protos.end()) return it->second->codegen();
 
-    Function* function = Function::Create(function_type, Function::ExternalLinkage, this->name, module.get());
+    return nullptr;
+}
 
-    // Set names for all arguments.
-    unsigned idx = 0;
-    for (auto &argument : function->args())
+static Type* get_llvm_type(internal_types type)
+{
+    switch (type)
     {
-      argument.setName(this->arguments[idx++]);
+        case TYPE_R32:  return Type::getFloatTy(*llvm_context);
+        case TYPE_R64:  return Type::getDoubleTy(*llvm_context);
+        case TYPE_BOOL: return Type::getInt1Ty(*llvm_context);
+        default:        return Type::getIntNTy(*llvm_context, type_bits(type));
     }
-    return function;
 }
 
-Function* function_ast::codegen()
+/// promote_types - the type both operands of a binary operator are converted to: floating
+/// point wins over integers, and otherwise the wider type (unsigned if they are as wide).
+static internal_types promote_types(internal_types lhs, internal_types rhs)
 {
-    // First, check for an existing function from a previous 'extern' declaration.
-    Function* function = module->getFunction(this->prototype->getName());
+    if (lhs == rhs) return lhs;
+    if (lhs == TYPE_BOOL) return rhs;
+    if (rhs == TYPE_BOOL) return lhs;
 
-    if (!function) function = this->prototype->codegen();
+    if (is_float_type(lhs) && is_float_type(rhs)) return TYPE_R64;
+    if (is_float_type(lhs)) return lhs;
+    if (is_float_type(rhs)) return rhs;
 
-    if (!function) return nullptr;
+    if (type_bits(lhs) != type_bits(rhs)) return type_bits(lhs) > type_bits(rhs) ? lhs : rhs;
+    return is_signed_type(lhs) ? rhs : lhs;
+}
 
-    if (!function->empty()) return (Function*)log_error_v("Function cannot be redefined.");
+/// convert_value - convert value from one type to another. a value converted to bool is
+/// true when it isn't zero.
+static Value* convert_value(Value* value, internal_types from, internal_types to)
+{
+    if (from == to) return value;
 
+    Type* to_type = get_llvm_type(to);
 
-    // Create a new basic block to start insertion into.
-    BasicBlock* basic_block = BasicBlock::Create(*llvm_context, "entry", function);
-    ir_builder->SetInsertPoint(basic_block);
+    if (to == TYPE_BOOL)
+    {
+        if (is_float_type(from)) return ir_builder->CreateFCmpUNE(value, ConstantFP::get(value->getType(), 0.0), "convtmp");
+        return ir_builder->CreateICmpNE(value, ConstantInt::get(value->getType(), 0), "convtmp");
+    }
 
-    // Record the function arguments in the NamedValues map.
-    named_values.clear();
-    for (auto &arg : function->args())
+    if (from == TYPE_BOOL)
     {
-        named_values[std::string(arg.getName())] = &arg;
+        if (is_float_type(to)) return ir_builder->CreateUIToFP(value, to_type, "booltmp");
+        return ir_builder->CreateZExt(value, to_type, "booltmp");
     }
 
+    if (is_float_type(from) && is_float_type(to)) return ir_builder->CreateFPCast(value, to_type, "convtmp");
 
-    if (Value *RetVal = this->body->codegen())
+    if (is_float_type(from))
     {
-        // Finish off the function.
-        ir_builder->CreateRet(RetVal);
-
-        // Validate the generated code, checking for consistency.
-        verifyFunction(*function);
+        if (is_signed_type(to)) return ir_builder->CreateFPToSI(value, to_type, "convtmp");
+        return ir_builder->CreateFPToUI(value, to_type, "convtmp");
+    }
 
-        return function;
+    if (is_float_type(to))
+    {
+        if (is_signed_type(from)) return ir_builder->CreateSIToFP(value, to_type, "convtmp");
+        return ir_builder->CreateUIToFP(value, to_type, "convtmp");
     }
 
-    // Error reading body, remove function.
-    function->eraseFromParent();
-    return nullptr;
+    return ir_builder->CreateIntCast(value, to_type, is_signed_type(from), "convtmp");
 }
 
+Value* number_expr_ast::codegen()
+{
+  this->type = this->literal_type;
 
+  if (is_integer_type(this->literal_type)) return ConstantInt::get(get_llvm_type(this->literal_type), this->integer_value);
+  if (this->literal_type == TYPE_R32) return ConstantFP::get(Type::getFloatTy(*llvm_context), this->value);
 
-//===----------------------------------------------------------------------===//
-// Top-Level parsing and JIT driver
-//===----------------------------------------------------------------------===//
+  return ConstantFP::get(*llvm_context, APFloat(this->value)); // now i'm using "this"!
+}
 
-static void initialize_module()
+bool number_expr_ast::fits_type(internal_types type) const
 {
-  // Open a new context and module.
-  llvm_context = std::make_unique<LLVMContext>();
-  module = std::make_unique<Module>("my cool jit", *llvm_context);
+  if (!is_integer_type(type)) return true;
+  if (this->value != std::floor(this->value)) return false;
 
-  // Create a new ir_builder for the module.
-  ir_builder = std::make_unique<IRBuilder<>>(*llvm_context);
+  // literals have no sign, so only the top end matters.
+  unsigned value_bits = type_bits(type) - is_signed_type(type);
+  return this->value < std::ldexp(1.0, value_bits);
+}
+
+
+Value* variable_expr_ast::codegen()
+{
+  // Look this variable up in the function.
+  auto it = named_values.find(name);
+  if (it == named_values.end()) return log_error_v("Unknown variable name", location);
+
+  this->type = it->second.type;
+  return it->second.value;
+}
+
+
+
+Value* binary_expr_ast::codegen()
+{
+
+  Value* lhs_value = lhs->codegen_operand();
+  Value* rhs_value = rhs->codegen_operand();
+
+  if (!lhs_value || !rhs_value) return nullptr;
+
+  emit_location(*this);
+
+  // an unsuffixed literal takes the type of the other side, so `n + 1` stays integer
+  // math for an integer n. comparisons produce bools; doing arithmetic on them makes them
+  // 0.0 and 1.0, as before there were types.
+  internal_types operand_type;
+  if (lhs->is_untyped_literal() && !rhs->is_untyped_literal()) operand_type = rhs->get_type();
+  else if (rhs->is_untyped_literal() && !lhs->is_untyped_literal()) operand_type = lhs->get_type();
+  else operand_type = promote_types(lhs->get_type(), rhs->get_type());
+
+  if (operand_type == TYPE_BOOL) operand_type = TYPE_R64;
+
+  for (expr_ast* operand : {lhs.get(), rhs.get()})
+  {
+      if (operand->is_untyped_literal() && !operand->fits_type(operand_type))
+      {
+          return log_error_v((std::string("literal does not fit in ") + internal_type_strings[operand_type]).c_str(), operand->get_location());
+      }
+  }
+
+  lhs_value = convert_value(lhs_value, lhs->get_type(), operand_type);
+  rhs_value = convert_value(rhs_value, rhs->get_type(), operand_type);
+
+  bool is_float = is_float_type(operand_type);
+  this->type = (op == '<') ? TYPE_BOOL : operand_type;
+
+  switch (op) {
+  case '+':
+    if (!is_float) return ir_builder->CreateAdd(lhs_value, rhs_value, "addtmp");
+    return ir_builder->CreateFAdd(lhs_value, rhs_value, "addtmp");
+  case '-':
+    if (!is_float) return ir_builder->CreateSub(lhs_value, rhs_value, "subtmp");
+    return ir_builder->CreateFSub(lhs_value, rhs_value, "subtmp");
+  case '*':
+    if (!is_float) return ir_builder->CreateMul(lhs_value, rhs_value, "multmp");
+    return ir_builder->CreateFMul(lhs_value, rhs_value, "multmp");
+  case '<':
+    // the i1 stays an i1 until someone needs a number.
+    if (is_float) return ir_builder->CreateFCmpULT(lhs_value, rhs_value, "cmptmp");
+    if (is_signed_type(operand_type)) return ir_builder->CreateICmpSLT(lhs_value, rhs_value, "cmptmp");
+    return ir_builder->CreateICmpULT(lhs_value, rhs_value, "cmptmp");
+  default:
+    return log_error_v("invalid binary operator", location);
+  }
+}
+
+// tiered execution hooks, see "Tiered execution" below. g_tier_compile_record is only set
+// while the tiered engine generates code for a function.
+static function_record_t* g_tier_compile_record = nullptr;
+static int g_tier_compile_tier = 0;
+static function_record_t* find_interpreted_function(const std::string &name);
+static Value* emit_interpreter_call(function_record_t* record, const std::vector<Value*> &arguments, source_location_t location);
+static void emit_tier_up_check();
+
+// partial evaluation hook, see "Partial evaluation" below.
+static Value* partially_evaluate_call(const std::string &callee, const std::vector<Value*> &arguments);
+
+// memoization hooks, see "Memoization" below.
+static Value* emit_memo_lookup(Function* function);
+static void emit_memo_store(Value* slot, Value* result);
+
+Value* call_expr_ast::codegen() {
+  // native code reaches functions that are still interpreted through the interpreter.
+  // (a function calling itself finds itself in the module and calls itself directly.)
+  function_record_t* interpreted_record = nullptr;
+  if (g_tier_compile_record && !module->getFunction(this->callee))
+  {
+      interpreted_record = find_interpreted_function(this->callee);
+  }
+
+  Function* callee_function = nullptr;
+  if (!interpreted_record)
+  {
+      // Look up the name in the global module table (or re-declare it from an earlier module).
+      callee_function = get_function(this->callee);
+
+      if (!callee_function) return log_error_v("Unknown function referenced", location);
+
+      // If argument mismatch error.
+      if (callee_function->arg_size() != this->arguments.size()) return log_error_v("Incorrect # arguments passed", location);
+  }
+
+  // (interpreted functions only take and return doubles.)
+  const prototype_ast* callee_prototype = nullptr;
+  auto prototype = function_protos.find(this->callee);
+  if (!interpreted_record && prototype != function_protos.end()) callee_prototype = prototype->second.get();
+
+  std::vector<Value*> value_arguments;
+  for (unsigned i = 0, e = this->arguments.size(); i != e; ++i)
+  {
+    Value* argument = this->arguments[i]->codegen_operand();
+    if (!argument) return nullptr;
+
+    internal_types argument_type = callee_prototype ? callee_prototype->get_argument_type(i) : TYPE_R64;
+    value_arguments.push_back(convert_value(argument, this->arguments[i]->get_type(), argument_type));
+  }
+
+  this->type = callee_prototype ? callee_prototype->get_return_type() : TYPE_R64;
+
+  if (g_options.partial_eval)
+  {
+      if (Value* value = partially_evaluate_call(this->callee, value_arguments)) return value;
+  }
+
+  emit_location(*this);
+
+  if (interpreted_record) return emit_interpreter_call(interpreted_record, value_arguments, location);
+
+  return ir_builder->CreateCall(callee_function, value_arguments, "calltmp");
+}
+
+
+
+Function* prototype_ast::codegen()
+{
+    // Make the function type:  double(double,double) etc, or whatever the annotations say.
+    std::vector<Type*> argument_types;
+    for (internal_types type : this->argument_types)
+    {
+        argument_types.push_back(get_llvm_type(type));
+    }
+
+
+    FunctionType* function_type = FunctionType::get(get_llvm_type(this->return_type), argument_types, false);
+
+    Function* function = Function::Create(function_type, Function::ExternalLinkage, this->name, module.get());
+
+    // externs of libm functions don't touch memory (as far as we care, errno aside), which
+    // lets the optimizer treat them as math and the vectorizer use vector versions.
+    if (known_math_functions.count(this->name))
+    {
+        function->setDoesNotAccessMemory();
+        function->setDoesNotThrow();
+    }
+
+    // Set names for all arguments.
+    unsigned idx = 0;
+    for (auto &argument : function->args())
+    {
+      argument.setName(this->arguments[idx++]);
+    }
+    return function;
+}
+
+Function* function_ast::codegen()
+{
+    // a redefinition is rejected first, so it can't replace the prototype of the
+    // definition that stays.
+    const std::string &name = this->prototype->getName();
+    Function* existing = module->getFunction(name);
+    if (existing && !existing->empty()) return (Function*)log_error_v("Function cannot be redefined.", location);
+
+    // record the prototype in function_protos so later modules can still re-declare it.
+    // we keep our own copy: the tiered engine generates code for the same definition
+    // more than once.
+    function_protos[name] = std::make_unique<prototype_ast>(*this->prototype);
+    Function* function = get_function(name);
+
+    if (!function) return nullptr;
+
+
+    // Create a new basic block to start insertion into.
+    BasicBlock* basic_block = BasicBlock::Create(*llvm_context, "entry", function);
+    ir_builder->SetInsertPoint(basic_block);
+    DISubprogram* outer_scope = begin_debug_function(function, *this->prototype, this->location);
+
+    if (g_tier_compile_record) emit_tier_up_check();
+
+    // Record the function arguments in the NamedValues map.
+    named_values.clear();
+    for (auto &arg : function->args())
+    {
+        named_values[std::string(arg.getName())] = {&arg, this->prototype->get_argument_type(arg.getArgNo())};
+    }
+
+
+    // if the function is memoized, this checks the cache and we continue on a miss.
+    Value* memo_slot = emit_memo_lookup(function);
+
+    if (Value *RetVal = this->body->codegen())
+    {
+        RetVal = convert_value(RetVal, this->body->get_type(), this->prototype->get_return_type());
+
+        if (memo_slot) emit_memo_store(memo_slot, RetVal);
+
+        // Finish off the function.
+        ir_builder->CreateRet(RetVal);
+
+        // Validate the generated code, checking for consistency.
+        verifyFunction(*function);
+
+        end_debug_function(outer_scope);
+        return function;
+    }
+
+    // Error reading body, remove function.
+    end_debug_function(outer_scope);
+    function->eraseFromParent();
+    return nullptr;
+}
+
+
+
+//===----------------------------------------------------------------------===//
+// Memoization
+//===----------------------------------------------------------------------===//
+
+// A function is pure when everything it calls is pure: itself, functions already found
+// pure, or the libm functions in known_math_functions. Since a function can only call
+// what was defined before it (or itself), one pass over the callees at definition time
+// is enough. A redefinition can take purity away from the functions that call the new
+// body though, directly or not; recheck_purity() finds those.
+//
+// With --memoize, pure functions with at least one argument get a direct-mapped cache:
+// memo_table_size slots of [occupied, argument bits..., result bits], indexed by a hash
+// of the argument bits. A new result just replaces whatever was in its slot. In the JIT
+// the table lives on our side and its address is baked into the code, which lets every
+// tier of a function share it and lets us print the hit rates; in a module that is
+// written out it is an internal global. A JIT side table can be switched off, for code
+// that turned out not to be pure after all: it then never hits.
+
+static std::set<std::string> pure_functions;
+static std::map<std::string, std::set<std::string>> pure_function_callees;
+
+// set while generating code that should not be memoized (the batch kernels).
+static bool g_memoization_suppressed = false;
+
+/// memo_table_t - the JIT side memo table and statistics for a function.
+struct memo_table_t
+{
+    std::string name;
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t enabled = 1;
+    std::vector<uint64_t> slots;
+};
+
+static std::map<std::string, std::unique_ptr<memo_table_t>> memo_tables;
+static std::vector<std::unique_ptr<memo_table_t>> disabled_memo_tables; // code may still use them.
+static std::mutex memo_tables_mutex; // the pipelined driver adds tables while code runs.
+
+static void note_purity(const function_ast &definition)
+{
+    const std::string &name = definition.get_prototype().getName();
+
+    // the memo tables and the partial evaluator only deal in doubles.
+    if (definition.is_typed()) return;
+
+    std::set<std::string> callees;
+    definition.get_body().collect_callees(callees);
+
+    for (const std::string &callee : callees)
+    {
+        if (callee != name && !pure_functions.count(callee) && !known_math_functions.count(callee)) return;
+    }
+
+    pure_functions.insert(name);
+    pure_function_callees[name] = std::move(callees);
+}
+
+/// recheck_purity - after a redefinition: drop the functions that are no longer pure,
+/// because something they call no longer is, and switch off their memo tables. code that
+/// was generated for them keeps its memo lookup, but it can't hit anymore.
+static void recheck_purity()
+{
+    bool changed = true;
+    while (changed)
+    {
+        changed = false;
+        for (auto it = pure_functions.begin(); it != pure_functions.end();)
+        {
+            const std::string &name = *it;
+            bool pure = true;
+            for (const std::string &callee : pure_function_callees[name])
+            {
+                if (callee != name && !pure_functions.count(callee) && !known_math_functions.count(callee)) pure = false;
+            }
+
+            if (pure)
+            {
+                ++it;
+                continue;
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(memo_tables_mutex);
+                auto table = memo_tables.find(name);
+                if (table != memo_tables.end()) table->second->enabled = 0;
+            }
+            pure_function_callees.erase(name);
+            it = pure_functions.erase(it);
+            changed = true;
+        }
+    }
+}
+
+static Value* constant_address(Value* address_as_integer, Type* pointee_type)
+{
+    return ConstantExpr::getIntToPtr(cast<Constant>(address_as_integer), PointerType::getUnqual(pointee_type));
+}
+
+/// emit_memo_lookup - at the start of a memoized function: hash the arguments, and return
+/// the cached result if the slot holds them. leaves the builder in the block that computes
+/// the result on a miss, and returns the slot (or null if the function isn't memoized).
+static Value* emit_memo_lookup(Function* function)
+{
+    const std::string name = std::string(function->getName());
+    if (!g_options.memoize || g_memoization_suppressed || function->arg_size() == 0 || !pure_functions.count(name)) return nullptr;
+
+    LLVMContext &context = *llvm_context;
+    Type* word_type = Type::getInt64Ty(context);
+    size_t stride = function->arg_size() + 2;
+    size_t slot_count = g_options.memo_table_size;
+
+    Value* slots;
+    Value* hits;
+    Value* misses;
+    Value* enabled = nullptr;
+    if (jit)
+    {
+        // every tier of a function shares the table, and older tiers may still be running.
+        std::lock_guard<std::mutex> lock(memo_tables_mutex);
+        auto &table = memo_tables[name];
+        if (table && !table->enabled) disabled_memo_tables.push_back(std::move(table));
+        if (!table)
+        {
+            table = std::make_unique<memo_table_t>();
+            table->name = name;
+            table->slots.assign(slot_count * stride, 0);
+        }
+
+        slots = constant_address(ConstantInt::get(word_type, (uint64_t)table->slots.data()), word_type);
+        hits = constant_address(ConstantInt::get(word_type, (uint64_t)&table->hits), word_type);
+        misses = constant_address(ConstantInt::get(word_type, (uint64_t)&table->misses), word_type);
+        enabled = constant_address(ConstantInt::get(word_type, (uint64_t)&table->enabled), word_type);
+    }
+    else
+    {
+        ArrayType* table_type = ArrayType::get(word_type, slot_count * stride);
+        auto* table = new GlobalVariable(*module, table_type, false, GlobalValue::InternalLinkage,
+            ConstantAggregateZero::get(table_type), name + ".__memo");
+        slots = ir_builder->CreateConstGEP2_32(table_type, table, 0, 0);
+        hits = new GlobalVariable(*module, word_type, false, GlobalValue::InternalLinkage,
+            ConstantInt::get(word_type, 0), name + ".__memo_hits");
+        misses = new GlobalVariable(*module, word_type, false, GlobalValue::InternalLinkage,
+            ConstantInt::get(word_type, 0), name + ".__memo_misses");
+    }
+
+    // hash the argument bits.
+    std::vector<Value*> keys;
+    Value* hash = ConstantInt::get(word_type, 0xcbf29ce484222325ULL);
+    for (auto &argument : function->args())
+    {
+        Value* key = ir_builder->CreateBitCast(&argument, word_type, "key");
+        keys.push_back(key);
+        hash = ir_builder->CreateMul(ir_builder->CreateXor(hash, key), ConstantInt::get(word_type, 0x9e3779b97f4a7c15ULL), "hash");
+    }
+    // the top bits of a multiplicative hash are the well mixed ones.
+    Value* index = ir_builder->CreateLShr(hash, 64 - Log2_64(slot_count), "slot_index");
+    Value* slot = ir_builder->CreateGEP(word_type, slots, ir_builder->CreateMul(index, ConstantInt::get(word_type, stride)), "slot");
+
+    // it's a hit if the slot is occupied and all keys match.
+    Value* is_hit = ir_builder->CreateICmpNE(ir_builder->CreateLoad(word_type, slot), ConstantInt::get(word_type, 0), "occupied");
+    if (enabled)
+    {
+        is_hit = ir_builder->CreateAnd(is_hit, ir_builder->CreateICmpNE(ir_builder->CreateLoad(word_type, enabled), ConstantInt::get(word_type, 0)), "enabled");
+    }
+    for (size_t idx = 0; idx != keys.size(); ++idx)
+    {
+        Value* stored_key = ir_builder->CreateLoad(word_type, ir_builder->CreateConstGEP1_32(word_type, slot, idx + 1));
+        is_hit = ir_builder->CreateAnd(is_hit, ir_builder->CreateICmpEQ(stored_key, keys[idx]), "is_hit");
+    }
+
+    BasicBlock* hit_block = BasicBlock::Create(context, "memo_hit", function);
+    BasicBlock* miss_block = BasicBlock::Create(context, "memo_miss", function);
+    ir_builder->CreateCondBr(is_hit, hit_block, miss_block);
+
+    ir_builder->SetInsertPoint(hit_block);
+    ir_builder->CreateStore(ir_builder->CreateAdd(ir_builder->CreateLoad(word_type, hits), ConstantInt::get(word_type, 1)), hits);
+    Value* cached_bits = ir_builder->CreateLoad(word_type, ir_builder->CreateConstGEP1_32(word_type, slot, stride - 1));
+    ir_builder->CreateRet(ir_builder->CreateBitCast(cached_bits, Type::getDoubleTy(context)));
+
+    ir_builder->SetInsertPoint(miss_block);
+    ir_builder->CreateStore(ir_builder->CreateAdd(ir_builder->CreateLoad(word_type, misses), ConstantInt::get(word_type, 1)), misses);
+
+    return slot;
+}
+
+/// emit_memo_store - on the way out of a memoized function: remember the result. the
+/// keys are written again here rather than before the body, since a recursive call could
+/// have taken the slot meanwhile.
+static void emit_memo_store(Value* slot, Value* result)
+{
+    Function* function = ir_builder->GetInsertBlock()->getParent();
+    Type* word_type = Type::getInt64Ty(*llvm_context);
+
+    unsigned idx = 1;
+    for (auto &argument : function->args())
+    {
+        ir_builder->CreateStore(ir_builder->CreateBitCast(&argument, word_type), ir_builder->CreateConstGEP1_32(word_type, slot, idx++));
+    }
+    ir_builder->CreateStore(ir_builder->CreateBitCast(result, word_type), ir_builder->CreateConstGEP1_32(word_type, slot, idx));
+    ir_builder->CreateStore(ConstantInt::get(word_type, 1), slot);
+}
+
+#ifndef KALEIDOSCOPE_LIBRARY
+
+static void print_memo_statistics()
+{
+    for (auto &entry : memo_tables)
+    {
+        const memo_table_t &table = *entry.second;
+        uint64_t calls = table.hits + table.misses;
+        fprintf(stderr, "memo %s: %llu calls, %llu hits, %llu misses, %.1f%% hit rate\n",
+            table.name.c_str(),
+            (unsigned long long)calls, (unsigned long long)table.hits, (unsigned long long)table.misses,
+            calls ? 100.0 * table.hits / calls : 0.0);
+    }
+}
+
+#endif // KALEIDOSCOPE_LIBRARY
+
+//===----------------------------------------------------------------------===//
+// Hash consing
+//===----------------------------------------------------------------------===//
+
+// With --hash-cons, the parser interns every expression it makes, keyed on what kind of
+// node it is, its operator or literal bits or name, and the canonical nodes of its
+// operands. The first time a key comes up, the node is kept and becomes the canonical
+// one; after that, a new node with the same key is thrown away (its operands are all
+// repeats already, or leaves) and a shared_expr_ast that refers to the canonical node
+// takes its place. So `(a*b+c) * (a*b+c)` parses to one tree for a*b+c and a reference
+// to it, and code is generated for a*b+c once.
+//
+// The table only holds the nodes of the definition that is being parsed, since a
+// variable means something else in another one. Calls are only interned when the callee
+// is pure (see "Memoization" above) at the time: two calls of printd are two calls. Like
+// with --partial-eval, code generated later for a definition keeps sharing the calls of a
+// function that has since been redefined to something impure.
+
+static std::unordered_map<std::string, expr_ast*> hash_cons_table;
+
+static void append_key_bytes(std::string &key, const void* bytes, size_t size)
+{
+    key.append((const char*)bytes, size);
+}
+
+static void append_key_operand(std::string &key, const expr_ast &operand)
+{
+    const expr_ast* canonical = operand.get_canonical();
+    append_key_bytes(key, &canonical, sizeof(canonical));
+}
+
+bool number_expr_ast::append_hash_cons_key(std::string &key) const
+{
+    key += 'n';
+    key += char(literal_type);
+    key += char(has_suffix);
+    append_key_bytes(key, &value, sizeof(value));
+    append_key_bytes(key, &integer_value, sizeof(integer_value));
+    return true;
+}
+
+bool variable_expr_ast::append_hash_cons_key(std::string &key) const
+{
+    key += 'v';
+    key += name;
+    return true;
+}
+
+bool binary_expr_ast::append_hash_cons_key(std::string &key) const
+{
+    key += 'b';
+    key += op;
+    append_key_operand(key, *lhs);
+    append_key_operand(key, *rhs);
+    return true;
+}
+
+bool call_expr_ast::append_hash_cons_key(std::string &key) const
+{
+    if (!pure_functions.count(callee) && !known_math_functions.count(callee)) return false;
+
+    // the operands have a fixed size, so the callee can just go at the end.
+    key += 'c';
+    size_t argument_count = arguments.size();
+    append_key_bytes(key, &argument_count, sizeof(argument_count));
+    for (auto &argument : arguments) append_key_operand(key, *argument);
+    key += callee;
+    return true;
+}
+
+/// hash_cons - the canonical node for expression, if there is one; expression itself
+/// otherwise.
+static std::unique_ptr<expr_ast> hash_cons(std::unique_ptr<expr_ast> expression)
+{
+    if (!g_options.hash_cons || !expression) return expression;
+
+    std::string key;
+    if (!expression->append_hash_cons_key(key)) return expression;
+
+    auto inserted = hash_cons_table.emplace(std::move(key), expression.get());
+    if (inserted.second) return expression;
+
+    return std::make_unique<shared_expr_ast>(inserted.first->second, expression->get_location());
+}
+
+/// reset_hash_cons - at the start of every definition or top-level expression.
+static void reset_hash_cons()
+{
+    hash_cons_table.clear();
+}
+
+Value* expr_ast::codegen_operand()
+{
+    generated_value = codegen();
+    generated_block = ir_builder->GetInsertBlock();
+    return generated_value;
+}
+
+/// shared_expr_ast::codegen - the value of the target, as it left it in this block. when
+/// the target's value is somewhere else (a function that calls itself with constant
+/// arguments gets specialized in the middle of its own body, see "Partial evaluation"),
+/// we generate it again.
+Value* shared_expr_ast::codegen()
+{
+    Value* value = target->get_generated_value(ir_builder->GetInsertBlock());
+    if (!value) value = target->codegen_operand();
+
+    this->type = target->get_type();
+    return value;
+}
+
+//===----------------------------------------------------------------------===//
+// Partial evaluation
+//===----------------------------------------------------------------------===//
+
+// With --partial-eval, call_expr_ast::codegen() looks at its arguments after generating
+// them (the builder folds constant arithmetic, so `f(2*3)` counts as constant too):
+//
+//  - all arguments constant and the callee a pure user function: run the callee at
+//    compile time and use the result. The evaluation has a step and a recursion budget;
+//    over budget, we just emit the call. Results (and give-ups) are cached per callee and
+//    argument bits.
+//  - some arguments constant: call a copy of the callee with those arguments baked in,
+//    <name>.__spec.<bits or _>..., made once per module.
+
+static const size_t partial_eval_step_budget = 1000000;
+static const size_t partial_eval_depth_budget = 256;
+static const size_t max_specialization_depth = 4;
+
+namespace {
+
+/// fold_frame_t - the arguments of the function being folded.
+struct fold_frame_t
+{
+    const std::vector<std::string>* parameters;
+    const double* arguments;
+    size_t depth;
+};
+
+} // end anonymous namespace
+
+static size_t g_fold_steps_left = 0;
+static size_t g_specialization_depth = 0;
+
+// the folded result of a call, or nothing if we gave up on it.
+static std::map<std::pair<std::string, std::vector<uint64_t>>, Optional<double>> folded_calls;
+
+static bool fold_math_call(const std::string &name, const double* arguments, size_t argument_count, double &result)
+{
+    static const std::map<std::string, double (*)(double)> unary_functions = {
+        {"sin", ::sin}, {"cos", ::cos}, {"tan", ::tan}, {"asin", ::asin}, {"acos", ::acos}, {"atan", ::atan},
+        {"sinh", ::sinh}, {"cosh", ::cosh}, {"tanh", ::tanh}, {"exp", ::exp}, {"exp2", ::exp2},
+        {"log", ::log}, {"log2", ::log2}, {"log10", ::log10}, {"sqrt", ::sqrt}, {"fabs", ::fabs},
+        {"floor", ::floor}, {"ceil", ::ceil}
+    };
+    static const std::map<std::string, double (*)(double, double)> binary_functions = {
+        {"pow", ::pow}, {"atan2", ::atan2}
+    };
+
+    auto unary = unary_functions.find(name);
+    if (unary != unary_functions.end() && argument_count == 1)
+    {
+        result = unary->second(arguments[0]);
+        return true;
+    }
+
+    auto binary = binary_functions.find(name);
+    if (binary != binary_functions.end() && argument_count == 2)
+    {
+        result = binary->second(arguments[0], arguments[1]);
+        return true;
+    }
+
+    return false;
+}
+
+/// fold_call - evaluate a call of a pure function at compile time, within budget.
+static bool fold_call(const std::string &name, const double* arguments, size_t argument_count, size_t depth, double &result)
+{
+    if (known_math_functions.count(name)) return fold_math_call(name, arguments, argument_count, result);
+
+    if (!pure_functions.count(name) || depth >= partial_eval_depth_budget) return false;
+
+    auto definition = function_definitions.find(name);
+    if (definition == function_definitions.end()) return false;
+
+    const prototype_ast &prototype = definition->second->get_prototype();
+    if (prototype.get_arguments().size() != argument_count) return false;
+
+    fold_frame_t frame{&prototype.get_arguments(), arguments, depth + 1};
+    return definition->second->get_body().fold(frame, result);
+}
+
+bool number_expr_ast::fold(const fold_frame_t &frame, double &result) const
+{
+    result = this->value;
+    return true;
+}
+
+bool variable_expr_ast::fold(const fold_frame_t &frame, double &result) const
+{
+    for (size_t idx = 0; idx != frame.parameters->size(); ++idx)
+    {
+        if ((*frame.parameters)[idx] == this->name)
+        {
+            result = frame.arguments[idx];
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool binary_expr_ast::fold(const fold_frame_t &frame, double &result) const
+{
+    if (g_fold_steps_left == 0) return false;
+    g_fold_steps_left -= 1;
+
+    double lhs_value, rhs_value;
+    if (!lhs->fold(frame, lhs_value) || !rhs->fold(frame, rhs_value)) return false;
+
+    switch (op)
+    {
+        case '+': result = lhs_value + rhs_value; return true;
+        case '-': result = lhs_value - rhs_value; return true;
+        case '*': result = lhs_value * rhs_value; return true;
+        case '<': result = !(lhs_value >= rhs_value) ? 1.0 : 0.0; return true;
+        default:  return false;
+    }
+}
+
+bool call_expr_ast::fold(const fold_frame_t &frame, double &result) const
+{
+    if (g_fold_steps_left == 0) return false;
+    g_fold_steps_left -= 1;
+
+    std::vector<double> values(this->arguments.size());
+    for (size_t idx = 0; idx != this->arguments.size(); ++idx)
+    {
+        if (!this->arguments[idx]->fold(frame, values[idx])) return false;
+    }
+
+    return fold_call(this->callee, values.data(), values.size(), frame.depth, result);
+}
+
+/// specialize - the copy of `name` with the constant arguments baked in.
+static Function* specialize(const std::string &name, function_ast &definition, const std::vector<Value*> &arguments)
+{
+    const std::vector<std::string> &parameters = definition.get_prototype().get_arguments();
+
+    std::string specialized_name = name + ".__spec";
+    std::vector<Type*> dynamic_types;
+    for (Value* argument : arguments)
+    {
+        if (auto* constant = dyn_cast<ConstantFP>(argument))
+        {
+            specialized_name += "." + utohexstr(constant->getValueAPF().bitcastToAPInt().getZExtValue());
+        }
+        else
+        {
+            specialized_name += "._";
+            dynamic_types.push_back(argument->getType());
+        }
+    }
+
+    if (Function* existing = module->getFunction(specialized_name)) return existing;
+    if (g_specialization_depth >= max_specialization_depth) return nullptr;
+
+    FunctionType* function_type = FunctionType::get(Type::getDoubleTy(*llvm_context), dynamic_types, false);
+    Function* function = Function::Create(function_type, Function::InternalLinkage, specialized_name, module.get());
+
+    // we are in the middle of generating the caller.
+    IRBuilderBase::InsertPointGuard insert_point_guard(*ir_builder);
+    auto saved_named_values = named_values;
+
+    ir_builder->SetInsertPoint(BasicBlock::Create(*llvm_context, "entry", function));
+
+    named_values.clear();
+    auto dynamic_argument = function->arg_begin();
+    for (size_t idx = 0; idx != arguments.size(); ++idx)
+    {
+        if (isa<ConstantFP>(arguments[idx]))
+        {
+            named_values[parameters[idx]] = {arguments[idx], TYPE_R64};
+        }
+        else
+        {
+            dynamic_argument->setName(parameters[idx]);
+            named_values[parameters[idx]] = {&*dynamic_argument++, TYPE_R64};
+        }
+    }
+
+    g_specialization_depth += 1;
+    Value* body = definition.get_body().codegen();
+    g_specialization_depth -= 1;
+
+    named_values = std::move(saved_named_values);
+
+    if (!body)
+    {
+        function->eraseFromParent();
+        return nullptr;
+    }
+
+    ir_builder->CreateRet(convert_value(body, definition.get_body().get_type(), TYPE_R64));
+    verifyFunction(*function);
+    return function;
+}
+
+static Value* partially_evaluate_call(const std::string &callee, const std::vector<Value*> &arguments)
+{
+    auto definition = function_definitions.find(callee);
+    if (definition == function_definitions.end() || definition->second->is_typed()) return nullptr;
+
+    size_t constant_count = 0;
+    for (Value* argument : arguments) constant_count += isa<ConstantFP>(argument);
+
+    if (constant_count == 0 && !arguments.empty()) return nullptr;
+
+    if (constant_count == arguments.size() && pure_functions.count(callee))
+    {
+        std::vector<double> values;
+        std::vector<uint64_t> bits;
+        for (Value* argument : arguments)
+        {
+            const APFloat &value = cast<ConstantFP>(argument)->getValueAPF();
+            values.push_back(value.convertToDouble());
+            bits.push_back(value.bitcastToAPInt().getZExtValue());
+        }
+
+        auto key = std::make_pair(callee, std::move(bits));
+        auto cached = folded_calls.find(key);
+        if (cached == folded_calls.end())
+        {
+            double result;
+            g_fold_steps_left = partial_eval_step_budget;
+            bool folded = fold_call(callee, values.data(), values.size(), 0, result);
+            cached = folded_calls.emplace(std::move(key), folded ? Optional<double>(result) : None).first;
+        }
+
+        if (cached->second) return ConstantFP::get(*llvm_context, APFloat(*cached->second));
+        return nullptr;
+    }
+
+    if (constant_count == arguments.size()) return nullptr;
+
+    Function* specialized = specialize(callee, *definition->second, arguments);
+    if (!specialized) return nullptr;
+
+    std::vector<Value*> dynamic_arguments;
+    for (Value* argument : arguments)
+    {
+        if (!isa<ConstantFP>(argument)) dynamic_arguments.push_back(argument);
+    }
+
+    return ir_builder->CreateCall(specialized, dynamic_arguments, "calltmp");
+}
+
+//===----------------------------------------------------------------------===//
+// Top-Level parsing and JIT driver
+//===----------------------------------------------------------------------===//
+
+// the target machine is only needed when we emit object files.
+static std::unique_ptr<TargetMachine> target_machine;
+
+/// stream_state_t - bookkeeping for the module that is currently being filled.
+struct stream_state_t
+{
+    size_t function_count = 0;
+    size_t estimated_bytes = 0;
+    size_t flush_count = 0;
+};
+
+static stream_state_t g_stream;
+
+
+// rough in-memory cost of an instruction (the Instruction itself, its operands/uses and
+// its share of the basic block / symbol table). only used to decide when to flush, so it
+// just has to be in the right ballpark.
+static const size_t approximate_bytes_per_instruction = 128;
+static const size_t approximate_bytes_per_function = 1024;
+
+static void initialize_module()
+{
+  // the old module and builders (if any) point into the old context, so drop them first.
+  g_debug_info = debug_info_t();
+  ir_builder.reset();
+  module.reset();
+
+  // Open a new context and module.
+  llvm_context = std::make_unique<LLVMContext>();
+  module = std::make_unique<Module>("my cool jit", *llvm_context);
+
+  if (target_machine)
+  {
+    module->setTargetTriple(target_machine->getTargetTriple().str());
+    module->setDataLayout(target_machine->createDataLayout());
+  }
+  else if (jit)
+  {
+    module->setDataLayout(jit->get_data_layout());
+  }
+
+  // Create a new ir_builder for the module.
+  ir_builder = std::make_unique<IRBuilder<>>(*llvm_context);
+
+  initialize_debug_info();
+}
+
+#ifndef KALEIDOSCOPE_LIBRARY
+
+static bool initialize_target_machine()
+{
+    InitializeNativeTarget();
+    InitializeNativeTargetAsmPrinter();
+
+    std::string target_triple = sys::getDefaultTargetTriple();
+    std::string error;
+    auto target = TargetRegistry::lookupTarget(target_triple, error);
+    if (!target)
+    {
+        fprintf(stderr, "Error: %s\n", error.c_str());
+        return false;
+    }
+
+    target_machine.reset(target->createTargetMachine(target_triple, "generic", "", TargetOptions(), Optional<Reloc::Model>(Reloc::PIC_)));
+    return true;
+}
+
+#endif // KALEIDOSCOPE_LIBRARY
+
+//===----------------------------------------------------------------------===//
+// "Library" functions that can be "extern'd" from user code.
+//===----------------------------------------------------------------------===//
+
+/// putchard - putchar that takes a double and returns 0.
+static double putchard(double x)
+{
+    fputc((char)x, stderr);
+    return 0;
+}
+
+/// printd - printf that takes a double prints it as "%f\n", returning 0.
+static double printd(double x)
+{
+    fprintf(stderr, "%f\n", x);
+    return 0;
+}
+
+static double interpret_call(void* record, const double* arguments);
+static void tier_up(void* record);
+
+static void initialize_jit()
+{
+    InitializeNativeTarget();
+    InitializeNativeTargetAsmPrinter();
+    InitializeNativeTargetAsmParser();
+
+    jit = exit_on_error(kaleidoscope::kaleidoscope_jit::create(g_options.profile));
+    exit_on_error(jit->define_host_symbol("putchard", (void*)&putchard));
+    exit_on_error(jit->define_host_symbol("printd", (void*)&printd));
+
+    if (g_options.tiered)
+    {
+        exit_on_error(jit->define_host_symbol("__interpret_call", (void*)&interpret_call));
+        exit_on_error(jit->define_host_symbol("__tier_up", (void*)&tier_up));
+    }
+}
+
+/// ensure_codegen - set up the JIT (with --jit) and the module, if that didn't happen yet.
+/// main() leaves this to the first item that needs code, so the prompt comes up without
+/// waiting for the native target and the JIT, and a run that never gets to generating
+/// code (it only has parse errors, or nothing at all) doesn't pay for them.
+static void ensure_codegen()
+{
+    if (module) return;
+
+    if (g_options.jit && !jit) initialize_jit();
+    initialize_module();
+}
+
+static bool codegen_callee_copies(GlobalValue::LinkageTypes linkage);
+static void run_interprocedural_optimization(Module &module, const char* description);
+static void forget_runtime_results();
+
+/// take_module - the current module, ready to go into the JIT. a fresh one takes its place.
+static orc::ThreadSafeModule take_module()
+{
+    finalize_debug_info();
+    orc::ThreadSafeModule thread_safe_module(std::move(module), std::move(llvm_context));
+    initialize_module();
+    return thread_safe_module;
+}
+
+/// prepared_definition_t - the module holding a new definition, on its way into the JIT.
+/// the pipelined driver compiles it to an object file before it gets there.
+struct prepared_definition_t
+{
+    orc::ThreadSafeModule module;
+    std::unique_ptr<MemoryBuffer> object;
+    std::string name;
+    std::string body_name;
+    source_location_t location; // of the definition, where the JIT's failures are reported.
+    bool optimize = false;
+};
+
+// every definition gets a resource tracker of its own, so that when a function is
+// redefined, the code, data and symbols of the old body can be freed. the versions name
+// the bodies; they belong to the front end, the trackers to the JIT side.
+static std::map<std::string, unsigned> definition_versions;
+static std::map<std::string, orc::ResourceTrackerSP> definition_trackers;
+
+/// prepare_definition - the front end's half of add_definition_to_jit: rename the body so
+/// the plain name is free for the stub, and (with --ipo) bring in copies of the callees
+/// for the inliner.
+static prepared_definition_t prepare_definition(Function* function, source_location_t location)
+{
+    prepared_definition_t prepared;
+    prepared.name = std::string(function->getName());
+    prepared.location = location;
+    prepared.optimize = g_options.ipo && codegen_callee_copies(GlobalValue::AvailableExternallyLinkage);
+
+    unsigned &version = definition_versions[prepared.name];
+    prepared.body_name = kaleidoscope::function_body_name(prepared.name, version++);
+    function->setName(prepared.body_name);
+
+    prepared.module = take_module();
+    emitted_definitions.insert(prepared.name);
+    return prepared;
+}
+
+/// optimize_definition - run --ipo over the module. this can drop the declarations of
+/// functions nobody calls anymore, but never the definition itself.
+static void optimize_definition(prepared_definition_t &prepared)
+{
+    if (!prepared.optimize) return;
+
+    prepared.module.withModuleDo([&](Module &module) { run_interprocedural_optimization(module, prepared.name.c_str()); });
+    prepared.optimize = false;
+}
+
+/// log_jit_error - report what the JIT ran into (like a call to an extern nobody defines)
+/// at location. this is the user's mistake, so it must not take the process down.
+static void log_jit_error(Error error, source_location_t location)
+{
+    // the cause (like "Symbols not found") goes to the session's error reporter, and the
+    // lookup only fails with what could not be materialized because of it.
+    for (const std::string &cause : jit->take_errors()) log_error(cause.c_str(), location);
+    log_error(toString(std::move(error)).c_str(), location);
+}
+
+/// install_definition - the JIT's half: add the module (or the object compiled from it)
+/// and route calls through the stub. with --lazy, the stub starts out at a trampoline and
+/// the body is only compiled (or linked) when something calls it.
+///
+/// for a redefinition, the stub is re-pointed at the new body and the old one is removed.
+/// we only get here between top-level items, so the old body can't be running. (with
+/// --lazy, the call-through trampoline of the old body is not given back; that is a few
+/// bytes per redefinition.)
+///
+/// returns whether the definition went in. if it didn't, the error is logged, its code
+/// is thrown away again, and an earlier definition (if any) stays in place.
+static bool install_definition(prepared_definition_t prepared)
+{
+    const std::string &name = prepared.name;
+
+    orc::ResourceTrackerSP tracker = jit->create_resource_tracker();
+    Error added = Error::success();
+    if (prepared.object)
+    {
+        added = jit->add_object(std::move(prepared.object), tracker);
+    }
+    else
+    {
+        optimize_definition(prepared);
+        added = jit->add_module(std::move(prepared.module), tracker);
+    }
+    if (added)
+    {
+        log_jit_error(std::move(added), prepared.location);
+        return false;
+    }
+
+    Expected<JITTargetAddress> target = g_options.lazy
+        ? jit->get_lazy_trampoline(name, prepared.body_name)
+        : jit->lookup(prepared.body_name);
+    if (!target)
+    {
+        log_jit_error(target.takeError(), prepared.location);
+        exit_on_error(tracker->remove());
+        return false;
+    }
+
+    bool redefined = jit->has_stub(name);
+    if (Error error = redefined ? jit->update_stub(name, *target) : jit->define_stub(name, *target))
+    {
+        log_jit_error(std::move(error), prepared.location);
+        exit_on_error(tracker->remove());
+        return false;
+    }
+
+    // functions from a library have no tracker of their own, so their old bodies stay.
+    orc::ResourceTrackerSP &old_tracker = definition_trackers[name];
+    if (redefined)
+    {
+        if (old_tracker) exit_on_error(old_tracker->remove());
+        forget_runtime_results();
+    }
+
+    old_tracker = std::move(tracker);
+    return true;
+}
+
+/// add_definition_to_jit - move the module holding the freshly generated function into the
+/// JIT and route calls to it through its stub. returns whether that worked.
+static bool add_definition_to_jit(Function* function, source_location_t location)
+{
+    return install_definition(prepare_definition(function, location));
+}
+
+/// saved_codegen_state_t - the front end's module (and friends), set aside while we
+/// generate code for something else in a module of its own.
+struct saved_codegen_state_t
+{
+    std::unique_ptr<LLVMContext> llvm_context;
+    std::unique_ptr<Module> module;
+    std::unique_ptr<IRBuilder<>> ir_builder;
+    std::map<std::string, named_value_t> named_values;
+    debug_info_t debug_info;
+};
+
+/// save_codegen_state - set the current module aside and start a fresh one.
+static saved_codegen_state_t save_codegen_state()
+{
+    saved_codegen_state_t state;
+    state.llvm_context = std::move(llvm_context);
+    state.module = std::move(module);
+    state.ir_builder = std::move(ir_builder);
+    state.named_values = named_values;
+    state.debug_info = std::move(g_debug_info);
+
+    initialize_module();
+    return state;
+}
+
+static void restore_codegen_state(saved_codegen_state_t state)
+{
+    g_debug_info = debug_info_t();
+    ir_builder.reset();
+    module.reset();
+    llvm_context = std::move(state.llvm_context);
+    module = std::move(state.module);
+    ir_builder = std::move(state.ir_builder);
+    named_values = std::move(state.named_values);
+    g_debug_info = std::move(state.debug_info);
+}
+
+// set when libmvec could be loaded, so the vectorizer may call its functions.
+static bool g_have_vector_math_library = false;
+
+/// run_module_passes - set up the analyses and run whatever build_pipeline adds to the
+/// pass manager over the module. with a target machine, the passes get its cost model
+/// (vector widths and so on), and libm calls can be mapped to libmvec.
+static void run_module_passes(
+    Module &module,
+    TargetMachine* target,
+    function_ref<void(PassBuilder &, ModulePassManager &)> build_pipeline)
+{
+    LoopAnalysisManager loop_analysis_manager;
+    FunctionAnalysisManager function_analysis_manager;
+    CGSCCAnalysisManager cgscc_analysis_manager;
+    ModuleAnalysisManager module_analysis_manager;
+
+    PassBuilder pass_builder(target);
+
+    TargetLibraryInfoImpl target_library_info(Triple(module.getTargetTriple()));
+    if (target && g_have_vector_math_library)
+    {
+        target_library_info.addVectorizableFunctionsFromVecLib(TargetLibraryInfoImpl::LIBMVEC_X86);
+    }
+    function_analysis_manager.registerPass([&] { return TargetLibraryAnalysis(target_library_info); });
+
+    pass_builder.registerModuleAnalyses(module_analysis_manager);
+    pass_builder.registerCGSCCAnalyses(cgscc_analysis_manager);
+    pass_builder.registerFunctionAnalyses(function_analysis_manager);
+    pass_builder.registerLoopAnalyses(loop_analysis_manager);
+    pass_builder.crossRegisterProxies(loop_analysis_manager, function_analysis_manager, cgscc_analysis_manager, module_analysis_manager);
+
+    ModulePassManager module_pass_manager;
+    build_pipeline(pass_builder, module_pass_manager);
+    module_pass_manager.run(module, module_analysis_manager);
+}
+
+/// optimize_module - run the default per-module pipeline at the given level.
+static void optimize_module(Module &module, OptimizationLevel level, TargetMachine* target = nullptr)
+{
+    run_module_passes(module, target, [level](PassBuilder &pass_builder, ModulePassManager &module_pass_manager)
+    {
+        module_pass_manager = pass_builder.buildPerModuleDefaultPipeline(level);
+    });
+}
+
+//===----------------------------------------------------------------------===//
+// Tiered execution
+//===----------------------------------------------------------------------===//
+
+// With --tiered, definitions are not compiled up front. Everything starts out in the
+// interpreter below, which walks the expr_ast tree directly. Every call of an interpreted
+// function bumps its call counter; at tier1_threshold the function is compiled without
+// optimization (tier 1), and the tier 1 code counts its own calls and asks for an
+// optimized recompile (tier 2) at tier2_threshold.
+//
+// Native code reaches a function through its stub, so a recompile just re-points the
+// stub; older code stays around since it may still be on the stack. The interpreter calls
+// native functions through the stub as well, and native code calls functions that are
+// still interpreted through __interpret_call.
+
+// the interpreter calls native code through plain function pointers, so we only go
+// native for functions whose arguments all fit in registers.
+static const size_t max_native_arity = 8;
+
+namespace {
+
+/// function_record_t - what the tiered engine knows about a function at runtime.
+struct function_record_t
+{
+    std::string name;
+    size_t arity = 0;
+
+    // null for externs. owned by function_definitions.
+    function_ast* definition = nullptr;
+
+    uint64_t call_count = 0;
+    int tier = 0;
+    bool tiering_failed = false;
+
+    // the stub (user functions, once compiled) or the host function (externs).
+    JITTargetAddress native_address = 0;
+};
+
+} // end anonymous namespace
+
+static std::map<std::string, std::unique_ptr<function_record_t>> function_records;
+
+static void compile_tier(function_record_t* record, int tier);
+static bool compile_baseline(function_record_t* record);
+
+/// find_function_record - the record for a user function or an extern. extern records
+/// are created on first use, and resolved against the host process.
+static function_record_t* find_function_record(const std::string &name)
+{
+    auto it = function_records.find(name);
+    if (it != function_records.end()) return it->second.get();
+
+    auto prototype = function_protos.find(name);
+    if (prototype == function_protos.end()) return nullptr;
+
+    auto address = jit->lookup(name);
+    if (!address)
+    {
+        consumeError(address.takeError());
+        return nullptr;
+    }
+
+    auto record = std::make_unique<function_record_t>();
+    record->name = name;
+    record->arity = prototype->second->get_arguments().size();
+    record->native_address = *address;
+    record->tiering_failed = true; // nothing to tier up.
+    return (function_records[name] = std::move(record)).get();
+}
+
+static function_record_t* find_interpreted_function(const std::string &name)
+{
+    auto it = function_records.find(name);
+    if (it == function_records.end()) return nullptr;
+
+    function_record_t* record = it->second.get();
+    if (!record->definition || record->native_address) return nullptr;
+
+    return record;
+}
+
+static double call_native(JITTargetAddress address, const double* a, size_t arity)
+{
+    switch (arity)
+    {
+        case 0: return ((double (*)())address)();
+        case 1: return ((double (*)(double))address)(a[0]);
+        case 2: return ((double (*)(double, double))address)(a[0], a[1]);
+        case 3: return ((double (*)(double, double, double))address)(a[0], a[1], a[2]);
+        case 4: return ((double (*)(double, double, double, double))address)(a[0], a[1], a[2], a[3]);
+        case 5: return ((double (*)(double, double, double, double, double))address)(a[0], a[1], a[2], a[3], a[4]);
+        case 6: return ((double (*)(double, double, double, double, double, double))address)(a[0], a[1], a[2], a[3], a[4], a[5]);
+        case 7: return ((double (*)(double, double, double, double, double, double, double))address)(a[0], a[1], a[2], a[3], a[4], a[5], a[6]);
+        case 8: return ((double (*)(double, double, double, double, double, double, double, double))address)(a[0], a[1], a[2], a[3], a[4], a[5], a[6], a[7]);
+    }
+
+    assert(false && "native call with too many arguments");
+    return 0;
+}
+
+/// call_function - call a function from the interpreter (or from native code through
+/// __interpret_call), compiling it first if it just got hot.
+static double call_function(function_record_t* record, const double* arguments)
+{
+    if (record->tier == 0 && !record->tiering_failed)
+    {
+        record->call_count += 1;
+        if (record->call_count >= g_options.tier1_threshold) compile_tier(record, 1);
+    }
+
+    if (record->native_address) return call_native(record->native_address, arguments, record->arity);
+
+    return record->definition->get_body().evaluate(arguments);
+}
+
+// entry points for native code. they take the record as an opaque pointer.
+static double interpret_call(void* record, const double* arguments)
+{
+    return call_function((function_record_t*)record, arguments);
+}
+
+static void tier_up(void* record)
+{
+    compile_tier((function_record_t*)record, 2);
+}
+
+static Value* record_constant(function_record_t* record)
+{
+    return ConstantExpr::getIntToPtr(
+        ConstantInt::get(Type::getInt64Ty(*llvm_context), (uint64_t)record),
+        Type::getInt8PtrTy(*llvm_context));
+}
+
+/// emit_interpreter_call - call an interpreted function from native code: spill the
+/// arguments to an array and hand it to __interpret_call together with the record.
+static Value* emit_interpreter_call(function_record_t* record, const std::vector<Value*> &arguments, source_location_t location)
+{
+    if (record->arity != arguments.size()) return log_error_v("Incorrect # arguments passed", location);
+
+    Type* double_type = Type::getDoubleTy(*llvm_context);
+    Function* function = ir_builder->GetInsertBlock()->getParent();
+
+    // allocas go in the entry block, so they are only made once.
+    IRBuilder<> entry_builder(&function->getEntryBlock(), function->getEntryBlock().begin());
+    AllocaInst* argument_array = entry_builder.CreateAlloca(
+        double_type,
+        entry_builder.getInt32(std::max<size_t>(arguments.size(), 1)),
+        "interpreter_arguments");
+
+    for (unsigned idx = 0; idx != arguments.size(); ++idx)
+    {
+        ir_builder->CreateStore(arguments[idx], ir_builder->CreateConstGEP1_32(double_type, argument_array, idx));
+    }
+
+    Function* bridge = module->getFunction("__interpret_call");
+    if (!bridge)
+    {
+        FunctionType* bridge_type = FunctionType::get(
+            double_type,
+            {Type::getInt8PtrTy(*llvm_context), PointerType::getUnqual(double_type)},
+            false);
+        bridge = Function::Create(bridge_type, Function::ExternalLinkage, "__interpret_call", module.get());
+    }
+
+    return ir_builder->CreateCall(bridge, {record_constant(record), argument_array}, "calltmp");
+}
+
+/// emit_tier_up_check - the prologue of tier 1 code: count the call, and ask for the
+/// optimized version once we hit tier2_threshold.
+static void emit_tier_up_check()
+{
+    function_record_t* record = g_tier_compile_record;
+    if (g_tier_compile_tier != 1) return;
+
+    Type* counter_type = Type::getInt64Ty(*llvm_context);
+    Value* counter_address = ConstantExpr::getIntToPtr(
+        ConstantInt::get(counter_type, (uint64_t)&record->call_count),
+        PointerType::getUnqual(counter_type));
+
+    Value* count = ir_builder->CreateLoad(counter_type, counter_address, "call_count");
+    count = ir_builder->CreateAdd(count, ConstantInt::get(counter_type, 1), "call_count");
+    ir_builder->CreateStore(count, counter_address);
+    Value* is_hot = ir_builder->CreateICmpEQ(count, ConstantInt::get(counter_type, g_options.tier2_threshold), "is_hot");
+
+    Function* function = ir_builder->GetInsertBlock()->getParent();
+    BasicBlock* tier_up_block = BasicBlock::Create(*llvm_context, "tier_up", function);
+    BasicBlock* body_block = BasicBlock::Create(*llvm_context, "body", function);
+    ir_builder->CreateCondBr(is_hot, tier_up_block, body_block);
+
+    ir_builder->SetInsertPoint(tier_up_block);
+    Function* tier_up_function = module->getFunction("__tier_up");
+    if (!tier_up_function)
+    {
+        FunctionType* tier_up_type = FunctionType::get(Type::getVoidTy(*llvm_context), {Type::getInt8PtrTy(*llvm_context)}, false);
+        tier_up_function = Function::Create(tier_up_type, Function::ExternalLinkage, "__tier_up", module.get());
+    }
+    ir_builder->CreateCall(tier_up_function, {record_constant(record)});
+    ir_builder->CreateBr(body_block);
+
+    ir_builder->SetInsertPoint(body_block);
+}
+
+/// compile_tier - generate code for the record's definition at the given tier, and point
+/// its stub at the result. we can be called in the middle of evaluating a top-level
+/// expression (or from native code), so the front end's module is set aside meanwhile.
+static void compile_tier(function_record_t* record, int tier)
+{
+    if (tier <= record->tier || record->tiering_failed) return;
+
+    saved_codegen_state_t saved_state = save_codegen_state();
+
+    g_tier_compile_record = record;
+    g_tier_compile_tier = tier;
+    Function* function = record->definition->codegen();
+    g_tier_compile_record = nullptr;
+
+    if (function)
+    {
+        if (tier >= 2) optimize_module(*module, OptimizationLevel::O2);
+
+        std::string body_name = record->name + ".tier" + std::to_string(tier);
+        function->setName(body_name);
+
+        finalize_debug_info();
+        exit_on_error(jit->add_module(orc::ThreadSafeModule(std::move(module), std::move(llvm_context))));
+        JITTargetAddress address = exit_on_error(jit->lookup(body_name));
+
+        if (!record->native_address)
+        {
+            exit_on_error(jit->define_stub(record->name, address));
+            record->native_address = exit_on_error(jit->lookup(record->name));
+        }
+        else
+        {
+            exit_on_error(jit->update_stub(record->name, address));
+        }
+
+        record->tier = tier;
+    }
+    else
+    {
+        record->tiering_failed = true;
+    }
+
+    restore_codegen_state(std::move(saved_state));
+}
+
+/// define_interpreted_function - the --tiered version of handling a definition: check
+/// it and keep the AST around for the interpreter.
+static void define_interpreted_function(std::unique_ptr<function_ast> definition)
+{
+    const prototype_ast &prototype = definition->get_prototype();
+    const std::string &name = prototype.getName();
+
+    if (definition->is_typed())
+    {
+        log_error("the interpreter only knows r64, typed definitions can't be used with --tiered", definition->get_location());
+        return;
+    }
+
+    auto record = std::make_unique<function_record_t>();
+    record->name = name;
+    record->arity = prototype.get_arguments().size();
+    record->tiering_failed = record->arity > max_native_arity;
+
+    // the record (and prototype) have to exist before binding, for recursive calls.
+    function_protos[name] = std::make_unique<prototype_ast>(prototype);
+    function_record_t* raw_record = (function_records[name] = std::move(record)).get();
+
+    if (!definition->get_body().bind(prototype.get_arguments()))
+    {
+        function_records.erase(name);
+        function_protos.erase(name);
+        return;
+    }
+
+    raw_record->definition = definition.get();
+    function_definitions[name] = std::move(definition);
+    emitted_definitions.insert(name);
+    fprintf(stderr, "Read function definition: %s\n", name.c_str());
+
+    if (g_options.baseline && !raw_record->tiering_failed) compile_baseline(raw_record);
+}
+
+bool number_expr_ast::bind(const std::vector<std::string> &parameters)
+{
+    return true;
+}
+
+double number_expr_ast::evaluate(const double* arguments)
+{
+    return this->value;
+}
+
+bool variable_expr_ast::bind(const std::vector<std::string> &parameters)
+{
+    for (size_t idx = 0; idx != parameters.size(); ++idx)
+    {
+        if (parameters[idx] == this->name)
+        {
+            this->argument_index = idx;
+            return true;
+        }
+    }
+
+    log_error("Unknown variable name", location);
+    return false;
+}
+
+double variable_expr_ast::evaluate(const double* arguments)
+{
+    return arguments[this->argument_index];
+}
+
+bool binary_expr_ast::bind(const std::vector<std::string> &parameters)
+{
+    if (!lhs->bind(parameters) || !rhs->bind(parameters)) return false;
+
+    switch (op)
+    {
+        case '+': case '-': case '*': case '<':
+            return true;
+        default:
+            log_error("invalid binary operator", location);
+            return false;
+    }
+}
+
+double binary_expr_ast::evaluate(const double* arguments)
+{
+    double lhs_value = lhs->evaluate(arguments);
+    double rhs_value = rhs->evaluate(arguments);
+
+    switch (op)
+    {
+        case '+': return lhs_value + rhs_value;
+        case '-': return lhs_value - rhs_value;
+        case '*': return lhs_value * rhs_value;
+        // unordered-or-less-than, like the fcmp ult codegen emits.
+        default: return !(lhs_value >= rhs_value) ? 1.0 : 0.0;
+    }
+}
+
+bool call_expr_ast::bind(const std::vector<std::string> &parameters)
+{
+    this->callee_record = find_function_record(this->callee);
+
+    if (!this->callee_record)
+    {
+        log_error("Unknown function referenced", location);
+        return false;
+    }
+
+    if (this->callee_record->arity != this->arguments.size())
+    {
+        log_error("Incorrect # arguments passed", location);
+        return false;
+    }
+
+    if (!function_protos[this->callee]->is_all_r64())
+    {
+        log_error("the interpreter can't call functions with typed prototypes", location);
+        return false;
+    }
+
+    if (!this->callee_record->definition && this->callee_record->arity > max_native_arity)
+    {
+        log_error("Too many arguments for an extern in tiered mode", location);
+        return false;
+    }
+
+    for (auto &argument : this->arguments)
+    {
+        if (!argument->bind(parameters)) return false;
+    }
+
+    return true;
+}
+
+double call_expr_ast::evaluate(const double* arguments)
+{
+    double values[max_native_arity];
+    std::vector<double> more_values;
+    double* argument_values = values;
+
+    if (this->arguments.size() > max_native_arity)
+    {
+        more_values.resize(this->arguments.size());
+        argument_values = more_values.data();
+    }
+
+    for (size_t idx = 0; idx != this->arguments.size(); ++idx)
+    {
+        argument_values[idx] = this->arguments[idx]->evaluate(arguments);
+    }
+
+    return call_function(this->callee_record, argument_values);
+}
+
+//===----------------------------------------------------------------------===//
+// Baseline compiler
+//===----------------------------------------------------------------------===//
+
+// With --baseline, the tiered engine skips the interpreter: a definition is compiled as
+// soon as it is read, straight from its bound expr_ast tree to x86-64 machine code, without
+// going through LLVM. That takes microseconds where an LLVM compile takes milliseconds, at
+// the price of code that keeps every value in memory. Baseline code counts its calls like
+// tier 1 code does, and is replaced by the optimized tier 2 at tier2_threshold.
+//
+// The code follows the System V calling convention, so stubs, the interpreter and LLVM code
+// call it like any other native function: the arguments arrive in xmm0-xmm7 and are spilled
+// to the frame, every expression leaves its value in xmm0, and the left operand of a binary
+// operator waits in a frame slot while the right one is computed (a call in there would
+// clobber every xmm register anyway).
+
+namespace {
+
+/// baseline_function_t - the code of the function being compiled, and its frame.
+struct baseline_function_t
+{
+    kaleidoscope::x86_64_assembler_t assembler;
+
+    // frame slots are below rbp, and are allocated and freed like a stack. arguments is
+    // the offset of the first argument; the others follow it.
+    int32_t arguments = 0;
+    int32_t frame_top = 0;
+    int32_t frame_bottom = 0;
+
+    /// allocate_slots - count consecutive slots, returns the offset of the first.
+    int32_t allocate_slots(size_t count)
+    {
+        frame_top -= int32_t(count * sizeof(double));
+        frame_bottom = std::min(frame_bottom, frame_top);
+        return frame_top;
+    }
+
+    void free_slots(size_t count) { frame_top += int32_t(count * sizeof(double)); }
+};
+
+} // end anonymous namespace
+
+// baseline code is never thrown away: like older tiers, it may still be on the stack.
+static kaleidoscope::code_arena_t baseline_code;
+
+/// compile_baseline - compile the record's definition and point its (new) stub at the
+/// result. false if there was no memory for the code; the function stays interpreted.
+static bool compile_baseline(function_record_t* record)
+{
+    baseline_function_t function;
+    kaleidoscope::x86_64_assembler_t &assembler = function.assembler;
+
+    assembler.push_rbp();
+    assembler.mov_rbp_rsp();
+    size_t frame_size = assembler.sub_rsp();
+
+    function.arguments = function.allocate_slots(record->arity);
+    for (unsigned idx = 0; idx != record->arity; ++idx)
+    {
+        assembler.movsd_store(function.arguments + idx * sizeof(double), idx);
+    }
+
+    // count the call, and ask for the optimized version once we hit tier2_threshold.
+    assembler.mov_rax((uint64_t)&record->call_count);
+    assembler.inc_qword_at_rax();
+    assembler.mov_rcx(g_options.tier2_threshold);
+    assembler.cmp_qword_at_rax_rcx();
+    size_t not_hot = assembler.jne();
+    assembler.mov_rdi((uint64_t)record);
+    assembler.mov_rax((uint64_t)&tier_up);
+    assembler.call_rax();
+    assembler.patch_jump(not_hot);
+
+    record->definition->get_body().emit_baseline(function);
+
+    assembler.leave();
+    assembler.ret();
+
+    // rsp is 16 byte aligned after pushing rbp; keep it that way for the calls we make.
+    assembler.patch_int32(frame_size, (-function.frame_bottom + 15) & ~15);
+
+    void* address = baseline_code.install(assembler.get_code());
+    if (!address) return false;
+
+    exit_on_error(jit->define_stub(record->name, pointerToJITTargetAddress(address)));
+    record->native_address = jit->get_stub_address(record->name);
+    record->tier = 1;
+    return true;
+}
+
+void number_expr_ast::emit_baseline(baseline_function_t &function) const
+{
+    uint64_t bits;
+    memcpy(&bits, &this->value, sizeof(bits));
+    function.assembler.mov_rax(bits);
+    function.assembler.movq_xmm0_rax();
+}
+
+void variable_expr_ast::emit_baseline(baseline_function_t &function) const
+{
+    function.assembler.movsd_load(0, function.arguments + this->argument_index * sizeof(double));
+}
+
+void binary_expr_ast::emit_baseline(baseline_function_t &function) const
+{
+    kaleidoscope::x86_64_assembler_t &assembler = function.assembler;
+
+    lhs->emit_baseline(function);
+    int32_t lhs_slot = function.allocate_slots(1);
+    assembler.movsd_store(lhs_slot, 0);
+
+    rhs->emit_baseline(function);
+    assembler.movapd_xmm1_xmm0();
+    assembler.movsd_load(0, lhs_slot);
+    function.free_slots(1);
+
+    switch (op)
+    {
+        case '+': assembler.addsd(); break;
+        case '-': assembler.subsd(); break;
+        case '*': assembler.mulsd(); break;
+        default:
+        {
+            // unordered-or-less-than, like the fcmp ult codegen emits: !(rhs <= lhs) is a
+            // mask, and the mask of 1.0 is 1.0 or 0.0.
+            assembler.cmpnlesd_xmm1_xmm0();
+            double one = 1.0;
+            uint64_t bits;
+            memcpy(&bits, &one, sizeof(bits));
+            assembler.mov_rax(bits);
+            assembler.movq_xmm0_rax();
+            assembler.andpd();
+            break;
+        }
+    }
+}
+
+void call_expr_ast::emit_baseline(baseline_function_t &function) const
+{
+    kaleidoscope::x86_64_assembler_t &assembler = function.assembler;
+
+    // the argument slots are allocated up front, so they are in order for __interpret_call.
+    size_t arity = this->arguments.size();
+    int32_t argument_slots = function.allocate_slots(arity);
+    for (size_t idx = 0; idx != arity; ++idx)
+    {
+        this->arguments[idx]->emit_baseline(function);
+        assembler.movsd_store(argument_slots + idx * sizeof(double), 0);
+    }
+
+    // a callee that is native now stays native; one that isn't (the function itself, say)
+    // may be by the time we run, which call_function sorts out.
+    if (this->callee_record->native_address)
+    {
+        for (size_t idx = 0; idx != arity; ++idx)
+        {
+            assembler.movsd_load(idx, argument_slots + idx * sizeof(double));
+        }
+        assembler.mov_rax(this->callee_record->native_address);
+    }
+    else
+    {
+        assembler.mov_rdi((uint64_t)this->callee_record);
+        assembler.lea_rsi(argument_slots);
+        assembler.mov_rax((uint64_t)&interpret_call);
+    }
+    assembler.call_rax();
+
+    function.free_slots(arity);
+}
+
+//===----------------------------------------------------------------------===//
+// Batch evaluation
+//===----------------------------------------------------------------------===//
+
+// evaluate_columns() runs one function over a lot of rows. Rather than calling the
+// scalar function once per row, we build a kernel
+//
+//     void <name>.__batch(double** columns, double* output, i64 begin, i64 end)
+//
+// that loops over the rows and calls a private copy of the function (and of every user
+// function it reaches), so the optimizer can inline everything into the loop and
+// vectorize it. Rows are split over a thread pool in chunks. --map is one front end for
+// it, kaleidoscope::evaluate_columns() (see kaleidoscope.h) the other.
+
+typedef void (*batch_kernel_t)(const double* const* columns, double* output, uint64_t begin, uint64_t end);
+
+static std::map<std::string, batch_kernel_t> batch_kernels;
+static orc::ResourceTrackerSP batch_kernel_tracker; // all of them, to throw them away at once.
+static std::unique_ptr<TargetMachine> jit_target_machine;
+static std::unique_ptr<ThreadPool> batch_thread_pool;
+
+// below this many rows per chunk, handing work to another thread isn't worth it.
+static const size_t min_batch_chunk_rows = 4096;
+
+/// codegen_callee_copies - fill in the bodies of every user function the module declares,
+/// until there is nothing left to fill in, giving the copies the given linkage.
+static bool codegen_callee_copies(GlobalValue::LinkageTypes linkage)
+{
+    bool changed = true;
+    while (changed)
+    {
+        changed = false;
+        for (auto &function : module->functions())
+        {
+            if (!function.isDeclaration() || function.hasLocalLinkage()) continue;
+
+            auto it = function_definitions.find(std::string(function.getName()));
+            if (it == function_definitions.end()) continue;
+
+            if (!it->second->codegen()) return false;
+            function.setLinkage(linkage);
+            changed = true;
+            break; // codegen added to the function list.
+        }
+    }
+
+    return true;
+}
+
+static batch_kernel_t compile_batch_kernel(const std::string &name)
+{
+    auto definition = function_definitions.find(name);
+    if (definition == function_definitions.end())
+    {
+        log_error("Unknown function referenced", source_location_t());
+        return nullptr;
+    }
+
+    if (!jit_target_machine)
+    {
+        auto target_machine_builder = exit_on_error(orc::JITTargetMachineBuilder::detectHost());
+        jit_target_machine = exit_on_error(target_machine_builder.createTargetMachine());
+
+        std::string error;
+        g_have_vector_math_library = !sys::DynamicLibrary::LoadLibraryPermanently("libmvec.so.1", &error);
+    }
+
+    saved_codegen_state_t saved_state = save_codegen_state();
+    module->setTargetTriple(jit_target_machine->getTargetTriple().str());
+
+    // memo tables would keep the loop from vectorizing, and the copies would get tables of
+    // their own anyway.
+    g_memoization_suppressed = true;
+    Function* function = definition->second->codegen();
+    bool copies_ok = function && codegen_callee_copies(GlobalValue::InternalLinkage);
+    g_memoization_suppressed = false;
+
+    if (!copies_ok)
+    {
+        restore_codegen_state(std::move(saved_state));
+        return nullptr;
+    }
+    function->setLinkage(Function::InternalLinkage);
+
+    LLVMContext &context = *llvm_context;
+    Type* double_type = Type::getDoubleTy(context);
+    Type* double_pointer_type = PointerType::getUnqual(double_type);
+    Type* index_type = Type::getInt64Ty(context);
+
+    std::string kernel_name = name + ".__batch";
+    FunctionType* kernel_type = FunctionType::get(
+        Type::getVoidTy(context),
+        {PointerType::getUnqual(double_pointer_type), double_pointer_type, index_type, index_type},
+        false);
+    Function* kernel = Function::Create(kernel_type, Function::ExternalLinkage, kernel_name, module.get());
+    kernel->addParamAttr(0, Attribute::NoAlias);
+    kernel->addParamAttr(1, Attribute::NoAlias);
+
+    Value* columns = kernel->getArg(0);
+    Value* output = kernel->getArg(1);
+    Value* begin = kernel->getArg(2);
+    Value* end = kernel->getArg(3);
+
+    BasicBlock* entry_block = BasicBlock::Create(context, "entry", kernel);
+    BasicBlock* loop_block = BasicBlock::Create(context, "loop", kernel);
+    BasicBlock* exit_block = BasicBlock::Create(context, "exit", kernel);
+
+    ir_builder->SetInsertPoint(entry_block);
+    std::vector<Value*> column_pointers;
+    for (unsigned idx = 0; idx != function->arg_size(); ++idx)
+    {
+        Value* column_address = ir_builder->CreateConstGEP1_32(double_pointer_type, columns, idx);
+        column_pointers.push_back(ir_builder->CreateLoad(double_pointer_type, column_address, "column"));
+    }
+    ir_builder->CreateCondBr(ir_builder->CreateICmpULT(begin, end), loop_block, exit_block);
+
+    ir_builder->SetInsertPoint(loop_block);
+    PHINode* row = ir_builder->CreatePHI(index_type, 2, "row");
+    row->addIncoming(begin, entry_block);
+
+    // the columns are doubles whatever the function takes, so convert on the way in and out.
+    const prototype_ast &prototype = definition->second->get_prototype();
+    std::vector<Value*> arguments;
+    for (size_t idx = 0; idx != column_pointers.size(); ++idx)
+    {
+        Value* argument = ir_builder->CreateLoad(double_type, ir_builder->CreateGEP(double_type, column_pointers[idx], row));
+        arguments.push_back(convert_value(argument, TYPE_R64, prototype.get_argument_type(idx)));
+    }
+    Value* result = ir_builder->CreateCall(function, arguments);
+    result = convert_value(result, prototype.get_return_type(), TYPE_R64);
+    ir_builder->CreateStore(result, ir_builder->CreateGEP(double_type, output, row));
+
+    Value* next_row = ir_builder->CreateAdd(row, ConstantInt::get(index_type, 1), "next_row");
+    row->addIncoming(next_row, loop_block);
+    ir_builder->CreateCondBr(ir_builder->CreateICmpULT(next_row, end), loop_block, exit_block);
+
+    ir_builder->SetInsertPoint(exit_block);
+    ir_builder->CreateRetVoid();
+
+    if (verifyFunction(*kernel, &errs()))
+    {
+        restore_codegen_state(std::move(saved_state));
+        log_error("batch kernel failed to verify", source_location_t());
+        return nullptr;
+    }
+
+    optimize_module(*module, OptimizationLevel::O3, jit_target_machine.get());
+
+    if (!batch_kernel_tracker) batch_kernel_tracker = jit->create_resource_tracker();
+    finalize_debug_info();
+    Error added = jit->add_module(orc::ThreadSafeModule(std::move(module), std::move(llvm_context)), batch_kernel_tracker);
+    restore_codegen_state(std::move(saved_state));
+
+    Expected<JITTargetAddress> address = added ? Expected<JITTargetAddress>(std::move(added)) : jit->lookup(kernel_name);
+    if (!address)
+    {
+        log_jit_error(address.takeError(), source_location_t());
+        return nullptr;
+    }
+    return (batch_kernel_t)*address;
+}
+
+/// evaluate_columns - output[row] = name(columns[0][row], columns[1][row], ...) for every
+/// row < row_count. there have to be as many columns as the function has arguments.
+static bool evaluate_columns(const std::string &name, const double* const* columns, size_t column_count, size_t row_count, double* output)
+{
+    auto prototype = function_protos.find(name);
+    // the function is named by the caller, not by a source, so there is nowhere to point.
+    if (prototype == function_protos.end() || !function_definitions.count(name))
+    {
+        log_error("Unknown function referenced", source_location_t());
+        return false;
+    }
+
+    if (prototype->second->get_arguments().size() != column_count)
+    {
+        log_error("Incorrect # arguments passed", source_location_t());
+        return false;
+    }
+
+    batch_kernel_t &kernel = batch_kernels[name];
+    if (!kernel) kernel = compile_batch_kernel(name);
+    if (!kernel)
+    {
+        batch_kernels.erase(name);
+        return false;
+    }
+
+    if (!batch_thread_pool) batch_thread_pool = std::make_unique<ThreadPool>();
+
+    size_t thread_count = batch_thread_pool->getThreadCount();
+    size_t chunk_rows = std::max(min_batch_chunk_rows, (row_count + thread_count * 4 - 1) / (thread_count * 4));
+
+    if (row_count <= chunk_rows)
+    {
+        kernel(columns, output, 0, row_count);
+        return true;
+    }
+
+    for (size_t begin = 0; begin < row_count; begin += chunk_rows)
+    {
+        size_t end = std::min(row_count, begin + chunk_rows);
+        batch_thread_pool->async([=] { kernel(columns, output, begin, end); });
+    }
+    batch_thread_pool->wait();
+
+    return true;
+}
+
+#ifndef KALEIDOSCOPE_LIBRARY
+
+/// map_csv_file - the command line front end for evaluate_columns: every line of the
+/// file is a row of comma separated arguments, the results go to stdout, one per line.
+static bool map_csv_file(const std::string &name, const std::string &path)
+{
+    std::ifstream file(path);
+    if (!file)
+    {
+        fprintf(stderr, "Error: could not open %s\n", path.c_str());
+        return false;
+    }
+
+    std::vector<std::vector<double>> columns;
+    size_t row_count = 0;
+    std::string line;
+    while (std::getline(file, line))
+    {
+        if (line.empty()) continue;
+
+        size_t column = 0;
+        const char* cursor = line.c_str();
+        while (true)
+        {
+            char* value_end = nullptr;
+            double value = strtod(cursor, &value_end);
+            if (value_end == cursor) break;
+
+            if (row_count == 0) columns.emplace_back();
+            if (column >= columns.size() || columns[column].size() != row_count)
+            {
+                fprintf(stderr, "Error: row %zu of %s has the wrong number of columns\n", row_count + 1, path.c_str());
+                return false;
+            }
+            columns[column++].push_back(value);
+
+            cursor = value_end;
+            while (*cursor == ' ' || *cursor == '\t') ++cursor;
+            if (*cursor != ',') break;
+            ++cursor;
+        }
+
+        if (column != columns.size())
+        {
+            fprintf(stderr, "Error: row %zu of %s has the wrong number of columns\n", row_count + 1, path.c_str());
+            return false;
+        }
+        row_count += 1;
+    }
+
+    std::vector<const double*> column_pointers;
+    for (auto &column : columns) column_pointers.push_back(column.data());
+
+    std::vector<double> output(row_count);
+    if (!evaluate_columns(name, column_pointers.data(), column_pointers.size(), row_count, output.data())) return false;
+
+    for (double value : output) printf("%f\n", value);
+    return true;
+}
+
+#endif // KALEIDOSCOPE_LIBRARY
+
+//===----------------------------------------------------------------------===//
+// Interprocedural optimization
+//===----------------------------------------------------------------------===//
+
+// With --ipo, modules go through an interprocedural pipeline before they are written out
+// or compiled: the inliner (with its usual cost model, at O2), argument promotion, IPSCCP
+// and dead argument elimination to clean up signatures and constant arguments, and
+// global DCE to drop whatever nobody uses anymore, unused extern declarations included.
+//
+// In AOT mode the whole module is available. With --export, everything that isn't
+// exported is internalized first, so unused definitions can go as well. In the JIT every
+// definition has a module of its own, so we put available_externally copies of everything
+// it calls in there: the inliner can use them, and whatever is left of them is dropped
+// before codegen, with the calls going through the stubs as usual.
+
+static size_t count_instructions(const Module &module)
+{
+    size_t count = 0;
+    for (const Function &function : module)
+    {
+        if (!function.hasAvailableExternallyLinkage()) count += function.getInstructionCount();
+    }
+    return count;
+}
+
+static size_t count_definitions(const Module &module)
+{
+    size_t count = 0;
+    for (const Function &function : module)
+    {
+        if (!function.isDeclaration() && !function.hasAvailableExternallyLinkage()) count += 1;
+    }
+    return count;
+}
+
+static void run_interprocedural_optimization(Module &module, const char* description)
+{
+    size_t instructions_before = count_instructions(module);
+    size_t functions_before = count_definitions(module);
+    // a library is linked against later, one function at a time, so it keeps everything.
+    bool internalize = !jit && !g_options.exports.empty() && g_options.library_output.empty();
+
+    run_module_passes(module, nullptr, [internalize](PassBuilder &pass_builder, ModulePassManager &module_pass_manager)
+    {
+        if (internalize)
+        {
+            module_pass_manager.addPass(InternalizePass([](const GlobalValue &value)
+            {
+                return g_options.exports.count(std::string(value.getName())) != 0;
+            }));
+        }
+
+        module_pass_manager.addPass(pass_builder.buildInlinerPipeline(OptimizationLevel::O2, ThinOrFullLTOPhase::None));
+        module_pass_manager.addPass(createModuleToPostOrderCGSCCPassAdaptor(ArgumentPromotionPass()));
+        module_pass_manager.addPass(IPSCCPPass());
+        module_pass_manager.addPass(DeadArgumentEliminationPass());
+        module_pass_manager.addPass(EliminateAvailableExternallyPass());
+        module_pass_manager.addPass(GlobalDCEPass());
+    });
+
+    emit_output(formatv("ipo {0}: {1} -> {2} instructions, {3} -> {4} functions\n",
+        description, instructions_before, count_instructions(module), functions_before, count_definitions(module)).str());
+}
+
+/// write_module - write the current module to path, as bitcode or as an object file.
+static bool write_module(const std::string &path, emit_kind_t emit_kind)
+{
+    std::error_code error_code;
+    raw_fd_ostream destination(path, error_code, sys::fs::OF_None);
+    if (error_code)
+    {
+        fprintf(stderr, "Error: could not open %s: %s\n", path.c_str(), error_code.message().c_str());
+        return false;
+    }
+
+    if (emit_kind == EMIT_BITCODE)
+    {
+        WriteBitcodeToFile(*module, destination);
+    }
+    else
+    {
+        legacy::PassManager pass_manager;
+        if (target_machine->addPassesToEmitFile(pass_manager, destination, nullptr, CGFT_ObjectFile))
+        {
+            fprintf(stderr, "Error: the target machine can't emit an object file\n");
+            return false;
+        }
+        pass_manager.run(*module);
+    }
+
+    destination.flush();
+    return true;
+}
+
+/// flush_module - emit everything defined since the last flush to <prefix>.<n>.bc / .o and
+/// start over with an empty module. whatever later code still calls is re-declared on
+/// demand from function_protos, so only the prototypes stay in memory. that goes for
+/// --partial-eval too: it forgets the ASTs and folded results of the flushed functions,
+/// and calls to them are just calls from then on.
+static void flush_module()
+{
+    if (g_stream.function_count == 0) return;
+
+    if (g_options.ipo) run_interprocedural_optimization(*module, ("chunk " + std::to_string(g_stream.flush_count)).c_str());
+
+    const char* extension = (g_options.emit_kind == EMIT_BITCODE) ? "bc" : "o";
+    std::string path = g_options.stream_prefix + "." + std::to_string(g_stream.flush_count) + "." + extension;
+
+    finalize_debug_info();
+    if (write_module(path, g_options.emit_kind))
+    {
+        fprintf(stderr, "flushed %zu functions (~%zu KB) to %s\n",
+            g_stream.function_count, g_stream.estimated_bytes / 1024, path.c_str());
+    }
+
+    for (auto &function : module->functions())
+    {
+        if (!function.isDeclaration()) emitted_definitions.insert(std::string(function.getName()));
+    }
+
+    function_definitions.clear();
+    folded_calls.clear();
+
+    g_stream.function_count = 0;
+    g_stream.estimated_bytes = 0;
+    g_stream.flush_count += 1;
+
+    initialize_module();
+}
+
+/// note_emitted_function - account for a freshly generated function, flushing if we went
+/// over either of the limits.
+static void note_emitted_function(Function* function)
+{
+    g_stream.function_count += 1;
+    g_stream.estimated_bytes += approximate_bytes_per_function + function->getInstructionCount() * approximate_bytes_per_instruction;
+
+    if (g_stream.function_count >= g_options.flush_function_count ||
+        g_stream.estimated_bytes >= g_options.flush_megabytes * 1024 * 1024)
+    {
+        flush_module();
+    }
+}
+
+/// can_redefine - whether a function that is already defined can get this definition.
+/// only the JIT can swap bodies, and callers compiled against the old body have to be
+/// able to call the new one.
+static bool can_redefine(const function_ast &definition)
+{
+    if (!jit || g_options.tiered)
+    {
+        log_error("Function cannot be redefined.", definition.get_location());
+        return false;
+    }
+
+    const prototype_ast &prototype = definition.get_prototype();
+    const prototype_ast &old_prototype = *function_protos[prototype.getName()];
+    bool same_signature = prototype.get_arguments().size() == old_prototype.get_arguments().size()
+        && prototype.get_return_type() == old_prototype.get_return_type();
+    for (size_t idx = 0; same_signature && idx != prototype.get_arguments().size(); ++idx)
+    {
+        same_signature = prototype.get_argument_type(idx) == old_prototype.get_argument_type(idx);
+    }
+
+    if (!same_signature)
+    {
+        log_error("a redefinition has to keep the argument count and types.", definition.get_location());
+        return false;
+    }
+
+    return true;
+}
+
+/// forget_compiled_results - drop what the front end derived from the old body of a
+/// function that is being redefined: its purity and folded results (of any function, since
+/// they may depend on it). the purity of its callers is rechecked once the new body's is
+/// known. code that inlined or folded the old body (--ipo, --partial-eval) keeps doing so.
+static void forget_compiled_results(const std::string &name)
+{
+    pure_functions.erase(name);
+    pure_function_callees.erase(name);
+    folded_calls.clear();
+}
+
+/// forget_runtime_results - once the new body is in place: drop memoized results (again
+/// of any function) and the batch kernels, which have private copies of the functions they
+/// call.
+static void forget_runtime_results()
+{
+    {
+        std::lock_guard<std::mutex> lock(memo_tables_mutex);
+        for (auto &entry : memo_tables)
+        {
+            std::fill(entry.second->slots.begin(), entry.second->slots.end(), 0);
+        }
+    }
+
+    batch_kernels.clear();
+    if (batch_kernel_tracker)
+    {
+        exit_on_error(batch_kernel_tracker->remove());
+        batch_kernel_tracker = nullptr;
+    }
+}
+
+/// ir_to_string - the textual IR of a function.
+static std::string ir_to_string(const Function &function)
+{
+    std::string text;
+    raw_string_ostream stream(text);
+    function.print(stream);
+    return stream.str();
+}
+
+/// define_function - everything that happens to a definition once it is parsed. the
+/// pipelined driver leaves the JIT's part of the work in `deferred`, for a later stage.
+static void define_function(std::unique_ptr<function_ast> function_ast, prepared_definition_t* deferred = nullptr)
+{
+    // whatever went into the JIT or an earlier flush is gone from the module, so the
+    // module can't tell us about redefinitions anymore.
+    const std::string &name = function_ast->get_prototype().getName();
+    bool is_redefinition = emitted_definitions.count(name) != 0;
+    if (is_redefinition)
+    {
+        if (!can_redefine(*function_ast)) return;
+        forget_compiled_results(name);
+    }
+
+    note_purity(*function_ast);
+    if (is_redefinition) recheck_purity();
+
+    if (g_options.tiered)
+    {
+        define_interpreted_function(std::move(function_ast));
+        return;
+    }
+
+    if (auto *function_ir = function_ast->codegen()) 
+    {
+        if (g_options.stream)
+        {
+            if (g_options.partial_eval)
+            {
+                function_definitions[function_ast->get_prototype().getName()] = std::move(function_ast);
+            }
+
+            // don't dump every function when we are chewing through a huge file.
+            note_emitted_function(function_ir);
+            return;
+        }
+
+        emit_output("Read function definition:" + ir_to_string(*function_ir) + "\n");
+
+        if (jit)
+        {
+            if (deferred) *deferred = prepare_definition(function_ir, function_ast->get_location());
+            else add_definition_to_jit(function_ir, function_ast->get_location());
+        }
+
+        if (jit || g_options.partial_eval || g_options.ipo)
+        {
+            function_definitions[function_ast->get_prototype().getName()] = std::move(function_ast);
+        }
+    }
 }
 
 static void handle_definition()
 {
-    if (auto function_ast = parse_definition())
+    size_t error_count = g_error_count;
+    if (auto function_ast = parse_definition())
+    {
+        ensure_codegen();
+        define_function(std::move(function_ast));
+    }
+
+    if (g_error_count != error_count) skip_to_next_item();
+}
+
+static void declare_extern(std::unique_ptr<prototype_ast> prototype_ast)
+{
+    // keep the prototype around so calls in later modules can re-declare it.
+    auto &prototype = *prototype_ast;
+    function_protos[prototype_ast->getName()] = std::move(prototype_ast);
+
+    if (auto* prototype_ir = prototype.codegen())
+    {
+        if (g_options.stream) return;
+
+        emit_output("read extern\n" + ir_to_string(*prototype_ir) + "\n");
+    }
+}
+
+static void handle_extern()
+{
+    size_t error_count = g_error_count;
+    if (auto prototype_ast = parse_extern())
+    {
+        ensure_codegen();
+        declare_extern(std::move(prototype_ast));
+    }
+
+    if (g_error_count != error_count) skip_to_next_item();
+}
+
+#ifndef KALEIDOSCOPE_LIBRARY
+
+/// report_jit_errors - log what the JIT ran into during the calls that just returned
+/// (bodies that failed to compile lazily), at the expression that made them. returns
+/// whether there was anything.
+static bool report_jit_errors(source_location_t location)
+{
+    std::vector<std::string> errors = jit->take_errors();
+    for (const std::string &error : errors) log_error(error.c_str(), location);
+    return !errors.empty();
+}
+
+/// run_top_level_expression - run the __anon_expr that was added to the JIT on tracker,
+/// print the result, and throw the code away again.
+static void run_top_level_expression(orc::ResourceTrackerSP tracker, source_location_t location)
+{
+    if (auto address = jit->lookup("__anon_expr"))
+    {
+        double (*top_level_function)() = (double (*)())*address;
+        double result = top_level_function();
+        if (!report_jit_errors(location)) fprintf(stderr, "Evaluated to %f\n", result);
+    }
+    else
+    {
+        log_jit_error(address.takeError(), location);
+    }
+
+    exit_on_error(tracker->remove());
+}
+
+#endif // KALEIDOSCOPE_LIBRARY
+
+//===----------------------------------------------------------------------===//
+// Function libraries
+//===----------------------------------------------------------------------===//
+
+// --emit-library <path> writes the definitions of a run to a bitcode file instead of
+// printing them, and --library <path> brings them back in a later run without parsing
+// them again. Bitcode keeps an index of where each function body starts, so loading a
+// library only reads the prototypes (like a block of externs), and the JIT reads a body
+// from the memory-mapped file the first time the function is called.
+//
+// Bitcode only has LLVM types, so every definition carries its prototype in an attribute,
+// in the return type first and then name:type per argument: "r64 x:r64 n:i32".
+
+#ifndef KALEIDOSCOPE_LIBRARY
+
+static const char* const prototype_attribute = "kaleidoscope-prototype";
+
+/// function_library_t - a loaded library. its module is lazy: the bodies stay in the file
+/// until they are asked for.
+struct function_library_t
+{
+    orc::ThreadSafeContext context;
+    std::unique_ptr<Module> module;
+};
+
+// what we loaded, for as long as the JIT may still want bodies out of it.
+static std::vector<std::shared_ptr<function_library_t>> function_libraries;
+
+/// write_library - record the prototypes of the definitions in the module and write it out.
+static bool write_library(const std::string &path)
+{
+    size_t count = 0;
+    for (Function &function : *module)
+    {
+        auto prototype = function_protos.find(std::string(function.getName()));
+        if (function.isDeclaration() || prototype == function_protos.end()) continue;
+
+        std::string description = internal_type_strings[prototype->second->get_return_type()];
+        for (size_t idx = 0; idx != prototype->second->get_arguments().size(); ++idx)
+        {
+            description += " " + prototype->second->get_arguments()[idx] + ":" + internal_type_strings[prototype->second->get_argument_type(idx)];
+        }
+        function.addFnAttr(prototype_attribute, description);
+        count += 1;
+    }
+
+    finalize_debug_info();
+    if (!write_module(path, EMIT_BITCODE)) return false;
+
+    fprintf(stderr, "wrote %zu functions to %s\n", count, path.c_str());
+    return true;
+}
+
+/// read_library_prototype - the prototype of a library function, or null if it isn't one
+/// of ours.
+static std::unique_ptr<prototype_ast> read_library_prototype(const Function &function)
+{
+    if (!function.hasFnAttribute(prototype_attribute)) return nullptr;
+
+    SmallVector<StringRef, 8> fields;
+    function.getFnAttribute(prototype_attribute).getValueAsString().split(fields, ' ');
+    if (fields.size() != function.arg_size() + 1) return nullptr;
+
+    internal_types return_type = find_internal_type(fields[0].str());
+    std::vector<std::string> arguments;
+    std::vector<internal_types> argument_types;
+    for (size_t idx = 1; idx != fields.size(); ++idx)
+    {
+        auto name_and_type = fields[idx].split(':');
+        arguments.push_back(name_and_type.first.str());
+        argument_types.push_back(find_internal_type(name_and_type.second.str()));
+        if (argument_types.back() == TYPE_INVALID) return nullptr;
+    }
+    if (return_type == TYPE_INVALID) return nullptr;
+
+    return std::make_unique<prototype_ast>(std::string(function.getName()), std::move(arguments), std::move(argument_types), return_type);
+}
+
+/// extract_library_function - a module with just the body of `name`, renamed to body_name.
+/// the JIT asks for it on the first call, from whichever thread makes that call.
+static Expected<orc::ThreadSafeModule> extract_library_function(function_library_t &library, const std::string &name, const std::string &body_name)
+{
+    auto lock = library.context.getLock();
+
+    Function* source = library.module->getFunction(name);
+    if (Error error = source->materialize()) return error;
+
+    auto extracted = std::make_unique<Module>(body_name, *library.context.getContext());
+    extracted->setDataLayout(library.module->getDataLayout());
+    extracted->setTargetTriple(library.module->getTargetTriple());
+
+    Function* body = Function::Create(source->getFunctionType(), Function::ExternalLinkage, body_name, extracted.get());
+    ValueToValueMapTy values;
+    for (size_t idx = 0; idx != source->arg_size(); ++idx) values[source->getArg(idx)] = body->getArg(idx);
+
+    // calls (to other library functions, to itself, to externs) go to declarations of the
+    // same names, so that they end up at the stubs like any other call.
+    for (Instruction &instruction : instructions(*source))
+    {
+        for (Value* operand : instruction.operands())
+        {
+            auto* callee = dyn_cast<Function>(operand);
+            if (callee && !values.count(callee))
+            {
+                values[callee] = extracted->getOrInsertFunction(callee->getName(), callee->getFunctionType()).getCallee();
+            }
+            else if (!callee && isa<GlobalValue>(operand))
+            {
+                return make_error<StringError>("library function " + name + " refers to a global variable", inconvertibleErrorCode());
+            }
+        }
+    }
+
+    SmallVector<ReturnInst*, 8> returns;
+    CloneFunctionInto(body, source, values, CloneFunctionChangeType::DifferentModule, returns);
+
+    // a body is only ever asked for once.
+    source->deleteBody();
+
+    return orc::ThreadSafeModule(std::move(extracted), library.context);
+}
+
+/// load_library - make the functions in the library at path callable. nothing but the
+/// prototypes is read; with the JIT, every function gets a stub that reads, compiles and
+/// links the body on the first call, whether or not --lazy was given.
+static bool load_library(const std::string &path)
+{
+    auto buffer = MemoryBuffer::getFile(path);
+    if (!buffer)
+    {
+        fprintf(stderr, "Error: could not open %s: %s\n", path.c_str(), buffer.getError().message().c_str());
+        return false;
+    }
+
+    auto library = std::make_shared<function_library_t>();
+    library->context = orc::ThreadSafeContext(std::make_unique<LLVMContext>());
+
+    auto lazy_module = getOwningLazyBitcodeModule(std::move(*buffer), *library->context.getContext());
+    if (!lazy_module)
+    {
+        fprintf(stderr, "Error: %s is not a function library: %s\n", path.c_str(), toString(lazy_module.takeError()).c_str());
+        return false;
+    }
+    library->module = std::move(*lazy_module);
+
+    // the bodies go on the default tracker, where they stay until exit. (adding symbols to
+    // any other tracker reserves room for exactly one more each time, which makes loading a
+    // large library quadratic.)
+    orc::ResourceTrackerSP tracker = jit ? jit->get_main_jit_dylib().getDefaultResourceTracker() : nullptr;
+
+    size_t count = 0;
+    for (Function &function : *library->module)
+    {
+        if (function.isDeclaration()) continue;
+
+        auto prototype = read_library_prototype(function);
+        if (!prototype) continue;
+
+        std::string name = prototype->getName();
+        if (function_protos.count(name))
+        {
+            fprintf(stderr, "Error: %s: %s is already defined\n", path.c_str(), name.c_str());
+            continue;
+        }
+
+        if (jit)
+        {
+            // the library body is version 0; a redefinition replaces it like any other.
+            std::string body_name = kaleidoscope::function_body_name(name);
+            definition_versions[name] = 1;
+
+            exit_on_error(jit->add_lazy_module(body_name, [library, name, body_name]
+            {
+                return extract_library_function(*library, name, body_name);
+            }, tracker));
+            exit_on_error(jit->define_stub(name, exit_on_error(jit->get_lazy_trampoline(name, body_name))));
+            emitted_definitions.insert(name);
+        }
+
+        function_protos[name] = std::move(prototype);
+        count += 1;
+    }
+
+    function_libraries.push_back(std::move(library));
+    fprintf(stderr, "loaded %zu functions from %s\n", count, path.c_str());
+    return true;
+}
+
+#endif // KALEIDOSCOPE_LIBRARY
+
+//===----------------------------------------------------------------------===//
+// Expression batching
+//===----------------------------------------------------------------------===//
+
+// With --batch-expressions n, runs of consecutive top-level expressions are compiled
+// and run as one module, instead of one module (and one JIT round trip) each:
+//
+//     void __anon_batch(double* results, i64 index)
+//     {
+//         switch (index) { case 0: results[0] = <expression 0>; return; ... }
+//     }
+//
+// The results are only printed once the whole batch ran, so only expressions that can't
+// have side effects (that only call pure functions) are batched. Anything else, and any
+// definition or extern, runs what is pending first. Errors are kept with their expression
+// and printed in order with the results.
+//
+// That makes a batch a set of expressions that depend on the definitions before it and
+// not on each other, so with --threads n they are handed to a pool of n threads in any
+// order; the definitions that end a batch are what orders them.
+//
+// An expression that fails takes what follows it up to the next item boundary with it,
+// like skip_to_next_item() does without batching. Those expressions were batched and ran
+// too (they have no side effects), but nothing is printed for them.
+
+#ifndef KALEIDOSCOPE_LIBRARY
+
+static std::vector<std::unique_ptr<function_ast>> pending_expressions;
+static std::vector<bool> pending_ends_item; // whether an item boundary follows each.
+static std::unique_ptr<kaleidoscope::work_stealing_pool_t> expression_pool;
+
+/// at_item_boundary - whether the current token ends an item: a `;`, the start of the next
+/// definition or extern, or the end of the input. without one, the next top-level
+/// expression follows right on the last item.
+static bool at_item_boundary()
+{
+    return g_current_token == ';' || g_current_token == TOKEN_DEF || g_current_token == TOKEN_EXTERN || g_current_token == TOKEN_EOF;
+}
+
+static bool can_batch_expression(const function_ast &expression)
+{
+    std::set<std::string> callees;
+    expression.get_body().collect_callees(callees);
+
+    for (const std::string &callee : callees)
+    {
+        if (!pure_functions.count(callee) && !known_math_functions.count(callee)) return false;
+    }
+
+    return true;
+}
+
+/// run_pending_expressions - run the batch and print what the expressions came to. true
+/// if the last one failed without an item boundary after it: then what follows is the
+/// rest of it.
+static bool run_pending_expressions()
+{
+    if (pending_expressions.empty()) return false;
+
+    // the errors are the pending expressions', not those of the item that made them run.
+    size_t error_count = g_error_count;
+
+    size_t count = pending_expressions.size();
+    std::vector<std::string> diagnostics(count);
+    std::vector<bool> failed(count);
+    std::vector<source_location_t> locations(count);
+
+    Type* double_type = Type::getDoubleTy(*llvm_context);
+    Type* index_type = Type::getInt64Ty(*llvm_context);
+    FunctionType* batch_type = FunctionType::get(Type::getVoidTy(*llvm_context), {PointerType::getUnqual(double_type), index_type}, false);
+    Function* batch = Function::Create(batch_type, Function::ExternalLinkage, "__anon_batch", module.get());
+    ir_builder->SetInsertPoint(BasicBlock::Create(*llvm_context, "entry", batch));
+
+    BasicBlock* done_block = BasicBlock::Create(*llvm_context, "done", batch);
+    SwitchInst* dispatch = ir_builder->CreateSwitch(batch->getArg(1), done_block, count);
+
+    // every expression goes into the batch function as a case of its own; a function per
+    // expression would cost about as much machine code generation as running them one by
+    // one. when an expression fails halfway, what it did emit has no side effects and
+    // never runs.
+    named_values.clear();
+    for (size_t idx = 0; idx != count; ++idx)
+    {
+        expr_ast &body = pending_expressions[idx]->get_body();
+        locations[idx] = pending_expressions[idx]->get_location();
+
+        BasicBlock* case_block = BasicBlock::Create(*llvm_context, "expression", batch);
+        dispatch->addCase(ConstantInt::get(cast<IntegerType>(index_type), idx), case_block);
+        ir_builder->SetInsertPoint(case_block);
+
+        g_diagnostics = &diagnostics[idx];
+        Value* result = body.codegen();
+        g_diagnostics = nullptr;
+
+        failed[idx] = !result;
+        if (!failed[idx])
+        {
+            result = convert_value(result, body.get_type(), TYPE_R64);
+            ir_builder->CreateStore(result, ir_builder->CreateConstGEP1_64(double_type, batch->getArg(0), idx));
+        }
+        ir_builder->CreateRetVoid();
+    }
+    pending_expressions.clear();
+    std::vector<bool> ends_item;
+    ends_item.swap(pending_ends_item);
+
+    ir_builder->SetInsertPoint(done_block);
+    ir_builder->CreateRetVoid();
+    verifyFunction(*batch);
+
+    // like a single expression, the whole batch goes away once it ran.
+    std::vector<double> results(count);
+    auto tracker = jit->create_resource_tracker();
+    Error added = jit->add_module(take_module(), tracker);
+    Expected<JITTargetAddress> address = added ? Expected<JITTargetAddress>(std::move(added)) : jit->lookup("__anon_batch");
+    void (*batch_function)(double*, uint64_t) = nullptr;
+    if (address)
+    {
+        batch_function = (void (*)(double*, uint64_t))*address;
+    }
+    else
+    {
+        // none of the batch can run, so every expression that got this far says why.
+        std::vector<std::string> errors = jit->take_errors();
+        errors.push_back(toString(address.takeError()));
+        for (size_t idx = 0; idx != count; ++idx)
+        {
+            if (failed[idx]) continue;
+
+            g_diagnostics = &diagnostics[idx];
+            for (const std::string &error : errors) log_error(error.c_str(), locations[idx]);
+            g_diagnostics = nullptr;
+            failed[idx] = true;
+        }
+    }
+
+    if (g_options.batch_threads && !expression_pool)
+    {
+        expression_pool = std::make_unique<kaleidoscope::work_stealing_pool_t>(g_options.batch_threads);
+    }
+
+    double* result_data = results.data();
+    for (size_t idx = 0; idx != count; ++idx)
+    {
+        if (failed[idx]) continue;
+
+        if (expression_pool)
+        {
+            expression_pool->submit([=] { batch_function(result_data, idx); });
+            continue;
+        }
+
+        batch_function(result_data, idx);
+        g_diagnostics = &diagnostics[idx];
+        failed[idx] = report_jit_errors(locations[idx]);
+        g_diagnostics = nullptr;
+    }
+
+    if (expression_pool)
+    {
+        expression_pool->wait();
+
+        // which of the threads' calls ran into what can't be told apart, so it all goes
+        // with the first expression that ran.
+        auto first = std::find(failed.begin(), failed.end(), false);
+        if (first != failed.end())
+        {
+            size_t idx = first - failed.begin();
+            g_diagnostics = &diagnostics[idx];
+            failed[idx] = report_jit_errors(locations[idx]);
+            g_diagnostics = nullptr;
+        }
+    }
+
+    exit_on_error(tracker->remove());
+
+    bool skipping = false;
+    for (size_t idx = 0; idx != count; ++idx)
+    {
+        bool skipped = skipping;
+        skipping = (skipped || failed[idx]) && !ends_item[idx];
+        if (skipped) continue;
+
+        if (!failed[idx]) fprintf(stderr, "Evaluated to %f\n", results[idx]);
+        else fputs(diagnostics[idx].c_str(), stderr);
+    }
+
+    g_error_count = error_count;
+    return skipping;
+}
+
+static void evaluate_top_level_expression() {
+  // with batching, a parse error has to wait for the results of what is pending.
+  std::string parse_diagnostics;
+  if (!pending_expressions.empty()) g_diagnostics = &parse_diagnostics;
+  auto top_level_expr_function_ast = parse_top_level_expr();
+  g_diagnostics = nullptr;
+
+  // with --tiered, top-level expressions are interpreted and need no code of their own.
+  if (top_level_expr_function_ast && !g_options.tiered) ensure_codegen();
+
+  if (top_level_expr_function_ast && g_options.batch_expressions)
+  {
+      if (can_batch_expression(*top_level_expr_function_ast))
+      {
+          pending_expressions.push_back(std::move(top_level_expr_function_ast));
+          pending_ends_item.push_back(at_item_boundary());
+          if (pending_expressions.size() >= g_options.batch_expressions && run_pending_expressions()) skip_to_next_item();
+          return;
+      }
+
+      // this expression may be the rest of a pending one that failed.
+      if (run_pending_expressions())
+      {
+          skip_to_next_item();
+          return;
+      }
+  }
+
+  if (!top_level_expr_function_ast)
+  {
+      if (!run_pending_expressions()) fputs(parse_diagnostics.c_str(), stderr);
+  }
+
+  // Evaluate a top-level expression into an anonymous function.
+  if (top_level_expr_function_ast)
+  {
+    if (g_options.tiered)
+    {
+        // top-level expressions run once, so they are always interpreted.
+        expr_ast &body = top_level_expr_function_ast->get_body();
+        if (body.is_typed())
+        {
+            log_error("the interpreter only knows r64, typed expressions can't be used with --tiered", body.get_location());
+            return;
+        }
+        if (body.bind({})) fprintf(stderr, "Evaluated to %f\n", body.evaluate(nullptr));
+        return;
+    }
+
+    if (auto* top_level_expr_function_ir = top_level_expr_function_ast->codegen())
+    {
+        if (g_options.stream)
+        {
+            top_level_expr_function_ir->eraseFromParent();
+            return;
+        }
+
+        if (jit)
+        {
+            // compile the anonymous function on its own tracker so we can throw it away
+            // once it ran.
+            auto tracker = jit->create_resource_tracker();
+            if (Error error = jit->add_module(take_module(), tracker))
+            {
+                log_jit_error(std::move(error), top_level_expr_function_ast->get_location());
+                return;
+            }
+            run_top_level_expression(tracker, top_level_expr_function_ast->get_location());
+            return;
+        }
+
+        fprintf(stderr, "read top-level-expression\n");
+        top_level_expr_function_ir->print(errs());
+        fprintf(stderr, "\n");
+
+        top_level_expr_function_ir->eraseFromParent();
+    }
+  }
+}
+
+static void handle_top_level_expression()
+{
+    size_t error_count = g_error_count;
+    evaluate_top_level_expression();
+    if (g_error_count != error_count) skip_to_next_item();
+}
+
+#endif // KALEIDOSCOPE_LIBRARY
+
+
+//===----------------------------------------------------------------------===//
+// Pipelined driver
+//===----------------------------------------------------------------------===//
+
+// With --pipeline, the work of main_loop() is spread over threads, connected by bounded
+// lock-free queues:
+//
+//  1. lex and parse the next top-level item,
+//  2. check it and generate its IR (the only thread that touches the front end's tables
+//     and module),
+//  3. optimize it and compile it to an object file,
+//
+// and the main thread links the objects into the JIT and runs the expressions. Items pass
+// through every stage in order, so a definition is in the JIT before anything after it
+// runs. What the earlier stages have to say about an item (prompts, IR, errors) is kept
+// with the item and printed by the main thread, so the output is the same as without
+// --pipeline.
+
+#ifndef KALEIDOSCOPE_LIBRARY
+
+namespace {
+
+/// pipeline_item_t - a top-level item on its way through the pipeline.
+struct pipeline_item_t
+{
+    // TOKEN_DEF, TOKEN_EXTERN, 0 for a top-level expression, or TOKEN_EOF at the end.
+    int kind = TOKEN_EOF;
+
+    // what stage 1 parsed: a definition or top-level expression, or an extern.
+    std::unique_ptr<function_ast> function;
+    std::unique_ptr<prototype_ast> prototype;
+
+    // what stage 2 generated and stage 3 compiled, if anything.
+    prepared_definition_t definition;
+    orc::ThreadSafeModule expression_module;
+    std::unique_ptr<MemoryBuffer> expression_object;
+
+    std::string output;
+    bool ends_item = true; // whether an item boundary follows, see at_item_boundary().
+};
+
+} // end anonymous namespace
+
+static const size_t pipeline_queue_capacity = 64;
+typedef kaleidoscope::spsc_queue_t<std::unique_ptr<pipeline_item_t>, pipeline_queue_capacity> pipeline_queue_t;
+
+/// parse_items - stage 1. the same loop as main_loop(), but only parsing.
+static void parse_items(pipeline_queue_t &parsed)
+{
+    std::string prompts;
+    while (true)
+    {
+        prompts += "ready> ";
+
+        // ignore top-level semicolons.
+        if (g_current_token == ';')
+        {
+            get_next_token();
+            continue;
+        }
+
+        auto item = std::make_unique<pipeline_item_t>();
+        item->output.swap(prompts);
+        item->kind = (g_current_token == TOKEN_DEF || g_current_token == TOKEN_EXTERN || g_current_token == TOKEN_EOF)
+            ? g_current_token
+            : 0;
+
+        g_diagnostics = &item->output;
+        switch (item->kind)
+        {
+            case TOKEN_EOF:    break;
+            case TOKEN_DEF:    item->function = parse_definition(); break;
+            case TOKEN_EXTERN: item->prototype = parse_extern(); break;
+            default:           item->function = parse_top_level_expr(); break;
+        }
+        g_diagnostics = nullptr;
+
+        if (item->kind != TOKEN_EOF && !item->function && !item->prototype) skip_to_next_item();
+        item->ends_item = at_item_boundary();
+
+        bool done = item->kind == TOKEN_EOF;
+        parsed.push(std::move(item));
+        if (done) return;
+    }
+}
+
+/// generate_items - stage 2. like skip_to_next_item() would have, it drops what follows
+/// an item that failed up to the next item boundary, which stage 1 parsed as items of
+/// their own.
+static void generate_items(pipeline_queue_t &parsed, pipeline_queue_t &generated)
+{
+    bool skipping = false;
+    while (true)
+    {
+        std::unique_ptr<pipeline_item_t> item = parsed.pop();
+
+        if (skipping)
+        {
+            skipping = !item->ends_item;
+            item->function.reset();
+            item->prototype.reset();
+            item->output.clear();
+        }
+
+        size_t error_count = g_error_count;
+        g_diagnostics = &item->output;
+        if (item->kind == TOKEN_DEF && item->function)
+        {
+            define_function(std::move(item->function), &item->definition);
+        }
+        else if (item->kind == TOKEN_EXTERN && item->prototype)
+        {
+            declare_extern(std::move(item->prototype));
+        }
+        else if (item->kind == 0 && item->function && item->function->codegen())
+        {
+            item->expression_module = take_module();
+        }
+        g_diagnostics = nullptr;
+        if (g_error_count != error_count) skipping = !item->ends_item;
+
+        bool done = item->kind == TOKEN_EOF;
+        generated.push(std::move(item));
+        if (done) return;
+    }
+}
+
+/// compile_items - stage 3. the JIT would compile the modules on the main thread, right
+/// before running them; this does it here instead, with a target machine of our own.
+static void compile_items(pipeline_queue_t &generated, pipeline_queue_t &compiled)
+{
+    auto target_machine_builder = exit_on_error(orc::JITTargetMachineBuilder::detectHost());
+    std::unique_ptr<TargetMachine> target = exit_on_error(target_machine_builder.createTargetMachine());
+    orc::SimpleCompiler compiler(*target);
+
+    auto compile = [&](orc::ThreadSafeModule &thread_safe_module)
+    {
+        auto object = thread_safe_module.withModuleDo([&](Module &module) { return compiler(module); });
+        thread_safe_module = orc::ThreadSafeModule();
+        return exit_on_error(std::move(object));
+    };
+
+    while (true)
+    {
+        std::unique_ptr<pipeline_item_t> item = generated.pop();
+
+        if (item->definition.module)
+        {
+            g_diagnostics = &item->output;
+            optimize_definition(item->definition);
+            g_diagnostics = nullptr;
+            item->definition.object = compile(item->definition.module);
+        }
+        if (item->expression_module) item->expression_object = compile(item->expression_module);
+
+        bool done = item->kind == TOKEN_EOF;
+        compiled.push(std::move(item));
+        if (done) return;
+    }
+}
+
+/// run_items - the main thread: install definitions and run expressions.
+static void run_items(pipeline_queue_t &compiled)
+{
+    while (true)
+    {
+        std::unique_ptr<pipeline_item_t> item = compiled.pop();
+
+        fputs(item->output.c_str(), stderr);
+        if (item->definition.object) install_definition(std::move(item->definition));
+        if (item->expression_object)
+        {
+            auto tracker = jit->create_resource_tracker();
+            if (Error error = jit->add_object(std::move(item->expression_object), tracker))
+            {
+                log_jit_error(std::move(error), item->function->get_location());
+            }
+            else
+            {
+                run_top_level_expression(tracker, item->function->get_location());
+            }
+        }
+
+        if (item->kind == TOKEN_EOF) return;
+    }
+}
+
+static void run_pipeline()
+{
+    auto parsed = std::make_unique<pipeline_queue_t>();
+    auto generated = std::make_unique<pipeline_queue_t>();
+    auto compiled = std::make_unique<pipeline_queue_t>();
+
+    std::thread parse_thread(parse_items, std::ref(*parsed));
+    std::thread generate_thread(generate_items, std::ref(*parsed), std::ref(*generated));
+    std::thread compile_thread(compile_items, std::ref(*generated), std::ref(*compiled));
+
+    // user code runs on the main thread, like it does without --pipeline.
+    run_items(*compiled);
+
+    parse_thread.join();
+    generate_thread.join();
+    compile_thread.join();
+}
+
+/// top ::= definition | external | expression | ';'
+static void main_loop()
+{
+    while (true) {
+        fprintf(stderr, "ready> ");
+        // only runs of top-level expressions are batched.
+        if (g_current_token == TOKEN_EOF || g_current_token == TOKEN_DEF || g_current_token == TOKEN_EXTERN)
+        {
+            run_pending_expressions();
+        }
+
+        switch (g_current_token) {
+        case TOKEN_EOF:
+        return;
+        case ';': // ignore top-level semicolons.
+        get_next_token();
+        break;
+        case TOKEN_DEF:
+        handle_definition();
+        break;
+        case TOKEN_EXTERN:
+        handle_extern();
+        break;
+        default:
+        handle_top_level_expression();
+        break;
+    }
+  }
+}
+
+#endif // KALEIDOSCOPE_LIBRARY
+
+
+
+
+
+//===----------------------------------------------------------------------===//
+// Compile server
+//===----------------------------------------------------------------------===//
+
+// With --serve <socket>, the parser stays up and runs what clients (see client.cc) send
+// it, so that only the first request pays for starting the process, loading LLVM and
+// setting up the JIT. All requests run in one session: what one request defines, the next
+// can call, and the memo tables and libraries stay warm.
+//
+// A request is everything a client writes until it shuts down its side of the socket; it
+// is run like main_loop() runs stdin, and the response is everything the run printed.
+// Connections are read and answered by a pool of serve_threads threads, but the front
+// end only takes one request at a time.
+
+static std::mutex front_end_mutex;
+
+#ifndef KALEIDOSCOPE_LIBRARY
+
+/// read_request - everything the client sends, until it is done sending.
+static bool read_request(int connection, std::string &request)
+{
+    char buffer[4096];
+    while (true)
+    {
+        ssize_t count = read(connection, buffer, sizeof(buffer));
+        if (count == 0) return true;
+        if (count < 0 && errno != EINTR) return false;
+        if (count > 0) request.append(buffer, count);
+    }
+}
+
+static bool write_response(int connection, const std::string &response)
+{
+    size_t written = 0;
+    while (written != response.size())
+    {
+        // a client that went away shouldn't take the server with it (no SIGPIPE).
+        ssize_t count = send(connection, response.data() + written, response.size() - written, MSG_NOSIGNAL);
+        if (count < 0 && errno != EINTR) return false;
+        if (count > 0) written += count;
+    }
+    return true;
+}
+
+/// run_request - run source through the front end, with stdin reading from it and stderr
+/// (where everything goes, down to printd) writing to the response.
+static std::string run_request(const std::string &source)
+{
+    std::lock_guard<std::mutex> lock(front_end_mutex);
+
+    // fmemopen doesn't take empty buffers, so there is always at least a newline.
+    std::string input_text = source + "\n";
+    FILE* input = fmemopen((void*)input_text.data(), input_text.size(), "r");
+    char* output_data = nullptr;
+    size_t output_size = 0;
+    FILE* output = open_memstream(&output_data, &output_size);
+
+    FILE* saved_stdin = stdin;
+    FILE* saved_stderr = stderr;
+    stdin = input;
+    stderr = output;
+
+    g_last_character = ' ';
+    g_last_character_location = {1, 0};
+    reset_errors();
+    fprintf(stderr, "ready> ");
+    get_next_token();
+    main_loop();
+
+    stdin = saved_stdin;
+    stderr = saved_stderr;
+    fclose(input);
+    fclose(output);
+
+    std::string response(output_data, output_size);
+    free(output_data);
+    return response;
+}
+
+static void serve_connection(int connection)
+{
+    std::string request;
+    if (read_request(connection, request)) write_response(connection, run_request(request));
+    close(connection);
+}
+
+/// run_server - listen on path until the process is killed.
+static int run_server(const std::string &path)
+{
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path))
+    {
+        fprintf(stderr, "Error: socket path %s is too long\n", path.c_str());
+        return 1;
+    }
+    strcpy(address.sun_path, path.c_str());
+
+    // a socket left behind by an earlier server is in the way of bind.
+    unlink(path.c_str());
+
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0 || bind(listener, (sockaddr*)&address, sizeof(address)) != 0 || listen(listener, 64) != 0)
+    {
+        fprintf(stderr, "Error: could not listen on %s: %s\n", path.c_str(), strerror(errno));
+        return 1;
+    }
+    fprintf(stderr, "serving on %s\n", path.c_str());
+
+    kaleidoscope::work_stealing_pool_t connections(g_options.serve_threads);
+    while (true)
+    {
+        int connection = accept(listener, nullptr, nullptr);
+        if (connection < 0)
+        {
+            if (errno == EINTR) continue;
+            fprintf(stderr, "Error: accept failed: %s\n", strerror(errno));
+            break;
+        }
+
+        connections.submit([connection] { serve_connection(connection); });
+    }
+
+    connections.wait();
+    close(listener);
+    return 1;
+}
+
+#endif // KALEIDOSCOPE_LIBRARY
+
+//===----------------------------------------------------------------------===//
+// Embedding API
+//===----------------------------------------------------------------------===//
+
+// kaleidoscope::compile() (see kaleidoscope.h) runs a source through the front end like
+// the server does, in one session for the whole process, with --jit semantics. So that
+// sources can't redefine each other's functions (and re-point the stubs callers already
+// have), the functions a source defines are renamed to __source<n>.<name> while it is
+// parsed. Externs keep their names.
+//
+// Results are cached on everything that goes into them. Entries are never removed, so the
+// diagnostics of an entry can be handed out by pointer. Failures aren't cached (the next
+// call tries again); their diagnostics are kept per thread, until its next failure.
+
+namespace {
+
+struct compiled_source_t
+{
+    void* address = nullptr;
+    std::string local_name; // what the function is called in the JIT.
+    std::string diagnostics;
+};
+
+} // end anonymous namespace
+
+static std::shared_mutex compile_cache_mutex;
+static std::unordered_map<std::string, compiled_source_t> compile_cache;
+static size_t g_source_count = 0;
+
+/// prototype_signature - the type of a function, like "r64(r64,i32)".
+static std::string prototype_signature(const prototype_ast &prototype)
+{
+    std::string signature = internal_type_strings[prototype.get_return_type()];
+    signature += "(";
+    for (size_t idx = 0; idx != prototype.get_arguments().size(); ++idx)
+    {
+        if (idx != 0) signature += ",";
+        signature += internal_type_strings[prototype.get_argument_type(idx)];
+    }
+    return signature + ")";
+}
+
+/// compile_source - the cache miss path of compile_symbol(): read the definitions and
+/// externs in source, and find name among the definitions.
+static void compile_source(const std::string &source, const std::string &name, const std::string &signature, const kaleidoscope::compile_options_t &options, compiled_source_t &result)
+{
+    std::lock_guard<std::mutex> lock(front_end_mutex);
+
+    if (!jit)
+    {
+        g_options.jit = true;
+        initialize_jit();
+        initialize_module();
+    }
+
+    options_t saved_options = g_options;
+    g_options.ipo = options.ipo;
+    g_options.partial_eval = options.partial_eval;
+    g_options.memoize = options.memoize;
+    g_options.hash_cons = options.hash_cons;
+
+    // fmemopen doesn't take empty buffers, so there is always at least a newline.
+    std::string input_text = source + "\n";
+    g_input = fmemopen((void*)input_text.data(), input_text.size(), "r");
+    g_last_character = ' ';
+    g_last_character_location = {1, 0};
+    reset_errors();
+    g_name_prefix = "__source" + std::to_string(++g_source_count) + ".";
+    g_local_names.clear();
+    g_diagnostics = &result.diagnostics;
+
+    get_next_token();
+    while (g_current_token != TOKEN_EOF)
+    {
+        if (g_current_token == ';') get_next_token();
+        else if (g_current_token == TOKEN_DEF) handle_definition();
+        else if (g_current_token == TOKEN_EXTERN) handle_extern();
+        else
+        {
+            log_error("only definitions and externs can be compiled");
+            break;
+        }
+    }
+
+    std::string local_name = local_function_name(name);
+
+    g_diagnostics = nullptr;
+    g_name_prefix.clear();
+    g_local_names.clear();
+    fclose(g_input);
+    g_input = nullptr;
+    g_options = saved_options;
+
+    auto definition = function_definitions.find(local_name);
+    if (local_name == name || definition == function_definitions.end())
+    {
+        result.diagnostics += "Error: the source does not define " + name + "\n";
+        return;
+    }
+
+    std::string actual_signature = prototype_signature(definition->second->get_prototype());
+    if (actual_signature != signature)
+    {
+        result.diagnostics += "Error: " + name + " is " + actual_signature + ", not " + signature + "\n";
+        return;
+    }
+
+    // a definition the JIT could not link (it calls an extern nobody defines, say) has
+    // said so already, and has no stub to find.
+    if (!jit->has_stub(local_name)) return;
+
+    Expected<JITTargetAddress> address = jit->lookup(local_name);
+    if (!address)
+    {
+        g_diagnostics = &result.diagnostics;
+        log_jit_error(address.takeError(), {0, 0});
+        g_diagnostics = nullptr;
+        return;
+    }
+
+    result.address = jitTargetAddressToPointer<void*>(*address);
+    result.local_name = local_name;
+}
+
+/// find_compiled_source - the cache entry for name in source, compiled if it wasn't yet.
+static const compiled_source_t &find_compiled_source(const std::string &source, const std::string &name, const std::string &signature, const kaleidoscope::compile_options_t &options)
+{
+    std::string key;
+    key += options.ipo ? '1' : '0';
+    key += options.partial_eval ? '1' : '0';
+    key += options.memoize ? '1' : '0';
+    key += options.hash_cons ? '1' : '0';
+    key += name + '\0' + signature + '\0' + source;
+
     {
-        if (auto *function_ir = function_ast->codegen()) 
-        {
-            fprintf(stderr, "Read function definition:");
-            function_ir->print(errs());
-            fprintf(stderr, "\n");
-        }
-      
-    } else
+        std::shared_lock<std::shared_mutex> lock(compile_cache_mutex);
+        auto it = compile_cache.find(key);
+        if (it != compile_cache.end()) return it->second;
+    }
+
+    // two threads that miss on the same key both compile; the second result is dropped.
+    compiled_source_t result;
+    compile_source(source, name, signature, options, result);
+
+    if (!result.address)
     {
-        // Skip token for error recovery.
-        get_next_token();
+        static thread_local compiled_source_t failed;
+        failed = std::move(result);
+        return failed;
     }
+
+    std::unique_lock<std::shared_mutex> lock(compile_cache_mutex);
+    return compile_cache.emplace(std::move(key), std::move(result)).first->second;
 }
 
-static void handle_extern()
+kaleidoscope::compiled_symbol_t kaleidoscope::compile_symbol(const std::string &source, const std::string &name, const std::string &signature, const compile_options_t &options)
 {
-    if (auto prototype_ast = parse_extern())
+    const compiled_source_t &compiled = find_compiled_source(source, name, signature, options);
+    return {compiled.address, &compiled.diagnostics};
+}
+
+bool kaleidoscope::evaluate_columns(const std::string &source, const std::string &name, const double* const* columns, size_t column_count, size_t row_count, double* output, std::string* diagnostics, const compile_options_t &options)
+{
+    std::string signature = "r64(";
+    for (size_t idx = 0; idx != column_count; ++idx) signature += idx == 0 ? "r64" : ",r64";
+    signature += ")";
+
+    const compiled_source_t &compiled = find_compiled_source(source, name, signature, options);
+    if (!compiled.address)
+    {
+        if (diagnostics) *diagnostics += compiled.diagnostics;
+        return false;
+    }
+
+    // the batch kernels are the front end's, like everything compile() makes.
+    std::lock_guard<std::mutex> lock(front_end_mutex);
+    std::string kernel_diagnostics;
+    g_diagnostics = &kernel_diagnostics;
+    bool evaluated = ::evaluate_columns(compiled.local_name, columns, column_count, row_count, output);
+    g_diagnostics = nullptr;
+
+    if (diagnostics) *diagnostics += kernel_diagnostics;
+    return evaluated;
+}
+
+//===----------------------------------------------------------------------===//
+// Incremental documents
+//===----------------------------------------------------------------------===//
+
+// A kaleidoscope::document_t (see kaleidoscope.h) is cut into items: every def or extern
+// token starts one, and the first one starts at the top of the text. Items keep their
+// tokens, and the ASTs and diagnostics the parser made of them.
+//
+// Lexing is stateless between tokens, so lexing from the start of any token gives the same
+// tokens as lexing the whole text did. An edit is re-lexed from the start of the item
+// before the one it is in (the edit might turn the def that starts its own item into
+// something else, or glue it to the last token of the item before) until
+// a def or extern turns up where an old item after the edit started, shifted by the edit.
+// From there on, the old items are still right; they only move.
+//
+// So that moving doesn't touch them, tokens, ASTs and diagnostics have lines relative to
+// their item (the first line of an item is line 1). Columns are as in the text.
+
+namespace {
+
+struct document_token_t
+{
+    int kind;
+    uint32_t offset; // from the start of the item.
+    uint32_t length;
+    source_location_t location; // relative to the item.
+};
+
+struct document_item_t
+{
+    size_t begin = 0;
+    source_location_t location = {1, 1}; // of the first token (or the top of the text).
+
+    std::vector<document_token_t> tokens;
+    std::vector<std::unique_ptr<function_ast>> definitions; // and top-level expressions.
+    std::vector<std::unique_ptr<prototype_ast>> externs;
+    std::vector<kaleidoscope::diagnostic_t> diagnostics; // relative to the item.
+};
+
+/// text_cursor_t - a position in a text, and the line and column it is at.
+struct text_cursor_t
+{
+    const std::string &text;
+    size_t position;
+    source_location_t location;
+
+    int peek() const { return position < text.size() ? (unsigned char)text[position] : EOF; }
+
+    void advance()
     {
-        if (auto* prototype_ir = prototype_ast->codegen())
+        if (text[position] == '\n')
+        {
+            location.line += 1;
+            location.column = 1;
+        }
+        else
         {
-            fprintf(stderr, "read extern\n");
-            prototype_ir->print(errs()); // this just means: print to stderr.
-            fprintf(stderr, "\n"); 
+            location.column += 1;
         }
-    } else
+        position += 1;
+    }
+};
+
+/// token_replay_t - the tokens of the item being parsed, for replay_token().
+struct token_replay_t
+{
+    const std::string* text = nullptr;
+    const document_item_t* item = nullptr;
+    size_t next = 0;
+};
+
+} // end anonymous namespace
+
+static token_replay_t g_token_replay;
+
+/// lex_text_token - get_token(), over a text instead of stdin. false at the end of it.
+static bool lex_text_token(text_cursor_t &cursor, int &kind, size_t &begin, source_location_t &location)
+{
+    while (true)
     {
-        // Skip token for error recovery.
-        get_next_token();
+        while (isspace(cursor.peek())) cursor.advance();
+        if (cursor.peek() != '#') break;
+
+        while (cursor.peek() != EOF && cursor.peek() != '\n' && cursor.peek() != '\r') cursor.advance();
+    }
+
+    int character = cursor.peek();
+    if (character == EOF) return false;
+
+    begin = cursor.position;
+    location = cursor.location;
+
+    if (isalpha(character))
+    {
+        while (isalnum(cursor.peek())) cursor.advance();
+
+        size_t length = cursor.position - begin;
+        kind = TOKEN_IDENTIFIER;
+        if (cursor.text.compare(begin, length, "def") == 0) kind = TOKEN_DEF;
+        else if (cursor.text.compare(begin, length, "extern") == 0) kind = TOKEN_EXTERN;
+        return true;
+    }
+
+    if (isdigit(character) || character == '.')
+    {
+        while (isdigit(cursor.peek()) || cursor.peek() == '.') cursor.advance();
+        while (isalnum(cursor.peek())) cursor.advance(); // type suffix.
+        kind = TOKEN_NUMBER;
+        return true;
     }
+
+    cursor.advance();
+    kind = character;
+    return true;
 }
 
-static void handle_top_level_expression() {
-  // Evaluate a top-level expression into an anonymous function.
-  if (auto top_level_expr_function_ast = parse_top_level_expr())
-  {
-    if (auto* top_level_expr_function_ir = top_level_expr_function_ast->codegen())
+/// replay_token - get_token(), for the item in g_token_replay.
+static int replay_token()
+{
+    const std::vector<document_token_t> &tokens = g_token_replay.item->tokens;
+    if (g_token_replay.next == tokens.size())
     {
-        fprintf(stderr, "read top-level-expression\n");
-        top_level_expr_function_ir->print(errs());
-        fprintf(stderr, "\n");
+        // errors at the end are reported at the last token.
+        if (!tokens.empty()) g_token_location = tokens.back().location;
+        return TOKEN_EOF;
+    }
 
-        top_level_expr_function_ir->eraseFromParent();
+    const document_token_t &token = tokens[g_token_replay.next++];
+    g_token_location = token.location;
+
+    std::string spelling = g_token_replay.text->substr(g_token_replay.item->begin + token.offset, token.length);
+    if (token.kind == TOKEN_IDENTIFIER)
+    {
+        g_identifier_string = spelling;
     }
-  } else
-  {
-    // Skip token for error recovery.
+    else if (token.kind == TOKEN_NUMBER)
+    {
+        size_t digits = 0;
+        while (digits != spelling.size() && (isdigit((unsigned char)spelling[digits]) || spelling[digits] == '.')) ++digits;
+
+        g_number_string = spelling.substr(0, digits);
+        g_number_suffix = spelling.substr(digits);
+        g_number_value = strtod(g_number_string.c_str(), 0);
+    }
+
+    return token.kind;
+}
+
+/// parse_document_item - what main_loop() does, but keeping the ASTs, and the errors with
+/// where they happened.
+static void parse_document_item(const std::string &text, document_item_t &item)
+{
+    item.definitions.clear();
+    item.externs.clear();
+    item.diagnostics.clear();
+
+    g_token_replay = {&text, &item, 0};
+    g_replaying_tokens = true;
+    // the errors are kept as diagnostics, this only keeps them off stderr.
+    std::string messages;
+    g_diagnostics = &messages;
+
     get_next_token();
-  }
+    while (g_current_token != TOKEN_EOF)
+    {
+        bool parsed = true;
+        messages.clear();
+        reset_errors();
+        if (g_current_token == ';')
+        {
+            get_next_token();
+            continue;
+        }
+        else if (g_current_token == TOKEN_DEF)
+        {
+            auto definition = parse_definition();
+            if ((parsed = bool(definition))) item.definitions.push_back(std::move(definition));
+        }
+        else if (g_current_token == TOKEN_EXTERN)
+        {
+            auto prototype = parse_extern();
+            if ((parsed = bool(prototype))) item.externs.push_back(std::move(prototype));
+        }
+        else
+        {
+            auto expression = parse_top_level_expr();
+            if ((parsed = bool(expression))) item.definitions.push_back(std::move(expression));
+        }
+
+        if (!parsed)
+        {
+            item.diagnostics.push_back({g_last_error_location.line, g_last_error_location.column, g_last_error});
+            skip_to_next_item();
+        }
+    }
+
+    g_diagnostics = nullptr;
+    g_replaying_tokens = false;
 }
 
+struct kaleidoscope::document_t::implementation_t
+{
+    std::string text;
+    std::vector<document_item_t> items;
+};
 
-/// top ::= definition | external | expression | ';'
-static void main_loop()
+kaleidoscope::document_t::document_t(const std::string &text)
+    :
+        implementation(std::make_unique<implementation_t>())
 {
-    while (true) {
-        fprintf(stderr, "ready> ");
-        switch (g_current_token) {
-        case TOKEN_EOF:
-        return;
-        case ';': // ignore top-level semicolons.
-        get_next_token();
-        break;
-        case TOKEN_DEF:
-        handle_definition();
-        break;
-        case TOKEN_EXTERN:
-        handle_extern();
-        break;
-        default:
-        handle_top_level_expression();
-        break;
-    }
-  }
+    implementation->items.emplace_back();
+    edit(0, 0, text);
 }
 
+kaleidoscope::document_t::~document_t() = default;
+
+kaleidoscope::document_t::edit_statistics_t kaleidoscope::document_t::edit(size_t begin, size_t end, const std::string &replacement)
+{
+    std::string &text = implementation->text;
+    std::vector<document_item_t> &items = implementation->items;
+
+    end = std::min(end, text.size());
+    begin = std::min(begin, end);
+    text.replace(begin, end - begin, replacement);
+    ptrdiff_t delta = ptrdiff_t(replacement.size()) - ptrdiff_t(end - begin);
+    size_t edit_end = begin + replacement.size(); // in the new text.
+
+    // the item before the one the edit starts in: the edit may take the def or extern
+    // away that starts its own item, which then becomes part of the one before it.
+    auto by_begin = [](const document_item_t &item, size_t offset) { return item.begin < offset; };
+    size_t first = std::lower_bound(items.begin(), items.end(), begin + 1, by_begin) - items.begin() - 1;
+    if (first != 0) first -= 1;
+
+    edit_statistics_t statistics;
+    std::vector<document_item_t> new_items(1);
+    new_items[0].begin = items[first].begin;
+    new_items[0].location = items[first].location;
+
+    // relative lines: where the item that is being lexed starts.
+    text_cursor_t cursor = {text, items[first].begin, items[first].location};
+    size_t reuse_from = items.size();
+    int line_delta = 0;
+
+    int kind;
+    size_t token_begin;
+    source_location_t location;
+    while (lex_text_token(cursor, kind, token_begin, location))
+    {
+        document_item_t* item = &new_items.back();
+        if ((kind == TOKEN_DEF || kind == TOKEN_EXTERN) && token_begin != item->begin)
+        {
+            if (token_begin >= edit_end)
+            {
+                size_t old_begin = token_begin - delta;
+                auto old_item = std::lower_bound(items.begin() + first + 1, items.end(), old_begin, by_begin);
+                if (old_item != items.end() && old_item->begin == old_begin && old_begin >= end && old_item->location.column == location.column)
+                {
+                    reuse_from = old_item - items.begin();
+                    line_delta = int(location.line) - int(old_item->location.line);
+                    break;
+                }
+            }
+
+            new_items.emplace_back();
+            item = &new_items.back();
+            item->begin = token_begin;
+            item->location = location;
+        }
+
+        source_location_t relative_location = {location.line - item->location.line + 1, location.column};
+        item->tokens.push_back({kind, uint32_t(token_begin - item->begin), uint32_t(cursor.position - token_begin), relative_location});
+        statistics.relexed_tokens += 1;
+    }
+
+    for (size_t idx = reuse_from; idx != items.size(); ++idx)
+    {
+        items[idx].begin += delta;
+        items[idx].location.line = unsigned(int(items[idx].location.line) + line_delta);
+    }
+    statistics.reused_items = items.size() - (reuse_from - first);
+
+    {
+        std::lock_guard<std::mutex> lock(front_end_mutex);
+        for (document_item_t &item : new_items) parse_document_item(text, item);
+    }
+    statistics.reparsed_items = new_items.size();
+
+    // usually there are as many items as before, and nothing after them has to move.
+    size_t old_count = reuse_from - first;
+    size_t common = std::min(old_count, new_items.size());
+    std::move(new_items.begin(), new_items.begin() + common, items.begin() + first);
+    if (old_count > common) items.erase(items.begin() + first + common, items.begin() + reuse_from);
+    else items.insert(items.begin() + reuse_from, std::make_move_iterator(new_items.begin() + common), std::make_move_iterator(new_items.end()));
+    return statistics;
+}
 
+const std::string &kaleidoscope::document_t::get_text() const
+{
+    return implementation->text;
+}
 
+size_t kaleidoscope::document_t::get_item_count() const
+{
+    return implementation->items.size();
+}
 
+std::vector<kaleidoscope::diagnostic_t> kaleidoscope::document_t::get_diagnostics() const
+{
+    std::vector<diagnostic_t> diagnostics;
+    for (const document_item_t &item : implementation->items)
+    {
+        for (const diagnostic_t &diagnostic : item.diagnostics)
+        {
+            diagnostics.push_back({item.location.line + diagnostic.line - 1, diagnostic.column, diagnostic.message});
+        }
+    }
+    return diagnostics;
+}
 
 // handle arbitrary top-level expressions.
 /// toplevelexpr ::= expression
@@ -713,19 +4968,278 @@ static void main_loop()
 
 
 
-int main()
+#ifndef KALEIDOSCOPE_LIBRARY
+
+static void print_usage(const char* program)
+{
+    fprintf(stderr,
+        "usage: %s [options] < input\n"
+        "  --stream <prefix>        write finished functions to <prefix>.<n>.bc/.o instead of keeping them\n"
+        "  --emit=bc|obj            what --stream writes (default: bc)\n"
+        "  --flush-functions <n>    flush after this many functions (default: 1000)\n"
+        "  --flush-mb <n>           flush after roughly this many megabytes of IR (default: 64)\n"
+        "  --jit                    compile and evaluate top-level expressions\n"
+        "  --lazy                   like --jit, but compile functions on their first call\n"
+        "  --tiered                 like --jit, but interpret first and only compile hot functions\n"
+        "  --baseline               like --tiered, but start functions off as quickly generated machine code\n"
+        "  --tier1-threshold <n>    calls before a function gets compiled (default: 100)\n"
+        "  --tier2-threshold <n>    calls before a function gets optimized (default: 10000)\n"
+        "  --memoize                cache the results of pure functions, print hit rates at exit\n"
+        "  --memo-size <n>          entries per memo table, rounded up to a power of two (default: 4096)\n"
+        "  --partial-eval           fold calls with constant arguments, specialize on constant arguments\n"
+        "  --hash-cons              generate code for repeated expressions within a definition once\n"
+        "  --ipo                    inline and optimize across functions (whole module, or per JIT definition)\n"
+        "  --export <function>      with --ipo, keep this function; all others may be internalized\n"
+        "  --batch-expressions <n>  like --jit, but run up to n consecutive top-level expressions at once\n"
+        "  --threads <n>            run the expressions of a batch on n threads (implies --batch-expressions 1024)\n"
+        "  --pipeline               like --jit, but parse, generate code, compile and run on separate threads\n"
+        "  --emit-library <path>    write the definitions to a function library instead of printing the module\n"
+        "  --library <path>         load a function library; bodies are only read when they are first called\n"
+        "  --debug-info             describe functions and source lines in DWARF\n"
+        "  --profile                like --jit --debug-info, and write a perf map and a jitdump file for perf\n"
+        "  --source <path>          read the program from path instead of stdin\n"
+        "  --serve <socket>         like --jit, but run what clients send to this Unix socket, in one session\n"
+        "  --serve-threads <n>      connections to handle at a time (default: 4)\n"
+        "  --map <function> <csv>   like --jit, then evaluate function over every row of the file\n",
+        program);
+}
+
+/// parse_options - returns false if the command line makes no sense.
+static bool parse_options(int argc, char* argv[])
+{
+    for (int idx = 1; idx < argc; ++idx)
+    {
+        const char* argument = argv[idx];
+        bool has_value = idx + 1 < argc;
+
+        if (strcmp(argument, "--stream") == 0 && has_value)
+        {
+            g_options.stream = true;
+            g_options.stream_prefix = argv[++idx];
+        }
+        else if (strcmp(argument, "--emit=bc") == 0)
+        {
+            g_options.emit_kind = EMIT_BITCODE;
+        }
+        else if (strcmp(argument, "--emit=obj") == 0)
+        {
+            g_options.emit_kind = EMIT_OBJECT;
+        }
+        else if (strcmp(argument, "--flush-functions") == 0 && has_value)
+        {
+            g_options.flush_function_count = std::max(1L, atol(argv[++idx]));
+        }
+        else if (strcmp(argument, "--flush-mb") == 0 && has_value)
+        {
+            g_options.flush_megabytes = std::max(1L, atol(argv[++idx]));
+        }
+        else if (strcmp(argument, "--jit") == 0)
+        {
+            g_options.jit = true;
+        }
+        else if (strcmp(argument, "--lazy") == 0)
+        {
+            g_options.jit = true;
+            g_options.lazy = true;
+        }
+        else if (strcmp(argument, "--tiered") == 0)
+        {
+            g_options.jit = true;
+            g_options.tiered = true;
+        }
+        else if (strcmp(argument, "--baseline") == 0)
+        {
+            g_options.jit = true;
+            g_options.tiered = true;
+            g_options.baseline = true;
+        }
+        else if (strcmp(argument, "--memoize") == 0)
+        {
+            g_options.memoize = true;
+        }
+        else if (strcmp(argument, "--memo-size") == 0 && has_value)
+        {
+            g_options.memo_table_size = PowerOf2Ceil(std::max(2L, atol(argv[++idx])));
+        }
+        else if (strcmp(argument, "--ipo") == 0)
+        {
+            g_options.ipo = true;
+        }
+        else if (strcmp(argument, "--export") == 0 && has_value)
+        {
+            g_options.exports.insert(argv[++idx]);
+        }
+        else if (strcmp(argument, "--partial-eval") == 0)
+        {
+            g_options.partial_eval = true;
+        }
+        else if (strcmp(argument, "--hash-cons") == 0)
+        {
+            g_options.hash_cons = true;
+        }
+        else if (strcmp(argument, "--map") == 0 && idx + 2 < argc)
+        {
+            g_options.jit = true;
+            g_options.map_function = argv[++idx];
+            g_options.map_path = argv[++idx];
+        }
+        else if (strcmp(argument, "--batch-expressions") == 0 && has_value)
+        {
+            g_options.jit = true;
+            g_options.batch_expressions = std::max(1L, atol(argv[++idx]));
+        }
+        else if (strcmp(argument, "--threads") == 0 && has_value)
+        {
+            g_options.jit = true;
+            g_options.batch_threads = std::max(1L, atol(argv[++idx]));
+        }
+        else if (strcmp(argument, "--pipeline") == 0)
+        {
+            g_options.jit = true;
+            g_options.pipeline = true;
+        }
+        else if (strcmp(argument, "--emit-library") == 0 && has_value)
+        {
+            g_options.library_output = argv[++idx];
+        }
+        else if (strcmp(argument, "--library") == 0 && has_value)
+        {
+            g_options.libraries.push_back(argv[++idx]);
+        }
+        else if (strcmp(argument, "--debug-info") == 0)
+        {
+            g_options.debug_info = true;
+        }
+        else if (strcmp(argument, "--profile") == 0)
+        {
+            g_options.jit = true;
+            g_options.debug_info = true;
+            g_options.profile = true;
+        }
+        else if (strcmp(argument, "--source") == 0 && has_value)
+        {
+            g_options.source_path = argv[++idx];
+        }
+        else if (strcmp(argument, "--serve") == 0 && has_value)
+        {
+            g_options.jit = true;
+            g_options.serve_path = argv[++idx];
+        }
+        else if (strcmp(argument, "--serve-threads") == 0 && has_value)
+        {
+            g_options.serve_threads = std::max(1L, atol(argv[++idx]));
+        }
+        else if (strcmp(argument, "--tier1-threshold") == 0 && has_value)
+        {
+            g_options.tier1_threshold = std::max(1L, atol(argv[++idx]));
+        }
+        else if (strcmp(argument, "--tier2-threshold") == 0 && has_value)
+        {
+            g_options.tier2_threshold = std::max(1L, atol(argv[++idx]));
+        }
+        else
+        {
+            return false;
+        }
+    }
+
+    // streaming writes everything out; there is nothing left in memory to run.
+    if (g_options.stream && g_options.jit) return false;
+    if (g_options.tiered && g_options.lazy) return false;
+    // a library holds definitions; there is nothing to write when they went into the JIT.
+    // and the interpreter can't call library functions, it has no AST for them.
+    if (!g_options.library_output.empty() && (g_options.jit || g_options.stream || g_options.memoize)) return false;
+    if (!g_options.libraries.empty() && g_options.tiered) return false;
+    // the server reads requests, not stdin, and has no end to run --map at.
+    if (!g_options.serve_path.empty() && (g_options.pipeline || !g_options.map_function.empty())) return false;
+    // --threads runs batches; without a batch size of its own it gets a generous one.
+    if (g_options.batch_threads && !g_options.batch_expressions) g_options.batch_expressions = 1024;
+    if (g_options.tiered && g_options.batch_expressions) return false;
+    // the memo tables are plain loads and stores, so threads could see each other's slots
+    // half written.
+    if (g_options.batch_threads && g_options.memoize) return false;
+    if (g_options.pipeline && (g_options.tiered || g_options.batch_expressions)) return false;
+    // interning a call asks whether the callee is pure, which the parser thread can't know
+    // before the definitions ahead of it are through code generation.
+    if (g_options.pipeline && g_options.hash_cons) return false;
+
+    return true;
+}
+
+int main(int argc, char* argv[])
 {
+    if (!parse_options(argc, argv))
+    {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    if (g_options.stream && g_options.emit_kind == EMIT_OBJECT)
+    {
+        if (!initialize_target_machine()) return 1;
+    }
+
+    if (!g_options.source_path.empty() && !freopen(g_options.source_path.c_str(), "r", stdin))
+    {
+        fprintf(stderr, "Error: could not open %s: %s\n", g_options.source_path.c_str(), strerror(errno));
+        return 1;
+    }
+
+    // libraries get their stubs in the JIT as they are loaded, the server is there to have
+    // everything warm, and the pipeline's threads share the module from the start. anything
+    // else sets up code generation on the first item that needs it (see ensure_codegen).
+    if (!g_options.libraries.empty() || !g_options.serve_path.empty() || g_options.pipeline) ensure_codegen();
+
+    for (const std::string &path : g_options.libraries)
+    {
+        if (!load_library(path)) return 1;
+    }
+
+    if (!g_options.serve_path.empty())
+    {
+        return run_server(g_options.serve_path);
+    }
+
     fprintf(stderr, "ready> ");
 
     get_next_token();
 
-    // Make the module, which holds all the code.
-    initialize_module();
+    if (g_options.pipeline) run_pipeline();
+    else main_loop();
 
-    main_loop();
+    // --jit runs are done once everything was run; the others still flush or print the
+    // module, even if nothing went into it.
+    if (!g_options.jit || !g_options.map_function.empty()) ensure_codegen();
+
+    if (g_options.stream)
+    {
+        // whatever is left over since the last flush.
+        flush_module();
+        return 0;
+    }
+
+    if (!g_options.map_function.empty())
+    {
+        bool mapped = map_csv_file(g_options.map_function, g_options.map_path);
+        print_memo_statistics();
+        return mapped ? 0 : 1;
+    }
+
+    print_memo_statistics();
+
+    // everything already went into the JIT.
+    if (g_options.jit) return 0;
+
+    if (g_options.ipo) run_interprocedural_optimization(*module, "module");
+
+    if (!g_options.library_output.empty()) return write_library(g_options.library_output) ? 0 : 1;
+
+    finalize_debug_info();
 
   // Print out all of the generated code.
     module->print(errs(), nullptr);
 
     return 0;
 }
+
+#endif // KALEIDOSCOPE_LIBRARY
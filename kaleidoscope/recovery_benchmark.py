@@ -0,0 +1,63 @@
+#!/usr/bin/env python3
+"""Time how parser gets through a large source where many items don't parse, and count
+the errors it reports on the way.
+
+    ./recovery_benchmark.py build/parser --items 20000 --broken 0.3
+
+Every item is a definition with a long body, followed by a call to it. A --broken
+fraction of the definitions has a stray token early in the body, so the parser has to
+find its way to the next item past the rest of it. parser runs with --tiered, which
+compiles nothing, so the time is the front end's. Pass more than one binary to compare
+them on the same input.
+
+Build with optimization (-DCMAKE_BUILD_TYPE=Release) for numbers that mean anything.
+"""
+
+import argparse
+import random
+import statistics
+import subprocess
+import sys
+import time
+
+
+def item(idx, broken, rng):
+    terms = ["x * %d.5 - y%s" % (term, "" if term % 3 else " # a comment\n") for term in range(40)]
+    if broken:
+        terms.insert(rng.randrange(1, 4), ")")
+    return "def f%d(x y) %s;\nf%d(1, 2);\n" % (idx, " + ".join(terms), idx)
+
+
+def program(items, broken, seed):
+    rng = random.Random(seed)
+    return "".join(item(idx, rng.random() < broken, rng) for idx in range(items)).encode()
+
+
+def time_run(parser, source):
+    start = time.perf_counter()
+    result = subprocess.run([parser, "--tiered"], input=source, stdout=subprocess.DEVNULL, stderr=subprocess.PIPE)
+    elapsed = time.perf_counter() - start
+
+    if result.returncode != 0:
+        sys.exit("%s failed: %s" % (parser, result.stderr.decode(errors="replace")[-2000:]))
+    return elapsed, result.stderr.count(b"Error")
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("parsers", nargs="+", help="paths to parser binaries")
+    parser.add_argument("--items", type=int, default=20000)
+    parser.add_argument("--broken", type=float, default=0.3, help="the fraction of definitions that don't parse")
+    parser.add_argument("--runs", type=int, default=3)
+    parser.add_argument("--seed", type=int, default=1)
+    arguments = parser.parse_args()
+
+    source = program(arguments.items, arguments.broken, arguments.seed)
+    print("%d items, %.1f MB" % (arguments.items, len(source) / 1e6))
+    for binary in arguments.parsers:
+        runs = [time_run(binary, source) for _ in range(arguments.runs)]
+        print("%-40s %8.3f s %8d errors" % (binary, statistics.median(elapsed for elapsed, _ in runs), runs[0][1]))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,74 @@
+#!/usr/bin/env python3
+"""Compare the latency of a small request sent to a running compile server with
+the latency of starting a fresh parser for it.
+
+    ./server_benchmark.py build/parser build/client --requests 200
+
+Every request defines a function under a new name and calls it, so the server
+compiles something each time, like a cold process does. Both sides are timed
+from the outside, including starting the client or the parser process.
+"""
+
+import argparse
+import os
+import statistics
+import subprocess
+import sys
+import tempfile
+import time
+
+
+def request_source(idx):
+    return b"def f%d(x y) x * y + %d;\nf%d(%d, 2);\n" % (idx, idx, idx, idx)
+
+
+def time_runs(command, requests):
+    latencies = []
+    for idx in range(requests):
+        start = time.perf_counter()
+        result = subprocess.run(command, input=request_source(idx), stdout=subprocess.DEVNULL, stderr=subprocess.PIPE)
+        latencies.append(time.perf_counter() - start)
+
+        if b"Evaluated to" not in result.stderr:
+            sys.exit("no result from %s: %s" % (" ".join(command), result.stderr.decode(errors="replace")))
+    return latencies
+
+
+def report(name, latencies):
+    latencies = sorted(latencies)
+    print("%-8s mean %7.2f ms   median %7.2f ms   p95 %7.2f ms" % (
+        name,
+        statistics.mean(latencies) * 1000,
+        statistics.median(latencies) * 1000,
+        latencies[int(len(latencies) * 0.95) - 1] * 1000))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("parser", help="path to the parser binary")
+    parser.add_argument("client", help="path to the client binary")
+    parser.add_argument("--requests", type=int, default=200)
+    arguments = parser.parse_args()
+
+    socket_path = os.path.join(tempfile.mkdtemp(), "kaleidoscope.sock")
+    server = subprocess.Popen([arguments.parser, "--serve", socket_path], stderr=subprocess.DEVNULL)
+    try:
+        deadline = time.time() + 10
+        while not os.path.exists(socket_path):
+            if time.time() > deadline or server.poll() is not None:
+                sys.exit("the server did not come up")
+            time.sleep(0.01)
+
+        cold = time_runs([arguments.parser, "--jit"], arguments.requests)
+        warm = time_runs([arguments.client, socket_path], arguments.requests)
+    finally:
+        server.kill()
+        server.wait()
+
+    report("cold", cold)
+    report("server", warm)
+    print("speedup (median): %.1fx" % (statistics.median(cold) / statistics.median(warm)))
+
+
+if __name__ == "__main__":
+    main()
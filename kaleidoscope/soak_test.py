@@ -0,0 +1,108 @@
+#!/usr/bin/env python3
+"""Feed the JIT a long stream of top-level expressions (and every so often a
+redefinition) and record its resident memory along the way.
+
+    ./soak_test.py build/parser --expressions 1000000 --output soak
+
+writes soak.csv (expressions sent, resident KB) and, if matplotlib is around,
+soak.png. With the JIT freeing anonymous expressions and superseded bodies, the
+curve should level off after warming up instead of growing with the input.
+"""
+
+import argparse
+import subprocess
+import sys
+import threading
+import time
+
+
+def resident_kb(pid):
+    with open("/proc/%d/status" % pid) as status:
+        for line in status:
+            if line.startswith("VmRSS:"):
+                return int(line.split()[1])
+    return 0
+
+
+def write_input(process, expressions, redefine_every, progress):
+    stdin = process.stdin
+    stdin.write(b"def f(x) x + 1;\ndef g(x y) f(x) * y;\n")
+
+    batch = []
+    for idx in range(expressions):
+        if redefine_every and idx % redefine_every == 0:
+            batch.append(b"def f(x) x + %d;\n" % idx)
+        batch.append(b"g(%d, %d) + %d.5;\n" % (idx, idx % 7, idx))
+
+        if len(batch) >= 1000:
+            stdin.write(b"".join(batch))
+            batch.clear()
+            progress[0] = idx + 1
+
+    stdin.write(b"".join(batch))
+    stdin.close()
+    progress[0] = expressions
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("parser", help="path to the parser binary")
+    parser.add_argument("--expressions", type=int, default=1000000)
+    parser.add_argument("--redefine-every", type=int, default=1000, help="0 to never redefine")
+    parser.add_argument("--interval", type=float, default=0.25, help="seconds between samples")
+    parser.add_argument("--mode", default="--jit", help="--jit or --lazy")
+    parser.add_argument("--output", default="soak")
+    arguments = parser.parse_args()
+
+    process = subprocess.Popen(
+        [arguments.parser, arguments.mode],
+        stdin=subprocess.PIPE, stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+
+    progress = [0]
+    writer = threading.Thread(
+        target=write_input,
+        args=(process, arguments.expressions, arguments.redefine_every, progress))
+    writer.start()
+
+    # the pipe is small, so what has been written is close to what has been read.
+    samples = []
+    while process.poll() is None:
+        try:
+            samples.append((progress[0], resident_kb(process.pid)))
+        except (FileNotFoundError, ProcessLookupError):
+            break
+        time.sleep(arguments.interval)
+
+    writer.join()
+    process.wait()
+
+    with open(arguments.output + ".csv", "w") as csv:
+        csv.write("expressions,resident_kb\n")
+        for expressions, kb in samples:
+            csv.write("%d,%d\n" % (expressions, kb))
+
+    if samples:
+        print("resident memory: %d KB at start, %d KB peak, %d KB at the end"
+              % (samples[0][1], max(kb for _, kb in samples), samples[-1][1]))
+
+    try:
+        import matplotlib
+        matplotlib.use("Agg")
+        import matplotlib.pyplot as plt
+    except ImportError:
+        print("no matplotlib, only wrote %s.csv" % arguments.output)
+        return process.returncode
+
+    figure, axes = plt.subplots()
+    axes.plot([e for e, _ in samples], [kb / 1024.0 for _, kb in samples])
+    axes.set_xlabel("top-level expressions")
+    axes.set_ylabel("resident memory (MB)")
+    axes.set_title("parser %s, redefinition every %d expressions" % (arguments.mode, arguments.redefine_every))
+    figure.savefig(arguments.output + ".png")
+    print("wrote %s.csv and %s.png" % (arguments.output, arguments.output))
+
+    return process.returncode
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,66 @@
+#ifndef INCLUDED_SPSC_QUEUE_
+#define INCLUDED_SPSC_QUEUE_
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <thread>
+#include <utility>
+
+// A bounded queue between exactly one producer thread and one consumer thread. Each side
+// only ever writes its own index, so push and pop need no locks: the release store of an
+// index publishes the slot it covers, and the other side picks it up with an acquire load.
+
+namespace kaleidoscope {
+
+template <typename T, size_t capacity>
+class spsc_queue_t
+{
+    static_assert(capacity != 0 && (capacity & (capacity - 1)) == 0, "capacity has to be a power of two");
+
+    T slots[capacity];
+
+    // both only ever grow; the slot is the index modulo capacity. they live on cache lines
+    // of their own so the producer and the consumer don't keep stealing each other's line.
+    alignas(64) std::atomic<size_t> head{0}; // next slot to pop, written by the consumer.
+    alignas(64) std::atomic<size_t> tail{0}; // next slot to push, written by the producer.
+
+    // waiting spins for a bit, and then backs off to sleeping, so that an idle REPL
+    // (blocked on input) doesn't keep the other threads busy.
+    static void wait(unsigned &attempt)
+    {
+        attempt += 1;
+        if (attempt < 64) std::this_thread::yield();
+        else std::this_thread::sleep_for(std::chrono::microseconds(attempt < 1024 ? 50 : 1000));
+    }
+
+public:
+    /// push - add value at the back, waiting while the queue is full.
+    void push(T value)
+    {
+        size_t position = tail.load(std::memory_order_relaxed);
+
+        unsigned attempt = 0;
+        while (position - head.load(std::memory_order_acquire) == capacity) wait(attempt);
+
+        slots[position & (capacity - 1)] = std::move(value);
+        tail.store(position + 1, std::memory_order_release);
+    }
+
+    /// pop - take the value at the front, waiting while the queue is empty.
+    T pop()
+    {
+        size_t position = head.load(std::memory_order_relaxed);
+
+        unsigned attempt = 0;
+        while (tail.load(std::memory_order_acquire) == position) wait(attempt);
+
+        T value = std::move(slots[position & (capacity - 1)]);
+        head.store(position + 1, std::memory_order_release);
+        return value;
+    }
+};
+
+} // end namespace kaleidoscope
+
+#endif
@@ -0,0 +1,113 @@
+#!/usr/bin/env python3
+"""Measure how long parser takes to come up: the time to the first prompt, and to the
+result of the first expression, from a cold and from a warm page cache.
+
+    ./startup_benchmark.py build/parser /tmp/components/parser --runs 20
+
+Every run starts parser --jit, waits for "ready> ", then sends a definition and a call
+and waits for "Evaluated to". A cold run first drops the binary and the shared libraries
+it loads from the page cache (posix_fadvise, so no root needed; pages some other process
+has mapped stay), a warm run follows right after another run.
+
+Build both with optimization (-DCMAKE_BUILD_TYPE=Release), one of them with
+-DKALEIDOSCOPE_LLVM_COMPONENTS=ON or -DKALEIDOSCOPE_STATIC=ON, to compare link modes.
+"""
+
+import argparse
+import os
+import select
+import statistics
+import subprocess
+import sys
+import time
+
+SOURCE = b"def twice(x) x * 2;\ntwice(21);\n"
+
+
+def loaded_files(parser):
+    """the binary and the shared libraries ldd says it loads."""
+    files = [os.path.realpath(parser)]
+    result = subprocess.run(["ldd", parser], stdout=subprocess.PIPE, stderr=subprocess.DEVNULL)
+    for line in result.stdout.decode().splitlines():
+        words = line.split()
+        if "=>" in words and len(words) > words.index("=>") + 1:
+            path = words[words.index("=>") + 1]
+            if os.path.isabs(path):
+                files.append(os.path.realpath(path))
+    return files
+
+
+def drop_from_page_cache(files):
+    for path in files:
+        try:
+            fd = os.open(path, os.O_RDONLY)
+        except OSError:
+            continue
+        try:
+            os.posix_fadvise(fd, 0, 0, os.POSIX_FADV_DONTNEED)
+        finally:
+            os.close(fd)
+
+
+def wait_for(process, output, text, deadline):
+    """read stderr until text shows up in it."""
+    fd = process.stderr.fileno()
+    while text not in output:
+        remaining = deadline - time.perf_counter()
+        if remaining <= 0 or not select.select([fd], [], [], remaining)[0]:
+            sys.exit("timed out waiting for %r, got: %s" % (text, output.decode(errors="replace")))
+        chunk = os.read(fd, 65536)
+        if not chunk:
+            sys.exit("parser exited before %r, got: %s" % (text, output.decode(errors="replace")))
+        output += chunk
+    return output
+
+
+def time_run(parser):
+    """seconds to the first prompt and to the first result."""
+    start = time.perf_counter()
+    process = subprocess.Popen([parser, "--jit"], stdin=subprocess.PIPE, stdout=subprocess.DEVNULL, stderr=subprocess.PIPE)
+    deadline = start + 60
+
+    output = wait_for(process, b"", b"ready> ", deadline)
+    prompt = time.perf_counter() - start
+
+    process.stdin.write(SOURCE)
+    process.stdin.flush()
+    wait_for(process, output, b"Evaluated to", deadline)
+    result = time.perf_counter() - start
+
+    process.stdin.close()
+    process.stderr.close()
+    process.wait()
+    return prompt, result
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("parsers", nargs="+", help="paths to parser binaries")
+    parser.add_argument("--runs", type=int, default=10)
+    arguments = parser.parse_args()
+
+    print("%-40s %-5s %10s %10s" % ("binary", "cache", "prompt", "result"))
+    for binary in arguments.parsers:
+        files = loaded_files(binary)
+        for cache in ("cold", "warm"):
+            prompts = []
+            results = []
+            for _ in range(arguments.runs):
+                if cache == "cold":
+                    drop_from_page_cache(files)
+                else:
+                    time_run(binary)
+                prompt, result = time_run(binary)
+                prompts.append(prompt)
+                results.append(result)
+
+            print("%-40s %-5s %8.1f ms %8.1f ms" % (binary, cache,
+                statistics.median(prompts) * 1e3, statistics.median(results) * 1e3))
+    print("(medians of %d runs)" % arguments.runs)
+
+
+if __name__ == "__main__":
+    main()
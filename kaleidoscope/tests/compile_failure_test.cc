@@ -0,0 +1,38 @@
+#include "../kaleidoscope.h"
+
+#include <cstdio>
+#include <string>
+
+// A source that can't be linked (it calls an extern nobody defines) is a failed compile:
+// an empty function and diagnostics, not the end of the program that asked. ctest runs it,
+// see CMakeLists.txt.
+
+static const char* const unresolved_source = "extern nosuch(x);\ndef g(x) nosuch(x);\n";
+
+static bool check(bool condition, const char* what, const std::string &diagnostics)
+{
+    if (!condition) fprintf(stderr, "%s, diagnostics:\n%s", what, diagnostics.c_str());
+    return condition;
+}
+
+int main()
+{
+    auto g = kaleidoscope::compile<double(double)>(unresolved_source, "g");
+    if (!check(!g, "an unresolved extern compiled", g.get_diagnostics())) return 1;
+    if (!check(g.get_diagnostics().find("Symbols not found: [ nosuch ]") != std::string::npos, "the extern isn't named", g.get_diagnostics())) return 1;
+
+    // failures aren't cached, so this compiles (and fails) again.
+    auto again = kaleidoscope::compile<double(double)>(unresolved_source, "g");
+    if (!check(!again && !again.get_diagnostics().empty(), "the second try didn't fail the same way", again.get_diagnostics())) return 1;
+
+    double row = 1, result = 0;
+    const double* columns[] = {&row};
+    std::string diagnostics;
+    bool evaluated = kaleidoscope::evaluate_columns(unresolved_source, "g", columns, 1, 1, &result, &diagnostics);
+    if (!check(!evaluated && !diagnostics.empty(), "evaluate_columns ran an unresolved extern", diagnostics)) return 1;
+
+    auto fine = kaleidoscope::compile<double(double)>("def g(x) x + 1;", "g");
+    if (!check(fine && fine(1) == 2, "a good source didn't compile after the failures", fine.get_diagnostics())) return 1;
+
+    return 0;
+}
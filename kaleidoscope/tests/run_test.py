@@ -0,0 +1,65 @@
+#!/usr/bin/env python3
+"""Run parser over a test input and compare what it evaluated, printed and reported with
+the expected output next to it (tests/<name>.k goes with tests/<name>.expected).
+
+    ./tests/run_test.py build/parser tests/modes.k --tiered
+    ./tests/run_test.py --update build/parser tests/modes.k --jit
+
+Prompts and IR are dropped before comparing: the lines that count are results
+("Evaluated to ..."), errors, and what printd printed. So every mode that runs the
+input has to come up with the same lines as --jit does. --update writes the expected
+output instead of comparing with it.
+
+ctest runs every tests/*.k in each of the modes on its "# modes:" line, see
+CMakeLists.txt.
+"""
+
+import argparse
+import difflib
+import os
+import re
+import subprocess
+import sys
+import tempfile
+
+KEPT_LINE = re.compile(r"^(Evaluated to |Error|-?[0-9]+\.[0-9]+$)")
+
+
+def kept_lines(output):
+    lines = output.replace("ready> ", "").splitlines()
+    return [line for line in lines if KEPT_LINE.match(line)]
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--update", action="store_true", help="write the expected output")
+    parser.add_argument("parser", help="path to the parser binary")
+    parser.add_argument("input", help="the test input, a .k file")
+    parser.add_argument("arguments", nargs=argparse.REMAINDER, help="what to run parser with")
+    arguments = parser.parse_args()
+
+    expected_path = os.path.splitext(arguments.input)[0] + ".expected"
+    # in a directory of its own, for whatever the run writes (--stream files, say).
+    with open(arguments.input, "rb") as source, tempfile.TemporaryDirectory() as directory:
+        result = subprocess.run([os.path.abspath(arguments.parser)] + arguments.arguments, stdin=source,
+            stdout=subprocess.DEVNULL, stderr=subprocess.PIPE, cwd=directory, timeout=120)
+
+    if result.returncode != 0:
+        sys.exit("parser exited with %d:\n%s" % (result.returncode, result.stderr.decode(errors="replace")[-2000:]))
+
+    actual = kept_lines(result.stderr.decode(errors="replace"))
+    if arguments.update:
+        with open(expected_path, "w") as expected_file:
+            expected_file.write("".join(line + "\n" for line in actual))
+        return
+
+    with open(expected_path) as expected_file:
+        expected = expected_file.read().splitlines()
+
+    if actual != expected:
+        sys.stdout.writelines(line + "\n" for line in difflib.unified_diff(expected, actual, expected_path, "parser " + " ".join(arguments.arguments), lineterm=""))
+        sys.exit(1)
+
+
+if __name__ == "__main__":
+    main()
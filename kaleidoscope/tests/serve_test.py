@@ -0,0 +1,55 @@
+#!/usr/bin/env python3
+"""Check that a request the JIT can't link is answered with an error, and that the
+server goes on to answer the next one.
+
+    ./tests/serve_test.py build/parser build/client
+
+ctest runs it, see CMakeLists.txt.
+"""
+
+import argparse
+import os
+import subprocess
+import sys
+import tempfile
+import time
+
+# (request, what its response has to contain)
+REQUESTS = [
+    (b"extern nosuch(x); nosuch(1);\n", b"Error: 1:19: Symbols not found: [ nosuch ]"),
+    (b"extern nosuch(x); def g(x) nosuch(x);\n", b"Error: 1:19: Symbols not found: [ nosuch ]"),
+    (b"def g(x) x + 1; g(1);\n", b"Evaluated to 2.000000"),
+]
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("parser", help="path to the parser binary")
+    parser.add_argument("client", help="path to the client binary")
+    arguments = parser.parse_args()
+
+    with tempfile.TemporaryDirectory() as directory:
+        socket_path = os.path.join(directory, "kaleidoscope.sock")
+        server = subprocess.Popen([arguments.parser, "--serve", socket_path], stderr=subprocess.DEVNULL)
+        try:
+            deadline = time.time() + 10
+            while not os.path.exists(socket_path):
+                if time.time() > deadline or server.poll() is not None:
+                    sys.exit("the server did not come up")
+                time.sleep(0.01)
+
+            for request, expected in REQUESTS:
+                result = subprocess.run([arguments.client, socket_path], input=request,
+                    stdout=subprocess.DEVNULL, stderr=subprocess.PIPE, timeout=60)
+                response = result.stderr.decode(errors="replace")
+                if expected not in result.stderr:
+                    sys.exit("%r: expected %r in the response, got:\n%s" % (request, expected, response))
+                if server.poll() is not None:
+                    sys.exit("%r: the server exited with %d" % (request, server.returncode))
+        finally:
+            server.kill()
+            server.wait()
+
+
+if __name__ == "__main__":
+    main()
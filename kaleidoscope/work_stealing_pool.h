@@ -0,0 +1,165 @@
+#ifndef INCLUDED_WORK_STEALING_POOL_
+#define INCLUDED_WORK_STEALING_POOL_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A thread pool where every worker has a deque of its own. A worker takes its newest task
+// first (the one most likely to still be in its cache), and when it runs out, it steals
+// the oldest task of another worker. Tasks submitted from outside the pool are dealt out
+// round robin; tasks submitted by a worker go to its own deque.
+
+namespace kaleidoscope {
+
+class work_stealing_pool_t
+{
+    typedef std::function<void()> task_t;
+
+    struct worker_queue_t
+    {
+        std::mutex mutex;
+        std::deque<task_t> tasks;
+    };
+
+    std::vector<std::unique_ptr<worker_queue_t>> queues;
+    std::vector<std::thread> threads;
+    size_t next_queue = 0;
+
+    // queued: tasks in any deque. unfinished: tasks submitted but not done yet. sleepers
+    // wait on `wake`, wait() waits on `idle`.
+    std::mutex state_mutex;
+    std::condition_variable wake;
+    std::condition_variable idle;
+    std::atomic<size_t> queued{0};
+    size_t unfinished = 0;
+    bool stopping = false;
+
+    // which pool (if any) the current thread works for, and which of its workers it is.
+    struct worker_identity_t
+    {
+        const work_stealing_pool_t* pool = nullptr;
+        size_t index = 0;
+    };
+
+    static worker_identity_t &current_worker()
+    {
+        thread_local worker_identity_t identity;
+        return identity;
+    }
+
+    bool try_pop(size_t self, task_t &task)
+    {
+        {
+            worker_queue_t &own = *queues[self];
+            std::lock_guard<std::mutex> lock(own.mutex);
+            if (!own.tasks.empty())
+            {
+                task = std::move(own.tasks.back());
+                own.tasks.pop_back();
+                queued -= 1;
+                return true;
+            }
+        }
+
+        for (size_t offset = 1; offset != queues.size(); ++offset)
+        {
+            worker_queue_t &victim = *queues[(self + offset) % queues.size()];
+            std::lock_guard<std::mutex> lock(victim.mutex);
+            if (!victim.tasks.empty())
+            {
+                task = std::move(victim.tasks.front());
+                victim.tasks.pop_front();
+                queued -= 1;
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    void run(size_t self)
+    {
+        current_worker().pool = this;
+        current_worker().index = self;
+
+        while (true)
+        {
+            task_t task;
+            if (try_pop(self, task))
+            {
+                task();
+
+                std::lock_guard<std::mutex> lock(state_mutex);
+                if (--unfinished == 0) idle.notify_all();
+                continue;
+            }
+
+            std::unique_lock<std::mutex> lock(state_mutex);
+            wake.wait(lock, [&] { return stopping || queued != 0; });
+            if (stopping && queued == 0) return;
+        }
+    }
+
+public:
+    explicit work_stealing_pool_t(size_t thread_count)
+    {
+        if (thread_count == 0) thread_count = 1;
+
+        for (size_t idx = 0; idx != thread_count; ++idx) queues.push_back(std::make_unique<worker_queue_t>());
+        for (size_t idx = 0; idx != thread_count; ++idx) threads.emplace_back([this, idx] { run(idx); });
+    }
+
+    ~work_stealing_pool_t()
+    {
+        {
+            std::lock_guard<std::mutex> lock(state_mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+
+        for (std::thread &thread : threads) thread.join();
+    }
+
+    size_t get_thread_count() const { return threads.size(); }
+
+    void submit(task_t task)
+    {
+        size_t target;
+        if (current_worker().pool == this) target = current_worker().index;
+        else target = next_queue++ % queues.size();
+
+        // counted before it is pushed: a worker can take it and finish it right away, and
+        // the counts must not go below zero then. under the lock, so a worker that just
+        // found nothing can't miss it.
+        {
+            std::lock_guard<std::mutex> lock(state_mutex);
+            queued += 1;
+            unfinished += 1;
+        }
+
+        {
+            worker_queue_t &queue = *queues[target];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            queue.tasks.push_back(std::move(task));
+        }
+        wake.notify_one();
+    }
+
+    /// wait - until every task submitted so far is done. not for use from a worker.
+    void wait()
+    {
+        std::unique_lock<std::mutex> lock(state_mutex);
+        idle.wait(lock, [&] { return unfinished == 0; });
+    }
+};
+
+} // end namespace kaleidoscope
+
+#endif
@@ -0,0 +1,149 @@
+#ifndef INCLUDED_X86_64_ASSEMBLER_
+#define INCLUDED_X86_64_ASSEMBLER_
+
+#include "llvm/Support/Memory.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <initializer_list>
+#include <system_error>
+#include <vector>
+
+// Just enough of x86-64 to write scalar double code without LLVM (see the baseline
+// compiler in parser.cc): a frame on rbp, SSE2 arithmetic in xmm0 and xmm1, and calls
+// through rax. Every instruction is a fixed byte template with its immediates patched in.
+
+namespace kaleidoscope {
+
+class x86_64_assembler_t
+{
+    std::vector<uint8_t> code;
+
+    void emit(std::initializer_list<uint8_t> bytes) { code.insert(code.end(), bytes); }
+
+    template <typename T>
+    void emit_value(T value)
+    {
+        uint8_t bytes[sizeof(T)];
+        memcpy(bytes, &value, sizeof(T));
+        code.insert(code.end(), bytes, bytes + sizeof(T));
+    }
+
+    // ModRM for [rbp + disp32] with the given xmm register.
+    static uint8_t rbp_operand(unsigned xmm) { return 0x85 | (xmm << 3); }
+
+public:
+    const std::vector<uint8_t> &get_code() const { return code; }
+    size_t get_size() const { return code.size(); }
+
+    // frame.
+    void push_rbp() { emit({0x55}); }
+    void mov_rbp_rsp() { emit({0x48, 0x89, 0xE5}); }
+    void leave() { emit({0xC9}); }
+    void ret() { emit({0xC3}); }
+
+    /// sub_rsp - returns where the immediate is, for patch_int32 once the frame size is known.
+    size_t sub_rsp()
+    {
+        emit({0x48, 0x81, 0xEC});
+        size_t at = code.size();
+        emit_value<int32_t>(0);
+        return at;
+    }
+
+    // moving doubles around.
+    void movsd_store(int32_t rbp_offset, unsigned xmm) { emit({0xF2, 0x0F, 0x11, rbp_operand(xmm)}); emit_value(rbp_offset); }
+    void movsd_load(unsigned xmm, int32_t rbp_offset) { emit({0xF2, 0x0F, 0x10, rbp_operand(xmm)}); emit_value(rbp_offset); }
+    void movapd_xmm1_xmm0() { emit({0x66, 0x0F, 0x28, 0xC8}); }
+    void movq_xmm0_rax() { emit({0x66, 0x48, 0x0F, 0x6E, 0xC0}); }
+
+    // xmm0 = xmm0 op xmm1.
+    void addsd() { emit({0xF2, 0x0F, 0x58, 0xC1}); }
+    void subsd() { emit({0xF2, 0x0F, 0x5C, 0xC1}); }
+    void mulsd() { emit({0xF2, 0x0F, 0x59, 0xC1}); }
+    void andpd() { emit({0x66, 0x0F, 0x54, 0xC1}); }
+
+    /// cmpnlesd_xmm1_xmm0 - xmm1 = all ones if !(xmm1 <= xmm0) (or unordered), else zero.
+    void cmpnlesd_xmm1_xmm0() { emit({0xF2, 0x0F, 0xC2, 0xC8, 0x06}); }
+
+    // integer registers.
+    void mov_rax(uint64_t value) { emit({0x48, 0xB8}); emit_value(value); }
+    void mov_rcx(uint64_t value) { emit({0x48, 0xB9}); emit_value(value); }
+    void mov_rdi(uint64_t value) { emit({0x48, 0xBF}); emit_value(value); }
+    void lea_rsi(int32_t rbp_offset) { emit({0x48, 0x8D, 0xB5}); emit_value(rbp_offset); }
+    void inc_qword_at_rax() { emit({0x48, 0xFF, 0x00}); }
+    void cmp_qword_at_rax_rcx() { emit({0x48, 0x39, 0x08}); }
+    void call_rax() { emit({0xFF, 0xD0}); }
+
+    /// jne - returns where the displacement is, for patch_jump.
+    size_t jne()
+    {
+        emit({0x0F, 0x85});
+        size_t at = code.size();
+        emit_value<int32_t>(0);
+        return at;
+    }
+
+    void patch_int32(size_t at, int32_t value) { memcpy(&code[at], &value, sizeof(value)); }
+
+    /// patch_jump - make the jump whose displacement is at `at` land here.
+    void patch_jump(size_t at) { patch_int32(at, int32_t(code.size() - (at + sizeof(int32_t)))); }
+};
+
+/// code_arena_t - executable memory for code we write ourselves. code is copied in chunk by
+/// chunk, and a chunk is only writable while code is being copied into it; so nothing may
+/// run from the arena while install() runs.
+class code_arena_t
+{
+    struct chunk_t
+    {
+        llvm::sys::MemoryBlock block;
+        size_t used = 0;
+    };
+
+    enum { chunk_size = 64 * 1024 };
+    std::vector<chunk_t> chunks;
+
+public:
+    code_arena_t() = default;
+    code_arena_t(const code_arena_t &) = delete;
+    code_arena_t &operator=(const code_arena_t &) = delete;
+
+    ~code_arena_t()
+    {
+        for (chunk_t &chunk : chunks) llvm::sys::Memory::releaseMappedMemory(chunk.block);
+    }
+
+    /// install - copy code into executable memory. null if there is no memory to be had.
+    void* install(const std::vector<uint8_t> &code)
+    {
+        using llvm::sys::Memory;
+
+        // keep functions 16 byte aligned, like a compiler would.
+        size_t size = (code.size() + 15) & ~size_t(15);
+        if (chunks.empty() || chunks.back().used + size > chunks.back().block.allocatedSize())
+        {
+            std::error_code error_code;
+            chunk_t chunk;
+            chunk.block = Memory::allocateMappedMemory(std::max<size_t>(size, chunk_size), nullptr, Memory::MF_READ | Memory::MF_WRITE, error_code);
+            if (error_code) return nullptr;
+            chunks.push_back(chunk);
+        }
+
+        chunk_t &chunk = chunks.back();
+        if (Memory::protectMappedMemory(chunk.block, Memory::MF_READ | Memory::MF_WRITE)) return nullptr;
+
+        uint8_t* address = (uint8_t*)chunk.block.base() + chunk.used;
+        memcpy(address, code.data(), code.size());
+        chunk.used += size;
+
+        if (Memory::protectMappedMemory(chunk.block, Memory::MF_READ | Memory::MF_EXEC)) return nullptr;
+        Memory::InvalidateInstructionCache(address, code.size());
+        return address;
+    }
+};
+
+} // end namespace kaleidoscope
+
+#endif
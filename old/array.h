@@ -1,3 +1,7 @@
+#ifndef INCLUDED_ARRAY_
+#define INCLUDED_ARRAY_
+
+#include "memory.h"
 
 #define ALLOCATE(type, count) \
     (type*)reallocate(NULL, 0, sizeof(type) * (count))
@@ -12,4 +16,6 @@
         sizeof(type) * (newCount))
 
 #define FREE_ARRAY(type, pointer, oldCount) \
-    reallocate(pointer, sizeof(type) * (oldCount), 0)
\ No newline at end of file
+    reallocate(pointer, sizeof(type) * (oldCount), 0)
+
+#endif
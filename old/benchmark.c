@@ -0,0 +1,147 @@
+// needed to stop whining about tmpfile and friends being deprecated.
+#define _CRT_SECURE_NO_DEPRECATE
+#include "line_reader.h"
+#include "tokenizer.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// how fast lines and tokens come out of a file, in GB/s of input:
+//
+//     cc -O2 -o benchmark benchmark.c line_reader.c tokenizer.c memory.c
+//     ./benchmark [megabytes]
+//
+// the input is generated into a temporary file first, so it is in the page cache for every
+// pass. the fgetc pass reads lines the way main.c used to, for comparison.
+
+static double now(void) {
+    struct timespec time;
+    timespec_get(&time, TIME_UTC);
+    return (double)time.tv_sec + (double)time.tv_nsec * 1e-9;
+}
+
+static size_t write_input(FILE* file, size_t megabytes) {
+    static const char* const names[] = {"a", "counter", "x_1", "total_weight", "b2"};
+    static const char* const types[] = {"i32", "r64", "u8", "r32", "i64"};
+
+    size_t written = 0;
+    unsigned seed = 1;
+    while (written < megabytes * 1024 * 1024) {
+        seed = seed * 1103515245u + 12345u;
+        unsigned pick = seed >> 16;
+        int length = fprintf(file, "let %s%u : %s = %s * (%u + %u.%ur32) - %s;\n",
+            names[pick % 5], pick % 1000, types[(pick / 5) % 5],
+            names[(pick / 25) % 5], pick % 97, pick % 13, pick % 10, names[(pick / 7) % 5]);
+        if (length < 0) {
+            return 0;
+        }
+        written += (size_t)length;
+    }
+    return written;
+}
+
+typedef struct result_t
+{
+    size_t lines;
+    size_t tokens;
+} result_t;
+
+static result_t pass_fgetc(FILE* file) {
+    result_t result = {0, 0};
+    size_t buffer_size = 1024;
+    char* line = malloc(buffer_size);
+    size_t length = 0;
+    int c;
+    while ((c = fgetc(file)) != EOF) {
+        if (c == '\n') {
+            result.lines += 1;
+            length = 0;
+            continue;
+        }
+        if (length + 1 >= buffer_size) {
+            buffer_size *= 2;
+            line = realloc(line, buffer_size);
+        }
+        line[length++] = (char)c;
+    }
+    free(line);
+    return result;
+}
+
+static result_t pass_lines(FILE* file) {
+    result_t result = {0, 0};
+    line_reader_t reader;
+    span_t line;
+    line_reader_init(&reader, file);
+    while (line_reader_next(&reader, &line) == 1) {
+        result.lines += 1;
+    }
+    line_reader_free(&reader);
+    return result;
+}
+
+static result_t pass_tokens(FILE* file) {
+    result_t result = {0, 0};
+    line_reader_t reader;
+    span_t line;
+    line_reader_init(&reader, file);
+    while (line_reader_next(&reader, &line) == 1) {
+        result.lines += 1;
+
+        tokenizer_t tokenizer;
+        tokenizer_init(&tokenizer, line);
+        while (next_token(&tokenizer).token_type != TOKEN_END) {
+            result.tokens += 1;
+        }
+    }
+    line_reader_free(&reader);
+    return result;
+}
+
+int main(int argc, char* argv[]) {
+    size_t megabytes = argc > 1 ? (size_t)atol(argv[1]) : 256;
+
+    FILE* file = tmpfile();
+    if (file == NULL) {
+        perror("Unable to create a temporary file");
+        return EXIT_FAILURE;
+    }
+
+    size_t bytes = write_input(file, megabytes);
+    if (bytes == 0 || fflush(file) != 0) {
+        perror("Unable to write the input");
+        return EXIT_FAILURE;
+    }
+
+    struct
+    {
+        const char* name;
+        result_t (*pass)(FILE*);
+    } passes[] = {
+        {"fgetc lines", pass_fgetc},
+        {"line reader", pass_lines},
+        {"line reader + tokenizer", pass_tokens},
+    };
+
+    for (size_t idx = 0; idx != sizeof(passes) / sizeof(passes[0]); ++idx) {
+        // the best of three, the others had more in their way.
+        double best = 0;
+        result_t result = {0, 0};
+        for (int run = 0; run != 3; ++run) {
+            rewind(file);
+            double start = now();
+            result = passes[idx].pass(file);
+            double elapsed = now() - start;
+            if (run == 0 || elapsed < best) {
+                best = elapsed;
+            }
+        }
+
+        printf("%-24s %6.2f GB/s  (%zu lines, %zu tokens, %.1f MB in %.3f s)\n",
+            passes[idx].name, (double)bytes / best / 1e9, result.lines, result.tokens, (double)bytes / 1e6, best);
+    }
+
+    fclose(file);
+    return 0;
+}
@@ -0,0 +1,116 @@
+#include "line_reader.h"
+#include "array.h"
+
+#include <string.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define LINE_READER_SSE2
+#include <emmintrin.h>
+#endif
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+static unsigned count_trailing_zeros(unsigned value) {
+    unsigned long index;
+    _BitScanForward(&index, value);
+    return index;
+}
+#else
+static unsigned count_trailing_zeros(unsigned value) {
+    return (unsigned)__builtin_ctz(value);
+}
+#endif
+
+const char* find_byte(const char* begin, const char* end, char byte) {
+#ifdef LINE_READER_SSE2
+    const __m128i pattern = _mm_set1_epi8(byte);
+    while (end - begin >= 16) {
+        __m128i bytes = _mm_loadu_si128((const __m128i*)begin);
+        unsigned mask = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, pattern));
+        if (mask) {
+            return begin + count_trailing_zeros(mask);
+        }
+        begin += 16;
+    }
+#endif
+
+    for (; begin != end; ++begin) {
+        if (*begin == byte) {
+            return begin;
+        }
+    }
+    return NULL;
+}
+
+void line_reader_init(line_reader_t* reader, FILE* file) {
+    memset(reader, 0, sizeof(*reader));
+    reader->file = file;
+
+    // room for a block and the unfinished line in front of it.
+    reader->capacity = 2 * LINE_READER_BLOCK_SIZE;
+    reader->buffer = ALLOCATE(char, reader->capacity);
+}
+
+void line_reader_free(line_reader_t* reader) {
+    FREE_ARRAY(char, reader->buffer, reader->capacity);
+    reader->buffer = NULL;
+}
+
+// read_block - move the unfinished line to the front and read a block after it.
+static int read_block(line_reader_t* reader) {
+    size_t unfinished = reader->end - reader->begin;
+    memmove(reader->buffer, reader->buffer + reader->begin, unfinished);
+    reader->begin = 0;
+    reader->end = unfinished;
+
+    if (reader->capacity - unfinished < LINE_READER_BLOCK_SIZE) {
+        size_t new_capacity = GROW_CAPACITY(reader->capacity);
+        reader->buffer = GROW_ARRAY(char, reader->buffer, reader->capacity, new_capacity);
+        reader->capacity = new_capacity;
+    }
+
+    size_t read = fread(reader->buffer + reader->end, 1, LINE_READER_BLOCK_SIZE, reader->file);
+    reader->end += read;
+
+    // fread only comes back short at the end of the file, or on an error.
+    if (read < LINE_READER_BLOCK_SIZE) {
+        if (ferror(reader->file)) {
+            return -1;
+        }
+        reader->at_end_of_file = 1;
+    }
+    return 0;
+}
+
+int line_reader_next(line_reader_t* reader, span_t* line) {
+    // what is already searched doesn't have to be searched again after a read_block.
+    size_t searched = 0;
+
+    while (1) {
+        const char* start = reader->buffer + reader->begin;
+        const char* newline = find_byte(start + searched, reader->buffer + reader->end, '\n');
+        if (newline != NULL) {
+            line->data = start;
+            line->length = (size_t)(newline - start);
+            reader->begin += line->length + 1;
+            return 1;
+        }
+
+        if (reader->at_end_of_file) {
+            if (reader->begin == reader->end) {
+                return 0;
+            }
+
+            // the last line has no newline.
+            line->data = start;
+            line->length = reader->end - reader->begin;
+            reader->begin = reader->end;
+            return 1;
+        }
+
+        searched = reader->end - reader->begin;
+        if (read_block(reader) != 0) {
+            return -1;
+        }
+    }
+}
@@ -0,0 +1,43 @@
+#ifndef INCLUDED_LINE_READER_
+#define INCLUDED_LINE_READER_
+
+#include <stddef.h>
+#include <stdio.h>
+
+// Reads a file in big blocks and hands out its lines without copying them: a line is a
+// span into the buffer the block was read into. When a block ends in the middle of a line,
+// that start of a line is moved to the front of the buffer and the next block is read in
+// after it, so the only bytes that are ever copied are those of one line per block. The
+// buffer grows for lines that are longer than a block.
+
+typedef struct span_t
+{
+    const char* data;
+    size_t length;
+} span_t;
+
+enum { LINE_READER_BLOCK_SIZE = 1 << 20 };
+
+typedef struct line_reader_t
+{
+    FILE* file;
+    char* buffer;
+    size_t capacity;
+    size_t begin; // the bytes that are read but not handed out are [begin, end).
+    size_t end;
+    int at_end_of_file;
+} line_reader_t;
+
+// line_reader_init - the reader doesn't own the file.
+void line_reader_init(line_reader_t* reader, FILE* file);
+void line_reader_free(line_reader_t* reader);
+
+// line_reader_next - the next line, without its '\n'. it stays valid until the next call.
+// returns 1 for a line, 0 at the end of the file and -1 if reading failed. like fgets,
+// a file that ends in '\n' has no empty line after it.
+int line_reader_next(line_reader_t* reader, span_t* line);
+
+// find_byte - the first `byte` in [begin, end), or NULL. 16 bytes at a time with SSE2.
+const char* find_byte(const char* begin, const char* end, char byte);
+
+#endif
@@ -1,101 +1,95 @@
+// needed to stop whining about fopen being deprecated. (before anything includes stdio.h)
+#define _CRT_SECURE_NO_DEPRECATE
 #include "types.h"
 #include "array.h"
-// needed to stop whining about fopen being deprecated.
-#define _CRT_SECURE_NO_DEPRECATE
+#include "line_reader.h"
+#include "tokenizer.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
-void process_line(char *line, size_t length);
+// prints the tokens of every line of the file, and what is wrong with the ones that are
+// invalid. --memory prints what was allocated where, at the end.
+//
+//     cc -O2 -o main main.c line_reader.c tokenizer.c memory.c
+
+void process_line(span_t line, size_t line_number);
 
 int main(int argc, char *argv[]) {
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s <filename>\n", argv[0]);
+    int print_memory = argc == 3 && strcmp(argv[1], "--memory") == 0;
+    if (argc != 2 && !print_memory) {
+        fprintf(stderr, "Usage: %s [--memory] <filename>\n", argv[0]);
         exit(EXIT_FAILURE);
     }
 
-    FILE *file = fopen(argv[1], "r");
+    FILE *file = fopen(argv[argc - 1], "rb");
     if (file == NULL) {
         perror("Error opening file");
         exit(EXIT_FAILURE);
     }
 
-    size_t buffer_size = 1024;
-    char *line = malloc(buffer_size);
-    if (line == NULL) {
-        perror("Unable to allocate buffer");
-        exit(EXIT_FAILURE);
-    }
-
-    while (1) {
-        size_t len = 0;
-        int c;
+    line_reader_t reader;
+    line_reader_init(&reader, file);
 
-        while ((c = fgetc(file)) != EOF && c != '\n') {
-            if (len + 1 >= buffer_size) {
-                buffer_size *= 2;
-                char *new_line = realloc(line, buffer_size);
-                if (new_line == NULL) {
-                    perror("Unable to reallocate buffer");
-                    free(line);
-                    exit(EXIT_FAILURE);
-                }
-                line = new_line;
-            }
-            line[len++] = c;
-        }
-
-        if (ferror(file)) {
-            perror("Error reading file");
-            free(line);
-            fclose(file);
-            exit(EXIT_FAILURE);
-        }
-
-        if (len > 0 || c == '\n') {
-            line[len] = '\0';
-            process_line(line, len);
-        }
+    span_t line;
+    size_t line_number = 0;
+    int result;
+    while ((result = line_reader_next(&reader, &line)) == 1) {
+        process_line(line, ++line_number);
+    }
 
-        if (c == EOF) {
-            break;
-        }
+    if (result < 0) {
+        perror("Error reading file");
+        line_reader_free(&reader);
+        fclose(file);
+        exit(EXIT_FAILURE);
     }
 
-    free(line);
+    line_reader_free(&reader);
     fclose(file);
+
+    if (print_memory) {
+        memory_print_statistics(stderr);
+    }
+    memory_release_all();
     return 0;
 }
 
-void process_line(char *line, size_t length) {
+void process_line(span_t line, size_t line_number) {
+    tokenizer_t tokenizer;
+    tokenizer_init(&tokenizer, line);
 
-    for (size_t idx = 0; idx < length; ++idx) {
-        // what kind of character are we dealing with? just a character? a number?
-        char c = line[idx];
+    token_t token;
+    while ((token = next_token(&tokenizer)).token_type != TOKEN_END) {
+        if (token.token_type == TOKEN_INVALID) {
+            fprintf(stderr, "%zu:%zu: error: %s: '%.*s'\n", line_number, token.column, token.error, (int)token.text.length, token.text.data);
+            continue;
+        }
 
-        switch (c)
+        printf("%zu:%zu %s", line_number, token.column, token_type_name(token.token_type));
+        switch (token.token_type)
         {
-            case ';' :
-            {
-                // end of an expression?
-            }
-            case '=' :
+            case TOKEN_IDENTIFIER:
             {
+                printf(" %.*s", (int)token.text.length, token.text.data);
+            } break;
 
-            } 
-
-            default:
+            case TOKEN_TYPE:
             {
-                if (is_alpha)
-                {
+                printf(" %s", internal_type_strings[token.value_type]);
+            } break;
 
+            case TOKEN_NUMBER:
+            {
+                if (token.value_type == TYPE_R32 || token.value_type == TYPE_R64) {
+                    printf(" %g %s", token.real_value, internal_type_strings[token.value_type]);
+                } else {
+                    printf(" %llu %s", (unsigned long long)token.integer_value, internal_type_strings[token.value_type]);
                 }
-                if (is_numerical())
-                {
-                    
-                }
-            };
-        }
+            } break;
 
+            default: break;
+        }
+        printf("\n");
     }
-
-}
\ No newline at end of file
+}
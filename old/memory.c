@@ -0,0 +1,327 @@
+#include "memory.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+enum
+{
+    SMALLEST_CLASS_SIZE = 16,
+    CLASS_COUNT = 8, // 16, 32, ... 2048 bytes.
+    LARGEST_CLASS_SIZE = SMALLEST_CLASS_SIZE << (CLASS_COUNT - 1),
+    SLAB_SIZE = 64 * 1024,
+    CALL_SITE_CAPACITY = 1024 // a power of two.
+};
+
+typedef struct free_block_t
+{
+    struct free_block_t* next;
+} free_block_t;
+
+// slab_t - a chunk of memory that blocks are carved out of, front to back. the blocks
+// start after the header, which keeps them 16 byte aligned.
+typedef struct slab_t
+{
+    struct slab_t* next;
+    size_t size;
+    size_t used;
+} slab_t;
+
+#define SLAB_HEADER_SIZE ((sizeof(slab_t) + 15) & ~(size_t)15)
+
+typedef struct call_site_t
+{
+    const char* file;
+    int line;
+    size_t allocations;
+    size_t resizes;
+    size_t resizes_in_place;
+    size_t frees;
+    size_t bytes_requested; // what allocations and growing asked for, in total.
+} call_site_t;
+
+static free_block_t* free_lists[CLASS_COUNT];
+static slab_t* pool_slabs; // the one blocks are carved out of now comes first.
+static slab_t* arena_slabs;
+static int in_arena;
+
+static call_site_t call_sites[CALL_SITE_CAPACITY];
+static call_site_t other_call_sites = {"(other call sites)", 0, 0, 0, 0, 0, 0};
+
+// a block can be allocated in one place and freed in another, so bytes in use are only
+// counted overall.
+static size_t bytes_in_use;
+static size_t peak_bytes_in_use;
+static size_t arena_bytes_in_use; // on top of bytes_in_use, gone with the next reset.
+
+static void out_of_memory(void) {
+    fprintf(stderr, "out of memory\n");
+    exit(EXIT_FAILURE);
+}
+
+static call_site_t* find_call_site(const char* file, int line) {
+    size_t hash = ((size_t)(uintptr_t)file >> 4) ^ ((size_t)line * 2654435761u);
+    for (size_t probe = 0; probe != CALL_SITE_CAPACITY; ++probe) {
+        call_site_t* site = &call_sites[(hash + probe) & (CALL_SITE_CAPACITY - 1)];
+        if (site->file == file && site->line == line) {
+            return site;
+        }
+        if (site->file == NULL) {
+            site->file = file;
+            site->line = line;
+            return site;
+        }
+    }
+    return &other_call_sites;
+}
+
+static int size_class(size_t size) {
+    int class_index = 0;
+    size_t class_size = SMALLEST_CLASS_SIZE;
+    while (class_size < size) {
+        class_size <<= 1;
+        ++class_index;
+    }
+    return class_index;
+}
+
+static size_t class_size(int class_index) {
+    return (size_t)SMALLEST_CLASS_SIZE << class_index;
+}
+
+static char* slab_data(slab_t* slab) {
+    return (char*)slab + SLAB_HEADER_SIZE;
+}
+
+// carve - size bytes from the first slab of slabs, or from a new one if it doesn't have
+// room. sizes are multiples of 16, so everything stays aligned.
+static void* carve(slab_t** slabs, size_t size) {
+    slab_t* slab = *slabs;
+    if (slab == NULL || slab->size - slab->used < size) {
+        size_t slab_size = size > SLAB_SIZE - SLAB_HEADER_SIZE ? size : SLAB_SIZE - SLAB_HEADER_SIZE;
+        slab = malloc(SLAB_HEADER_SIZE + slab_size);
+        if (slab == NULL) {
+            out_of_memory();
+        }
+        slab->size = slab_size;
+        slab->used = 0;
+        slab->next = *slabs;
+        *slabs = slab;
+    }
+
+    void* block = slab_data(slab) + slab->used;
+    slab->used += size;
+    return block;
+}
+
+// grow_last - if block is the last one carved out of the first slab, and the slab has the
+// room, make it new_size bytes.
+static int grow_last(slab_t* slab, void* block, size_t old_size, size_t new_size) {
+    if (slab == NULL || (char*)block + old_size != slab_data(slab) + slab->used) {
+        return 0;
+    }
+    if (slab->size - slab->used < new_size - old_size) {
+        return 0;
+    }
+    slab->used += new_size - old_size;
+    return 1;
+}
+
+static void* allocate_small(size_t size) {
+    int class_index = size_class(size);
+    free_block_t* block = free_lists[class_index];
+    if (block != NULL) {
+        free_lists[class_index] = block->next;
+        return block;
+    }
+    return carve(&pool_slabs, class_size(class_index));
+}
+
+static void free_small(void* pointer, size_t size) {
+    int class_index = size_class(size);
+    free_block_t* block = pointer;
+    block->next = free_lists[class_index];
+    free_lists[class_index] = block;
+}
+
+// resize_in_arena - nothing is freed in the arena. a block grows in place if it was the
+// last one carved out, and shrinks in place always.
+static void* resize_in_arena(void* pointer, size_t old_size, size_t new_size, call_site_t* site) {
+    size_t old_rounded = (old_size + 15) & ~(size_t)15;
+    size_t new_rounded = (new_size + 15) & ~(size_t)15;
+
+    if (pointer != NULL && (new_rounded <= old_rounded || grow_last(arena_slabs, pointer, old_rounded, new_rounded))) {
+        site->resizes_in_place += 1;
+        return pointer;
+    }
+
+    void* result = carve(&arena_slabs, new_rounded);
+    if (pointer != NULL) {
+        memcpy(result, pointer, old_size);
+    }
+    return result;
+}
+
+static void* resize_in_pool(void* pointer, size_t old_size, size_t new_size, call_site_t* site) {
+    int old_small = old_size <= LARGEST_CLASS_SIZE;
+    int new_small = new_size <= LARGEST_CLASS_SIZE;
+
+    if (old_small && new_small) {
+        int old_class = size_class(old_size);
+        int new_class = size_class(new_size);
+
+        // a block that shrinks stays where it is; from then on it counts as the smaller
+        // class, which it is big enough for.
+        if (new_class <= old_class) {
+            site->resizes_in_place += 1;
+            return pointer;
+        }
+        if (grow_last(pool_slabs, pointer, class_size(old_class), class_size(new_class))) {
+            site->resizes_in_place += 1;
+            return pointer;
+        }
+    }
+
+    if (!old_small && !new_small) {
+        void* result = realloc(pointer, new_size);
+        if (result == NULL) {
+            out_of_memory();
+        }
+        return result;
+    }
+
+    void* result = new_small ? allocate_small(new_size) : malloc(new_size);
+    if (result == NULL) {
+        out_of_memory();
+    }
+    memcpy(result, pointer, old_size < new_size ? old_size : new_size);
+
+    if (old_small) {
+        free_small(pointer, old_size);
+    } else {
+        free(pointer);
+    }
+    return result;
+}
+
+void* reallocate_at(void* pointer, size_t old_size, size_t new_size, const char* file, int line) {
+    call_site_t* site = find_call_site(file, line);
+    size_t* counted_in = in_arena ? &arena_bytes_in_use : &bytes_in_use;
+    if (new_size > old_size) {
+        site->bytes_requested += new_size - old_size;
+        *counted_in += new_size - old_size;
+        if (bytes_in_use + arena_bytes_in_use > peak_bytes_in_use) {
+            peak_bytes_in_use = bytes_in_use + arena_bytes_in_use;
+        }
+    } else {
+        *counted_in -= old_size - new_size;
+    }
+
+    if (new_size == 0) {
+        site->frees += 1;
+        if (pointer != NULL && !in_arena) {
+            if (old_size <= LARGEST_CLASS_SIZE) {
+                free_small(pointer, old_size);
+            } else {
+                free(pointer);
+            }
+        }
+        return NULL;
+    }
+
+    if (pointer == NULL || old_size == 0) {
+        site->allocations += 1;
+        if (in_arena) {
+            return resize_in_arena(NULL, 0, new_size, site);
+        }
+
+        void* result = new_size <= LARGEST_CLASS_SIZE ? allocate_small(new_size) : malloc(new_size);
+        if (result == NULL) {
+            out_of_memory();
+        }
+        return result;
+    }
+
+    site->resizes += 1;
+    if (in_arena) {
+        return resize_in_arena(pointer, old_size, new_size, site);
+    }
+    return resize_in_pool(pointer, old_size, new_size, site);
+}
+
+void memory_begin_arena(void) {
+    in_arena = 1;
+}
+
+void memory_reset_arena(void) {
+    // keep one ordinary slab around for what comes next.
+    while (arena_slabs != NULL && (arena_slabs->next != NULL || arena_slabs->size != SLAB_SIZE - SLAB_HEADER_SIZE)) {
+        slab_t* next = arena_slabs->next;
+        free(arena_slabs);
+        arena_slabs = next;
+    }
+    if (arena_slabs != NULL) {
+        arena_slabs->used = 0;
+    }
+    arena_bytes_in_use = 0;
+}
+
+void memory_end_arena(void) {
+    memory_reset_arena();
+    in_arena = 0;
+}
+
+static int compare_bytes_requested(const void* lhs, const void* rhs) {
+    const call_site_t* left = lhs;
+    const call_site_t* right = rhs;
+    if (left->bytes_requested != right->bytes_requested) {
+        return left->bytes_requested < right->bytes_requested ? 1 : -1;
+    }
+    return 0;
+}
+
+void memory_print_statistics(FILE* file) {
+    call_site_t sites[CALL_SITE_CAPACITY + 1];
+    size_t site_count = 0;
+    for (size_t idx = 0; idx != CALL_SITE_CAPACITY; ++idx) {
+        if (call_sites[idx].file != NULL) {
+            sites[site_count++] = call_sites[idx];
+        }
+    }
+    if (other_call_sites.allocations + other_call_sites.resizes + other_call_sites.frees != 0) {
+        sites[site_count++] = other_call_sites;
+    }
+    qsort(sites, site_count, sizeof(sites[0]), compare_bytes_requested);
+
+    size_t slab_bytes = 0;
+    for (slab_t* slab = pool_slabs; slab != NULL; slab = slab->next) {
+        slab_bytes += SLAB_HEADER_SIZE + slab->size;
+    }
+    for (slab_t* slab = arena_slabs; slab != NULL; slab = slab->next) {
+        slab_bytes += SLAB_HEADER_SIZE + slab->size;
+    }
+
+    fprintf(file, "%-28s %10s %10s %10s %10s %14s\n", "call site", "allocs", "resizes", "in place", "frees", "bytes asked");
+    for (size_t idx = 0; idx != site_count; ++idx) {
+        const call_site_t* site = &sites[idx];
+        char location[256];
+        snprintf(location, sizeof(location), "%s:%d", site->file, site->line);
+        fprintf(file, "%-28s %10zu %10zu %10zu %10zu %14zu\n", location,
+            site->allocations, site->resizes, site->resizes_in_place, site->frees, site->bytes_requested);
+    }
+    fprintf(file, "in use: %zu bytes, at most %zu bytes; slabs: %zu bytes\n", bytes_in_use + arena_bytes_in_use, peak_bytes_in_use, slab_bytes);
+}
+
+static void free_slabs(slab_t** slabs) {
+    while (*slabs != NULL) {
+        slab_t* next = (*slabs)->next;
+        free(*slabs);
+        *slabs = next;
+    }
+}
+
+void memory_release_all(void) {
+    free_slabs(&pool_slabs);
+    free_slabs(&arena_slabs);
+    memset(free_lists, 0, sizeof(free_lists));
+}
@@ -0,0 +1,42 @@
+#ifndef INCLUDED_MEMORY_
+#define INCLUDED_MEMORY_
+
+#include <stddef.h>
+#include <stdio.h>
+
+// The allocator behind array.h. Callers always say how big a block is, so blocks don't
+// need headers:
+//
+//  - blocks of up to 2048 bytes come in power of two size classes, carved out of 64 KB
+//    slabs. a freed block goes on the free list of its class, and slabs are only given
+//    back by memory_release_all().
+//  - growing a block within its size class keeps it where it is, and so does growing the
+//    last block carved out of a slab, as long as the slab has room.
+//  - bigger blocks go to malloc and realloc.
+//
+// Between memory_begin_arena() and memory_end_arena(), everything comes out of an arena
+// instead: freeing does nothing, and memory_reset_arena() (or ending the arena) frees it
+// all at once. Blocks from the arena must not be resized or freed outside of it, and
+// blocks from outside must not be resized inside it.
+//
+// Every call site of reallocate() gets counters, see memory_print_statistics(). None of
+// this is thread safe, like the rest of old/.
+
+void* reallocate_at(void* pointer, size_t old_size, size_t new_size, const char* file, int line);
+
+// reallocate - new_size 0 frees, old_size 0 allocates. exits when there is no memory.
+#define reallocate(pointer, old_size, new_size) \
+    reallocate_at((pointer), (old_size), (new_size), __FILE__, __LINE__)
+
+void memory_begin_arena(void);
+void memory_reset_arena(void);
+void memory_end_arena(void);
+
+// memory_print_statistics - per call site: calls, how many resizes didn't have to move
+// the block and the bytes asked for. and overall: bytes in use, now and at most.
+void memory_print_statistics(FILE* file);
+
+// memory_release_all - give every slab back. only when nothing allocated is in use anymore.
+void memory_release_all(void);
+
+#endif
@@ -0,0 +1,132 @@
+#include "array.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+// what growing a lot of small arrays costs, with malloc and realloc and with the
+// allocator behind array.h (in its pool and in an arena):
+//
+//     cc -O2 -o memory_benchmark memory_benchmark.c memory.c
+//     ./memory_benchmark [rounds]
+//
+// a round grows ARRAY_COUNT arrays to a random length of up to 256 ints one element at a
+// time and then frees them all. either one array after the other, like a line buffer
+// (which lets the allocator grow the last block in place), or all of them interleaved,
+// like the lists of a syntax tree.
+
+enum { ARRAY_COUNT = 4096, MAXIMUM_LENGTH = 256 };
+
+typedef struct int_array_t
+{
+    int* values;
+    size_t count;
+    size_t capacity;
+} int_array_t;
+
+static double now(void) {
+    struct timespec time;
+    timespec_get(&time, TIME_UTC);
+    return (double)time.tv_sec + (double)time.tv_nsec * 1e-9;
+}
+
+static size_t lengths[ARRAY_COUNT];
+static int_array_t arrays[ARRAY_COUNT];
+
+static void push_malloc(int_array_t* array, int value) {
+    if (array->count == array->capacity) {
+        array->capacity = GROW_CAPACITY(array->capacity);
+        array->values = realloc(array->values, sizeof(int) * array->capacity);
+    }
+    array->values[array->count++] = value;
+}
+
+static void push_array(int_array_t* array, int value) {
+    if (array->count == array->capacity) {
+        size_t old_capacity = array->capacity;
+        array->capacity = GROW_CAPACITY(old_capacity);
+        array->values = GROW_ARRAY(int, array->values, old_capacity, array->capacity);
+    }
+    array->values[array->count++] = value;
+}
+
+static void push(int_array_t* array, int value, int use_malloc) {
+    if (use_malloc) {
+        push_malloc(array, value);
+    } else {
+        push_array(array, value);
+    }
+}
+
+// round_of - returns the number of elements pushed.
+static size_t round_of(int interleaved, int use_malloc, int in_arena) {
+    size_t pushed = 0;
+    if (interleaved) {
+        for (size_t length = 0; length != MAXIMUM_LENGTH; ++length) {
+            for (size_t idx = 0; idx != ARRAY_COUNT; ++idx) {
+                if (length < lengths[idx]) {
+                    push(&arrays[idx], (int)length, use_malloc);
+                    pushed += 1;
+                }
+            }
+        }
+    } else {
+        for (size_t idx = 0; idx != ARRAY_COUNT; ++idx) {
+            for (size_t length = 0; length != lengths[idx]; ++length) {
+                push(&arrays[idx], (int)length, use_malloc);
+                pushed += 1;
+            }
+        }
+    }
+
+    for (size_t idx = 0; idx != ARRAY_COUNT; ++idx) {
+        if (use_malloc) {
+            free(arrays[idx].values);
+        } else if (!in_arena) {
+            FREE_ARRAY(int, arrays[idx].values, arrays[idx].capacity);
+        }
+        arrays[idx].values = NULL;
+        arrays[idx].count = 0;
+        arrays[idx].capacity = 0;
+    }
+    if (in_arena) {
+        memory_reset_arena();
+    }
+    return pushed;
+}
+
+int main(int argc, char* argv[]) {
+    int rounds = argc > 1 ? atoi(argv[1]) : 50;
+
+    unsigned seed = 1;
+    for (size_t idx = 0; idx != ARRAY_COUNT; ++idx) {
+        seed = seed * 1103515245u + 12345u;
+        lengths[idx] = 1 + (seed >> 16) % MAXIMUM_LENGTH;
+    }
+
+    const char* names[] = {"malloc/realloc", "pool", "arena"};
+    for (int interleaved = 0; interleaved != 2; ++interleaved) {
+        printf("%s:\n", interleaved ? "interleaved" : "one after the other");
+        for (int mode = 0; mode != 3; ++mode) {
+            if (mode == 2) {
+                memory_begin_arena();
+            }
+
+            size_t pushed = 0;
+            double start = now();
+            for (int round = 0; round != rounds; ++round) {
+                pushed += round_of(interleaved, mode == 0, mode == 2);
+            }
+            double elapsed = now() - start;
+
+            if (mode == 2) {
+                memory_end_arena();
+            }
+            printf("  %-16s %6.2f ns per element (%zu elements in %.3f s)\n", names[mode], elapsed * 1e9 / (double)pushed, pushed, elapsed);
+        }
+    }
+
+    printf("\n");
+    memory_print_statistics(stdout);
+    memory_release_all();
+    return 0;
+}
@@ -0,0 +1,270 @@
+#include "tokenizer.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+static const char* const token_type_names[TOKEN_TYPE_COUNT] = {
+    "end",
+    "invalid",
+    "let",
+    "identifier",
+    "type",
+    "number",
+    ":",
+    "=",
+    ";",
+    "+",
+    "-",
+    "*",
+    "/",
+    "(",
+    ")"
+};
+
+const char* token_type_name(token_type_t token_type) {
+    return token_type_names[token_type];
+}
+
+// what a byte can be part of, looked up instead of compared, since the tokenizer asks for
+// every byte of the input. only ASCII has a class: bytes from 0x80 up are pieces of UTF-8
+// sequences, whatever the locale's isdigit thinks of them.
+enum
+{
+    CHARACTER_SPACE = 1,
+    CHARACTER_DIGIT = 2,
+    CHARACTER_LETTER = 4, // or '_'.
+    CHARACTER_IDENTIFIER = CHARACTER_DIGIT | CHARACTER_LETTER
+};
+
+#define S CHARACTER_SPACE
+#define D CHARACTER_DIGIT
+#define L CHARACTER_LETTER
+static const unsigned char character_classes[256] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 0, S, 0, S, S, S, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    S, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    D, D, D, D, D, D, D, D, D, D, 0, 0, 0, 0, 0, 0,
+    0, L, L, L, L, L, L, L, L, L, L, L, L, L, L, L,
+    L, L, L, L, L, L, L, L, L, L, L, 0, 0, 0, 0, L,
+    0, L, L, L, L, L, L, L, L, L, L, L, L, L, L, L,
+    L, L, L, L, L, L, L, L, L, L, L, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
+};
+#undef S
+#undef D
+#undef L
+
+static int is_space(char c) {
+    return character_classes[(unsigned char)c] & CHARACTER_SPACE;
+}
+
+static int is_digit(char c) {
+    return character_classes[(unsigned char)c] & CHARACTER_DIGIT;
+}
+
+static int is_identifier_start(char c) {
+    return character_classes[(unsigned char)c] & CHARACTER_LETTER;
+}
+
+static int is_identifier_character(char c) {
+    return character_classes[(unsigned char)c] & CHARACTER_IDENTIFIER;
+}
+
+// find_type - the internal type called text, or TYPE_INVALID.
+static enum internal_types find_type(const char* text, size_t length) {
+    // the names are 2 to 4 characters and start with one of four letters, so most
+    // identifiers don't have to be compared with any of them.
+    if (length < 2 || length > 4) {
+        return TYPE_INVALID;
+    }
+
+    int first, last;
+    switch (text[0])
+    {
+        case 'u': first = TYPE_U8; last = TYPE_U64; break;
+        case 'i': first = TYPE_I8; last = TYPE_I64; break;
+        case 'r': first = TYPE_R32; last = TYPE_R64; break;
+        case 'b': first = TYPE_BOOL; last = TYPE_BOOL; break;
+        default: return TYPE_INVALID;
+    }
+
+    for (int type = first; type <= last; ++type) {
+        const char* name = internal_type_strings[type];
+        if (strncmp(name, text, length) == 0 && name[length] == '\0') {
+            return (enum internal_types)type;
+        }
+    }
+    return TYPE_INVALID;
+}
+
+static int is_integer_type(enum internal_types type) {
+    return type >= TYPE_U8 && type <= TYPE_I64;
+}
+
+void tokenizer_init(tokenizer_t* tokenizer, span_t line) {
+    tokenizer->line = line.data;
+    tokenizer->current = line.data;
+    tokenizer->end = line.data + line.length;
+}
+
+static void set_invalid(token_t* token, const char* error) {
+    token->token_type = TOKEN_INVALID;
+    token->error = error;
+}
+
+// number ::= digit+ ['.' digit*] [type] | '.' digit+ [type]
+static void scan_number(tokenizer_t* tokenizer, token_t* token) {
+    const char* current = tokenizer->current;
+    uint64_t digits = 0;
+    size_t digit_count = 0;
+    size_t fraction_digit_count = 0;
+    int seen_point = 0;
+    int overflow = 0;
+    token->token_type = TOKEN_NUMBER;
+
+    while (current != tokenizer->end && (is_digit(*current) || (*current == '.' && !seen_point))) {
+        if (*current == '.') {
+            seen_point = 1;
+        } else {
+            uint64_t digit = (uint64_t)(*current - '0');
+            if (digits > UINT64_MAX / 10 || (digits == UINT64_MAX / 10 && digit > UINT64_MAX % 10)) {
+                overflow = 1;
+            }
+            digits = digits * 10 + digit;
+            digit_count += 1;
+            fraction_digit_count += seen_point;
+        }
+        ++current;
+    }
+    const char* number_end = current;
+
+    // the suffix, if any, runs up to the next delimiter.
+    while (current != tokenizer->end && is_identifier_character(*current)) {
+        ++current;
+    }
+    tokenizer->current = current;
+    token->text.length = (size_t)(current - token->text.data);
+
+    if (digit_count == 0) {
+        set_invalid(token, "a number needs at least one digit");
+        return;
+    }
+
+    token->value_type = seen_point ? TYPE_R64 : TYPE_I64;
+    if (current != number_end) {
+        token->value_type = find_type(number_end, (size_t)(current - number_end));
+        if (token->value_type == TYPE_INVALID || token->value_type == TYPE_BOOL) {
+            set_invalid(token, "unknown type suffix on number");
+            return;
+        }
+    }
+
+    if (is_integer_type(token->value_type)) {
+        if (seen_point) {
+            set_invalid(token, "integer literal with a fractional part");
+            return;
+        }
+        if (overflow) {
+            set_invalid(token, "integer literal out of range for its type");
+            return;
+        }
+
+        static const unsigned value_bits[] = {0, 8, 16, 32, 64, 7, 15, 31, 63};
+        unsigned bits = value_bits[token->value_type];
+        if (bits < 64 && (digits >> bits) != 0) {
+            set_invalid(token, "integer literal out of range for its type");
+            return;
+        }
+
+        token->integer_value = digits;
+        token->real_value = (double)digits;
+        return;
+    }
+
+    // up to 15 digits, both the digits and the power of ten are exact as doubles, so the
+    // one rounding of the division gives the same double strtod would.
+    if (digit_count <= 15 && !overflow) {
+        double scale = 1;
+        for (size_t idx = 0; idx != fraction_digit_count; ++idx) {
+            scale *= 10;
+        }
+        token->real_value = (double)digits / scale;
+    } else {
+        // the line isn't terminated, so strtod gets a copy.
+        char copy[128];
+        size_t length = (size_t)(number_end - token->text.data);
+        if (length >= sizeof(copy)) {
+            set_invalid(token, "number is too long");
+            return;
+        }
+        memcpy(copy, token->text.data, length);
+        copy[length] = '\0';
+        token->real_value = strtod(copy, NULL);
+    }
+}
+
+token_t next_token(tokenizer_t* tokenizer) {
+    while (tokenizer->current != tokenizer->end && is_space(*tokenizer->current)) {
+        ++tokenizer->current;
+    }
+
+    token_t token;
+    token.value_type = TYPE_INVALID;
+    token.integer_value = 0;
+    token.real_value = 0;
+    token.error = NULL;
+    token.text.data = tokenizer->current;
+    token.column = (size_t)(tokenizer->current - tokenizer->line) + 1;
+
+    if (tokenizer->current == tokenizer->end) {
+        token.token_type = TOKEN_END;
+        return token;
+    }
+
+    char c = *tokenizer->current;
+    if (is_digit(c) || c == '.') {
+        scan_number(tokenizer, &token);
+        return token;
+    }
+
+    if (is_identifier_start(c)) {
+        const char* current = tokenizer->current + 1;
+        while (current != tokenizer->end && is_identifier_character(*current)) {
+            ++current;
+        }
+        tokenizer->current = current;
+        token.text.length = (size_t)(current - token.text.data);
+
+        token.token_type = TOKEN_IDENTIFIER;
+        if (token.text.length == 3 && memcmp(token.text.data, "let", 3) == 0) {
+            token.token_type = TOKEN_LET;
+        } else if ((token.value_type = find_type(token.text.data, token.text.length)) != TYPE_INVALID) {
+            token.token_type = TOKEN_TYPE;
+        }
+        return token;
+    }
+
+    tokenizer->current += 1;
+    token.text.length = 1;
+    switch (c)
+    {
+        case ':': token.token_type = TOKEN_COLON; break;
+        case '=': token.token_type = TOKEN_EQUALS; break;
+        case ';': token.token_type = TOKEN_SEMICOLON; break;
+        case '+': token.token_type = TOKEN_PLUS; break;
+        case '-': token.token_type = TOKEN_MINUS; break;
+        case '*': token.token_type = TOKEN_MULTIPLY; break;
+        case '/': token.token_type = TOKEN_DIVIDE; break;
+        case '(': token.token_type = TOKEN_OPEN_PARENTHESIS; break;
+        case ')': token.token_type = TOKEN_CLOSE_PARENTHESIS; break;
+        default: set_invalid(&token, "unknown character"); break;
+    }
+    return token;
+}
@@ -0,0 +1,65 @@
+#ifndef INCLUDED_TOKENIZER_
+#define INCLUDED_TOKENIZER_
+
+#include "line_reader.h"
+#include "types.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Tokens of a line like `let a : i32 = 2 * (b + 1.5r32);`. A token refers to its text in
+// the line instead of copying it. Type names are the ones from internal_type_strings, and a
+// number can carry one as a suffix (42u8, 1.5r32); without a suffix it is an i64, or an
+// r64 if it has a decimal point.
+
+typedef enum token_type_t
+{
+    TOKEN_END,
+    TOKEN_INVALID,
+    TOKEN_LET,
+    TOKEN_IDENTIFIER,
+    TOKEN_TYPE,
+    TOKEN_NUMBER,
+    TOKEN_COLON,
+    TOKEN_EQUALS,
+    TOKEN_SEMICOLON,
+    TOKEN_PLUS,
+    TOKEN_MINUS,
+    TOKEN_MULTIPLY,
+    TOKEN_DIVIDE,
+    TOKEN_OPEN_PARENTHESIS,
+    TOKEN_CLOSE_PARENTHESIS,
+    TOKEN_TYPE_COUNT
+} token_type_t;
+
+typedef struct token_t
+{
+    token_type_t token_type;
+    span_t text;
+    size_t column; // counts from 1.
+
+    // TOKEN_TYPE: the type. TOKEN_NUMBER: the type of the number, and its value in
+    // integer_value or real_value.
+    enum internal_types value_type;
+    uint64_t integer_value;
+    double real_value;
+
+    const char* error; // TOKEN_INVALID: what is wrong.
+} token_t;
+
+typedef struct tokenizer_t
+{
+    const char* line;
+    const char* current;
+    const char* end;
+} tokenizer_t;
+
+void tokenizer_init(tokenizer_t* tokenizer, span_t line);
+
+// next_token - TOKEN_END at the end of the line. after a TOKEN_INVALID, the tokenizer
+// carries on after the offending text.
+token_t next_token(tokenizer_t* tokenizer);
+
+const char* token_type_name(token_type_t token_type);
+
+#endif
@@ -1,3 +1,6 @@
+#ifndef INCLUDED_TYPES_
+#define INCLUDED_TYPES_
+
 enum internal_types
 {
 	TYPE_INVALID = 0,
@@ -11,19 +14,24 @@ enum internal_types
 	TYPE_I64,
 	TYPE_R32,
 	TYPE_R64,
+	TYPE_BOOL,
 	TYPE_ELEMENT_COUNT
 };
 
-const char* internal_type_strings[TYPE_ELEMENT_COUNT] = {
-  	[TYPE_INVALID] ="TYPE_ERROR",
-	[TYPE_U8] = "u8",
-	[TYPE_U16] = "u16",
-	[TYPE_U32] = "u32",
-	[TYPE_U64] = "u64",
-	[TYPE_I8] = "i8",
-	[TYPE_I16] = "i16",
-	[TYPE_I32] = "i32",
-	[TYPE_I64] = "i64",
-	[TYPE_R32] = "r32",
-	[TYPE_R64] = "r64"
-};
\ No newline at end of file
+// in enum order. no designated initializers, so C++ can include this too.
+static const char* const internal_type_strings[TYPE_ELEMENT_COUNT] = {
+	"TYPE_ERROR",
+	"u8",
+	"u16",
+	"u32",
+	"u64",
+	"i8",
+	"i16",
+	"i32",
+	"i64",
+	"r32",
+	"r64",
+	"bool"
+};
+
+#endif
@@ -2,6 +2,12 @@
 #include <cstdint>
 #include <string>
 #include <cassert>
+#include <cstring>
+#include <vector>
+#include <unordered_map>
+#include <chrono>
+
+#include "constexpr_formula.h"
 
 enum token_type_t
 {
@@ -10,6 +16,7 @@ enum token_type_t
     TOKEN_MINUS,
     TOKEN_DIVIDE,
     TOKEN_MULTIPLY,
+    TOKEN_VARIABLE,
     TOKEN_END
 };
 
@@ -18,6 +25,7 @@ struct token_t
     token_type_t token_type;
     double value;
     char my_operator;
+    uint8_t variable_index = 0; // for TOKEN_VARIABLE: a = 0, b = 1, ... z = 25.
 };
 
 struct tokenizer_t
@@ -57,6 +65,13 @@ token_t next_token(tokenizer_t& tokenizer)
         return token_t{TOKEN_NUMBER, strtod(&input[start], NULL), 0};
     }
 
+    // single letter variables, these are the inputs of the formula.
+    if (current >= 'a' && current <= 'z')
+    {
+        tokenizer.position = position + 1;
+        return token_t{TOKEN_VARIABLE, 0, 0, uint8_t(current - 'a')};
+    }
+
     tokenizer.position = position + 1; // start from this position next time.
     switch (current)
     {
@@ -94,6 +109,7 @@ struct parser_t
 enum node_type
 {
     NODE_TYPE_NUMBER,
+    NODE_TYPE_VARIABLE,
     NODE_TYPE_BINARY_OP
 };
 
@@ -110,6 +126,7 @@ struct node_t {
     union data_t
     {
         double value;
+        uint8_t variable_index;
         binary_operator_data_t binary_operator_data;
     };
 
@@ -121,6 +138,8 @@ struct node_t {
 void print_node(node_t* node) {
     if (node->type == NODE_TYPE_NUMBER) {
         printf("%f", node->data.value);
+    } else if (node->type == NODE_TYPE_VARIABLE) {
+        printf("%c", 'a' + node->data.variable_index);
     } else if (node->type == NODE_TYPE_BINARY_OP) {
         printf("(");
         print_node(node->data.binary_operator_data.lhs);
@@ -153,6 +172,16 @@ node_t* create_number_node(double value)
 }
 
 
+// these are just constructors
+node_t* create_variable_node(uint8_t variable_index)
+{
+    node_t* variable_node = new node_t{};
+    variable_node->type = NODE_TYPE_VARIABLE;
+    variable_node->data.variable_index = variable_index;
+    return variable_node;
+}
+
+
 // these are just constructors
 node_t*  create_binary_operator_node(char my_operator, node_t* lhs, node_t* rhs)
 {
@@ -168,7 +197,8 @@ node_t*  create_binary_operator_node(char my_operator, node_t* lhs, node_t* rhs)
 
 // <expression>    ::= <term> { ("+" | "-") <term> }
 // <term>          ::= <factor> { ("*" | "/") <factor> }
-// <factor>        ::= <number> | "(" <expression> ")"
+// <factor>        ::= <number> | <variable> | "(" <expression> ")"
+// <variable>      ::= "a" | "b" | ... | "z"
 // <number>        ::= <digit> { <digit> } [ "." <digit> { <digit> } ]
 // <digit>         ::= "0" | "1" | "2" | "3" | "4" | "5" | "6" | "7" | "8" | "9"
 
@@ -184,6 +214,13 @@ node_t* parse_factor(parser_t& parser)
         return node;
     };
 
+    if (parser.current_token.token_type == TOKEN_VARIABLE)
+    {
+        node_t* node = create_variable_node(parser.current_token.variable_index);
+        parser.current_token = next_token(parser.tokenizer);
+        return node;
+    }
+
     assert(false && "tried to find a number but could not find any.\n");
     return nullptr;
 }
@@ -217,26 +254,356 @@ node_t* parse_expression(parser_t& parser)
 }
 
 
-int main()
+node_t* parse_formula(const std::string& formula)
 {
-    auto string_to_parse = std::string{"1 + 2 * 3 + 4"};
-
     auto parser = parser_t{
         .tokenizer = tokenizer_t{
-            .input = string_to_parse,
+            .input = formula,
             .position = std::size_t{0}
         },
         .current_token = {}
     };
     parser.current_token = next_token(parser.tokenizer);
 
-    node_t* root_node = parse_expression(parser);
+    return parse_expression(parser);
+}
+
+
+// formulas that are known when we compile can be parsed (and folded) by the compiler
+// instead, see constexpr_formula.h. a malformed one, like parse_formula("1 +"), doesn't
+// compile.
+static_assert(constexpr_formula::parse_formula("1 + 2 * 3 + 4").evaluate() == 11, "* binds tighter than +");
+static_assert(constexpr_formula::parse_formula("8 - 2 - 1").evaluate() == 5, "- is left associative");
+static_assert(constexpr_formula::parse_formula("8 / 4 / 2").evaluate() == 1, "/ is left associative");
+static_assert(constexpr_formula::parse_formula("(1 + 2) * 3").evaluate() == 9, "parentheses group");
+static_assert(constexpr_formula::parse_formula("0.1 + 0.2").evaluate() == 0.1 + 0.2, "numbers read like strtod does");
+static_assert(constexpr_formula::parse_formula("2 * 3 * a").node_count == 3, "constant operands are folded");
+static_assert(constexpr_formula::parse_formula("a * b + c").input_count == 3, "inputs are counted");
+
+
+// the straightforward way: walk the tree for every evaluation.
+double evaluate_node(node_t* node, const double* inputs)
+{
+    switch (node->type)
+    {
+        case NODE_TYPE_NUMBER:   return node->data.value;
+        case NODE_TYPE_VARIABLE: return inputs[node->data.variable_index];
+        case NODE_TYPE_BINARY_OP:
+        {
+            double lhs = evaluate_node(node->data.binary_operator_data.lhs, inputs);
+            double rhs = evaluate_node(node->data.binary_operator_data.rhs, inputs);
+            switch (node->data.binary_operator_data.my_operator)
+            {
+                case '+': return lhs + rhs;
+                case '-': return lhs - rhs;
+                case '*': return lhs * rhs;
+                default:  return lhs / rhs;
+            }
+        }
+    }
+
+    return 0;
+}
+
+
+// Register bytecode.
+// every instruction is 4 bytes: an opcode, a destination register and two operands. the
+// operands are registers, except for OP_LOAD_CONSTANT (index into the constant pool) and
+// OP_LOAD_INPUT (index into the inputs). binary operators have variants that take the
+// right hand side straight from the constants or the inputs, since that is where most
+// right hand sides come from and it saves a load per operator.
+enum opcode_t : uint8_t
+{
+    OP_LOAD_CONSTANT,
+    OP_LOAD_INPUT,
+    OP_ADD, OP_SUBTRACT, OP_MULTIPLY, OP_DIVIDE,                 // r[dst] = r[a] op r[b]
+    OP_ADD_CONSTANT, OP_SUBTRACT_CONSTANT, OP_MULTIPLY_CONSTANT, OP_DIVIDE_CONSTANT, // r[dst] = r[a] op constants[b]
+    OP_ADD_INPUT, OP_SUBTRACT_INPUT, OP_MULTIPLY_INPUT, OP_DIVIDE_INPUT,             // r[dst] = r[a] op inputs[b]
+    OP_RETURN,                                                   // return r[a]
+    OP_COUNT
+};
+
+struct instruction_t
+{
+    opcode_t opcode;
+    uint8_t destination;
+    uint8_t a;
+    uint8_t b;
+};
+
+struct bytecode_t
+{
+    std::vector<instruction_t> instructions;
+    std::vector<double> constants;
+    uint8_t register_count;
+    uint8_t input_count; // highest variable index + 1.
+};
+
+constexpr size_t max_registers = 256;
+
+
+uint8_t add_constant(bytecode_t& bytecode, double value)
+{
+    for (size_t idx = 0; idx != bytecode.constants.size(); ++idx)
+    {
+        if (memcmp(&bytecode.constants[idx], &value, sizeof(double)) == 0) return uint8_t(idx);
+    }
+
+    assert(bytecode.constants.size() < 256 && "too many constants in one formula.\n");
+    bytecode.constants.push_back(value);
+    return uint8_t(bytecode.constants.size() - 1);
+}
+
+void emit(bytecode_t& bytecode, opcode_t opcode, uint8_t destination, uint8_t a, uint8_t b)
+{
+    bytecode.instructions.push_back(instruction_t{opcode, destination, a, b});
+}
+
+opcode_t operator_opcode(char my_operator, opcode_t add_variant)
+{
+    // the four variants of each group are in + - * / order.
+    switch (my_operator)
+    {
+        case '+': return opcode_t(add_variant + 0);
+        case '-': return opcode_t(add_variant + 1);
+        case '*': return opcode_t(add_variant + 2);
+        default:  return opcode_t(add_variant + 3);
+    }
+}
+
+bool is_constant_node(node_t* node)
+{
+    if (node->type == NODE_TYPE_BINARY_OP)
+    {
+        return is_constant_node(node->data.binary_operator_data.lhs) && is_constant_node(node->data.binary_operator_data.rhs);
+    }
+
+    return node->type == NODE_TYPE_NUMBER;
+}
+
+// compile node so that its value ends up in register `target`. registers above target are
+// free to use, so the register count is just the depth of the tree (minus the leaves).
+void compile_node(bytecode_t& bytecode, node_t* node, uint8_t target)
+{
+    assert(target < max_registers && "formula is nested too deeply.\n");
+    if (target + 1 > bytecode.register_count) bytecode.register_count = target + 1;
+
+    switch (node->type)
+    {
+        case NODE_TYPE_NUMBER:
+        {
+            emit(bytecode, OP_LOAD_CONSTANT, target, add_constant(bytecode, node->data.value), 0);
+            return;
+        }
+        case NODE_TYPE_VARIABLE:
+        {
+            uint8_t index = node->data.variable_index;
+            if (index + 1 > bytecode.input_count) bytecode.input_count = index + 1;
+            emit(bytecode, OP_LOAD_INPUT, target, index, 0);
+            return;
+        }
+        case NODE_TYPE_BINARY_OP:
+        {
+            auto& binary = node->data.binary_operator_data;
+
+            // fold constant subtrees right here.
+            if (is_constant_node(node))
+            {
+                double inputs_unused[1] = {};
+                emit(bytecode, OP_LOAD_CONSTANT, target, add_constant(bytecode, evaluate_node(node, inputs_unused)), 0);
+                return;
+            }
+
+            compile_node(bytecode, binary.lhs, target);
+
+            if (binary.rhs->type == NODE_TYPE_NUMBER)
+            {
+                uint8_t constant = add_constant(bytecode, binary.rhs->data.value);
+                emit(bytecode, operator_opcode(binary.my_operator, OP_ADD_CONSTANT), target, target, constant);
+            }
+            else if (binary.rhs->type == NODE_TYPE_VARIABLE)
+            {
+                uint8_t index = binary.rhs->data.variable_index;
+                if (index + 1 > bytecode.input_count) bytecode.input_count = index + 1;
+                emit(bytecode, operator_opcode(binary.my_operator, OP_ADD_INPUT), target, target, index);
+            }
+            else
+            {
+                compile_node(bytecode, binary.rhs, target + 1);
+                emit(bytecode, operator_opcode(binary.my_operator, OP_ADD), target, target, target + 1);
+            }
+            return;
+        }
+    }
+}
+
+bytecode_t compile_bytecode(node_t* root_node)
+{
+    bytecode_t bytecode = {};
+    compile_node(bytecode, root_node, 0);
+    emit(bytecode, OP_RETURN, 0, 0, 0);
+    return bytecode;
+}
+
+
+// the vm. with GCC/clang we use computed gotos (every handler jumps straight to the next
+// one, which gives the branch predictor one indirect jump per handler to learn instead of
+// a single shared switch); otherwise a plain switch.
+double run_bytecode(const bytecode_t& bytecode, const double* inputs)
+{
+    double registers[max_registers];
+    const instruction_t* ip = bytecode.instructions.data();
+    const double* constants = bytecode.constants.data();
+
+#if defined(__GNUC__)
+    static void* dispatch_table[OP_COUNT] = {
+        &&op_load_constant, &&op_load_input,
+        &&op_add, &&op_subtract, &&op_multiply, &&op_divide,
+        &&op_add_constant, &&op_subtract_constant, &&op_multiply_constant, &&op_divide_constant,
+        &&op_add_input, &&op_subtract_input, &&op_multiply_input, &&op_divide_input,
+        &&op_return
+    };
+
+    #define DISPATCH() goto *dispatch_table[ip->opcode]
+    #define CASE(label) label:
+    #define NEXT() ++ip; DISPATCH()
+
+    DISPATCH();
+#else
+    #define CASE(label) case label##_opcode:
+    #define NEXT() ++ip; continue
+    // map the labels back onto the opcodes for the switch version.
+    enum {
+        op_load_constant_opcode = OP_LOAD_CONSTANT, op_load_input_opcode = OP_LOAD_INPUT,
+        op_add_opcode = OP_ADD, op_subtract_opcode = OP_SUBTRACT, op_multiply_opcode = OP_MULTIPLY, op_divide_opcode = OP_DIVIDE,
+        op_add_constant_opcode = OP_ADD_CONSTANT, op_subtract_constant_opcode = OP_SUBTRACT_CONSTANT,
+        op_multiply_constant_opcode = OP_MULTIPLY_CONSTANT, op_divide_constant_opcode = OP_DIVIDE_CONSTANT,
+        op_add_input_opcode = OP_ADD_INPUT, op_subtract_input_opcode = OP_SUBTRACT_INPUT,
+        op_multiply_input_opcode = OP_MULTIPLY_INPUT, op_divide_input_opcode = OP_DIVIDE_INPUT,
+        op_return_opcode = OP_RETURN
+    };
+    while (true) switch (ip->opcode) {
+#endif
+
+    CASE(op_load_constant)     registers[ip->destination] = constants[ip->a]; NEXT();
+    CASE(op_load_input)        registers[ip->destination] = inputs[ip->a]; NEXT();
+    CASE(op_add)               registers[ip->destination] = registers[ip->a] + registers[ip->b]; NEXT();
+    CASE(op_subtract)          registers[ip->destination] = registers[ip->a] - registers[ip->b]; NEXT();
+    CASE(op_multiply)          registers[ip->destination] = registers[ip->a] * registers[ip->b]; NEXT();
+    CASE(op_divide)            registers[ip->destination] = registers[ip->a] / registers[ip->b]; NEXT();
+    CASE(op_add_constant)      registers[ip->destination] = registers[ip->a] + constants[ip->b]; NEXT();
+    CASE(op_subtract_constant) registers[ip->destination] = registers[ip->a] - constants[ip->b]; NEXT();
+    CASE(op_multiply_constant) registers[ip->destination] = registers[ip->a] * constants[ip->b]; NEXT();
+    CASE(op_divide_constant)   registers[ip->destination] = registers[ip->a] / constants[ip->b]; NEXT();
+    CASE(op_add_input)         registers[ip->destination] = registers[ip->a] + inputs[ip->b]; NEXT();
+    CASE(op_subtract_input)    registers[ip->destination] = registers[ip->a] - inputs[ip->b]; NEXT();
+    CASE(op_multiply_input)    registers[ip->destination] = registers[ip->a] * inputs[ip->b]; NEXT();
+    CASE(op_divide_input)      registers[ip->destination] = registers[ip->a] / inputs[ip->b]; NEXT();
+    CASE(op_return)            return registers[ip->a];
+
+#if !defined(__GNUC__)
+    }
+#endif
+
+    #undef CASE
+    #undef NEXT
+    #undef DISPATCH
+}
+
+
+// parsing and compiling is only done once per formula string.
+std::unordered_map<std::string, bytecode_t> bytecode_cache;
+
+const bytecode_t& get_bytecode(const std::string& formula)
+{
+    auto it = bytecode_cache.find(formula);
+    if (it != bytecode_cache.end()) return it->second;
+
+    node_t* root_node = parse_formula(formula);
+    bytecode_t bytecode = compile_bytecode(root_node);
+    free_node(root_node);
+
+    return bytecode_cache.emplace(formula, std::move(bytecode)).first->second;
+}
+
+
+// tree walking vs the vm over the same formula with changing inputs.
+void run_benchmark(const std::string& formula, size_t iteration_count)
+{
+    node_t* root_node = parse_formula(formula);
+    const bytecode_t& bytecode = get_bytecode(formula);
+
+    double inputs[26] = {};
+    double tree_sum = 0;
+    double vm_sum = 0;
+
+    auto tree_start = std::chrono::steady_clock::now();
+    for (size_t idx = 0; idx != iteration_count; ++idx)
+    {
+        for (size_t input = 0; input != 26; ++input) inputs[input] = double(idx + input);
+        tree_sum += evaluate_node(root_node, inputs);
+    }
+    auto tree_end = std::chrono::steady_clock::now();
+
+    for (size_t idx = 0; idx != iteration_count; ++idx)
+    {
+        for (size_t input = 0; input != 26; ++input) inputs[input] = double(idx + input);
+        vm_sum += run_bytecode(bytecode, inputs);
+    }
+    auto vm_end = std::chrono::steady_clock::now();
+
+    double tree_ns = std::chrono::duration<double, std::nano>(tree_end - tree_start).count() / iteration_count;
+    double vm_ns = std::chrono::duration<double, std::nano>(vm_end - tree_end).count() / iteration_count;
+
+    printf("%s\n", formula.c_str());
+    printf("  %zu instructions, %zu constants, %d registers\n", bytecode.instructions.size(), bytecode.constants.size(), bytecode.register_count);
+    printf("  tree walk: %6.2f ns/eval\n", tree_ns);
+    printf("  bytecode:  %6.2f ns/eval (%.2fx)\n", vm_ns, tree_ns / vm_ns);
+
+    if (tree_sum != vm_sum) printf("  MISMATCH: %f vs %f\n", tree_sum, vm_sum);
 
-    print_node(root_node);
     free_node(root_node);
+}
+
 
+// the same, for a formula the compiler parsed.
+template <size_t capacity>
+void run_constexpr_benchmark(const constexpr_formula::formula_t<capacity>& formula, size_t iteration_count)
+{
+    double inputs[26] = {};
+    double sum = 0;
 
+    auto start = std::chrono::steady_clock::now();
+    for (size_t idx = 0; idx != iteration_count; ++idx)
+    {
+        for (size_t input = 0; input != 26; ++input) inputs[input] = double(idx + input);
+        sum += formula.evaluate(inputs);
+    }
+    auto end = std::chrono::steady_clock::now();
 
+    double ns = std::chrono::duration<double, std::nano>(end - start).count() / iteration_count;
+    printf("  constexpr: %6.2f ns/eval (%zu nodes, sum %f)\n", ns, formula.node_count, sum);
+}
 
 
+int main(int argc, char* argv[])
+{
+    if (argc > 1 && strcmp(argv[1], "--bench") == 0)
+    {
+        size_t iteration_count = argc > 2 ? strtoull(argv[2], NULL, 10) : 10000000;
+        run_benchmark("1 + 2 * 3 + 4", iteration_count);
+        run_benchmark("a * b + c * d - e / 2", iteration_count);
+        constexpr auto formula = constexpr_formula::parse_formula("a * b + c * d - e / 2");
+        run_constexpr_benchmark(formula, iteration_count);
+        run_benchmark("a * 2 + b * 3 * c - d / e + f * g * h - 1 * i + j / 4 - k * l * m + n", iteration_count);
+        return 0;
+    }
+
+    auto string_to_parse = std::string{"1 + 2 * 3 + 4"};
+
+    node_t* root_node = parse_formula(string_to_parse);
+
+    print_node(root_node);
+    printf(" = %f\n", run_bytecode(get_bytecode(string_to_parse), nullptr));
+    free_node(root_node);
 }
\ No newline at end of file